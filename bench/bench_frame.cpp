@@ -0,0 +1,379 @@
+/**
+ *  \file bench_frame.cpp
+ *  \brief Frame loop benchmark for the n-Blocks Studio kernel
+ *
+ *  \details Generates synthetic graphs of nBlockSimpleNode subclasses and
+ *  nBlockConnections, runs them through ProgressNodes() on the host
+ *  backend and reports the cost of a frame as the graph grows:
+ *    - chain:   n nodes connected in series (n-1 connections)
+ *    - fanout:  one source output connected to n-1 sinks
+ *    - diamond: repeated split/join DAG, one split node feeding
+ *               BENCH_DIAMOND_WIDTH branches which all feed one join node
+ *  Each topology is measured for all four nBlocks_OutputType values.
+ *
+ *  Reported figures:
+ *    - ns/frame: average time of one frame
+ *    - ns/node:  average cost of stepping one node, measured on the same
+ *                nodes without any connection
+ *    - ns/conn:  remaining frame time divided by the number of connections
+ *    - max@period: largest node count whose frame fits the given period
+ *
+ *  Nodes and connections live as long as the process, and builds with
+ *  NBLOCKS_PROFILE or NBLOCKS_TRACE only instrument the default
+ *  workbench, so a fresh nWorkbench per graph would leak every graph
+ *  and lose the instrumentation. Instead, each measurement builds its
+ *  graph in the default workbench of a forked child process, which
+ *  reports back through a pipe.
+ *
+ *  Build and run from the repository root:
+ *
+ *      g++ -Ihost -I. -O2 bench/bench_frame.cpp nworkbench.cpp \
+ *          nprofile.cpp nexecutor.cpp host/mbed_host.cpp -pthread -o bench_frame
+ *      ./bench_frame [--frames N] [--period-us P] [--fire-every K] [--topological] [--threads T] [--batched] [--typed] [--quick]
+ */
+
+#include "nworkbench.h"
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define BENCH_TICK_PIN P0_0
+#define BENCH_DIAMOND_WIDTH 4
+#define BENCH_ARRAY_LENGTH 8
+
+enum bench_Topology {
+    TOPOLOGY_NONE,
+    TOPOLOGY_CHAIN,
+    TOPOLOGY_FANOUT,
+    TOPOLOGY_DIAMOND
+};
+
+static const char * topology_names[] = { "none", "chain", "fanout", "diamond" };
+static const char * type_names[] = { "int", "string", "float", "array" };
+
+// Frames between two outputs of every node (1 = every frame)
+static uint32_t bench_fire_every = 1;
+
+// Schedule mode for all measurements
+static nBlocks_ScheduleModes bench_schedule = KERNEL_SCHEDULE_STAGED;
+// Threads of the parallel frame stages
+static uint32_t bench_threads = 1;
+// Nodes receive their inputs through triggerInputs() overrides
+static uint32_t bench_batched = 0;
+// Graphs use nBlockTypedConnection
+static uint32_t bench_typed = 0;
+
+// Sink for received data, so the compiler can't drop the receiving code
+static volatile uint32_t bench_sink = 0;
+
+static char bench_string[] = "n-Blocks benchmark";
+static uint32_t bench_array[BENCH_ARRAY_LENGTH] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+/**
+ *  \brief Node with one output of a given type, which outputs data every
+ *  bench_fire_every frames and consumes whatever it receives
+ */
+class BenchNode: public nBlockSimpleNode<1> {
+public:
+    BenchNode(nBlocks_OutputType type) {
+        outputType[0] = type;
+        _frame = 0;
+        _accumulator = 0;
+    }
+
+    void triggerInput(nBlocks_Message message) {
+        receive(message);
+    }
+
+    void endFrame(void) {
+        _frame++;
+        if ((_frame % bench_fire_every) != 0) return;
+        switch (outputType[0]) {
+            case OUTPUT_TYPE_INT:
+                output[0] = _accumulator + _frame;
+                available[0] = 1;
+                break;
+            case OUTPUT_TYPE_FLOAT:
+                output[0] = PackFloat((float)(_frame) * 0.5f);
+                available[0] = 1;
+                break;
+            case OUTPUT_TYPE_STRING:
+                output[0] = (nBlocks_Handle)(uintptr_t)(bench_string);
+                available[0] = sizeof(bench_string) - 1;
+                break;
+            case OUTPUT_TYPE_ARRAY:
+                output[0] = (nBlocks_Handle)(uintptr_t)(bench_array);
+                available[0] = BENCH_ARRAY_LENGTH;
+                break;
+            default:
+                break;
+        }
+        bench_sink = _accumulator;
+    }
+
+protected:
+    inline void receive(const nBlocks_Message & message) {
+        switch (message.dataType) {
+            case OUTPUT_TYPE_INT:
+                _accumulator += message.intValue;
+                break;
+            case OUTPUT_TYPE_FLOAT:
+                _accumulator += (uint32_t)(message.floatValue);
+                break;
+            case OUTPUT_TYPE_STRING:
+                _accumulator += (uint32_t)(message.stringValue[0]);
+                break;
+            case OUTPUT_TYPE_ARRAY:
+                _accumulator += ((uint32_t *)(uintptr_t)(message.pointerValue))[message.dataLength - 1];
+                break;
+            default:
+                break;
+        }
+    }
+
+private:
+    uint32_t _frame;
+    uint32_t _accumulator;
+};
+
+/**
+ *  \brief BenchNode taking all its inputs of a frame in one call
+ */
+class BatchedBenchNode: public BenchNode {
+public:
+    BatchedBenchNode(nBlocks_OutputType type): BenchNode(type) { }
+
+    void triggerInputs(const nBlocks_Message * messages, uint32_t count) {
+        uint32_t i;
+        for (i=0; i<count; i++) receive(messages[i]);
+    }
+};
+
+/**
+ *  \brief Typed connection from output 0 to input 0 to 3 of Node objects
+ */
+template <typename Node>
+static void ConnectTyped(BenchNode * src, BenchNode * dst, uint32_t input) {
+    switch (input) {
+        case 0: new nBlockTypedConnection<Node, 0, Node, 0>(static_cast<Node *>(src), static_cast<Node *>(dst)); break;
+        case 1: new nBlockTypedConnection<Node, 0, Node, 1>(static_cast<Node *>(src), static_cast<Node *>(dst)); break;
+        case 2: new nBlockTypedConnection<Node, 0, Node, 2>(static_cast<Node *>(src), static_cast<Node *>(dst)); break;
+        default: new nBlockTypedConnection<Node, 0, Node, 3>(static_cast<Node *>(src), static_cast<Node *>(dst)); break;
+    }
+}
+
+/**
+ *  \brief Connects output 0 of src to an input of dst
+ */
+static void Connect(BenchNode * src, BenchNode * dst, uint32_t input) {
+    if (bench_typed == 0) new nBlockConnection(src, 0, dst, input);
+    else if (bench_batched) ConnectTyped<BatchedBenchNode>(src, dst, input);
+    else ConnectTyped<BenchNode>(src, dst, input);
+}
+
+/**
+ *  \brief Builds a graph with num_nodes nodes in the given topology
+ *
+ *  \return Number of connections created
+ */
+static uint32_t BuildGraph(bench_Topology topology, nBlocks_OutputType type, uint32_t num_nodes) {
+    BenchNode ** nodes = new BenchNode * [num_nodes];
+    uint32_t connections = 0;
+    uint32_t i, j;
+
+    for (i=0; i<num_nodes; i++) {
+        if (bench_batched) nodes[i] = new BatchedBenchNode(type);
+        else nodes[i] = new BenchNode(type);
+    }
+
+    switch (topology) {
+        case TOPOLOGY_NONE:
+            break;
+
+        case TOPOLOGY_CHAIN:
+            for (i=1; i<num_nodes; i++) {
+                Connect(nodes[i-1], nodes[i], 0);
+                connections++;
+            }
+            break;
+
+        case TOPOLOGY_FANOUT:
+            for (i=1; i<num_nodes; i++) {
+                Connect(nodes[0], nodes[i], 0);
+                connections++;
+            }
+            break;
+
+        case TOPOLOGY_DIAMOND:
+            // Node 0 splits, the next BENCH_DIAMOND_WIDTH nodes are the
+            // branches, and the node after them joins and splits again
+            i = 0;
+            while ((i + BENCH_DIAMOND_WIDTH + 1) < num_nodes) {
+                for (j=1; j<=BENCH_DIAMOND_WIDTH; j++) {
+                    Connect(nodes[i], nodes[i+j], 0);
+                    Connect(nodes[i+j], nodes[i+BENCH_DIAMOND_WIDTH+1], j-1);
+                    connections += 2;
+                }
+                i += BENCH_DIAMOND_WIDTH + 1;
+            }
+            break;
+    }
+
+    delete[] nodes;
+    return connections;
+}
+
+typedef struct bench_Result {
+    double ns_per_frame;
+    uint32_t connections;
+    uint32_t frames;
+} bench_Result;
+
+/**
+ *  \brief Builds and runs one graph. Must run in a fresh process.
+ */
+static bench_Result RunGraph(bench_Topology topology, nBlocks_OutputType type, uint32_t num_nodes, uint32_t frames) {
+    bench_Result result;
+    uint32_t i, processed;
+    uint64_t start;
+
+    result.connections = BuildGraph(topology, type, num_nodes);
+
+    KernelTickSource(KERNEL_TICK_EXT, BENCH_TICK_PIN);
+    KernelScheduleMode(bench_schedule);
+    KernelParallelStages(bench_threads);
+    SetupWorkbench();
+
+    // Warm up caches and branch predictors
+    for (i=0; i<16; i++) HostPulsePin(BENCH_TICK_PIN);
+    ProgressNodes();
+
+    // Queue all ticks first so only ProgressNodes() is timed
+    for (i=0; i<frames; i++) HostPulsePin(BENCH_TICK_PIN);
+    start = HostTimeNs();
+    processed = ProgressNodes();
+    result.ns_per_frame = (double)(HostTimeNs() - start) / (double)(processed ? processed : 1);
+    result.frames = processed;
+    return result;
+}
+
+/**
+ *  \brief Runs RunGraph() in a child process and collects its result
+ */
+static bench_Result Measure(bench_Topology topology, nBlocks_OutputType type, uint32_t num_nodes, uint32_t frames) {
+    bench_Result result;
+    int fds[2];
+    pid_t pid;
+
+    memset(&result, 0, sizeof(result));
+    if (pipe(fds) != 0) return result;
+
+    pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        result = RunGraph(topology, type, num_nodes, frames);
+        if (write(fds[1], &result, sizeof(result)) != (ssize_t)sizeof(result)) _exit(1);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], &result, sizeof(result)) != (ssize_t)sizeof(result)) memset(&result, 0, sizeof(result));
+    close(fds[0]);
+    waitpid(pid, 0, 0);
+    return result;
+}
+
+/**
+ *  \brief Frame count for a probe, reduced for big graphs so each probe
+ *  takes roughly the same time
+ */
+static uint32_t ProbeFrames(uint32_t num_nodes, uint32_t frames) {
+    uint32_t limit = 20000000u / num_nodes;
+    if (limit < 50) limit = 50;
+    return (frames < limit) ? frames : limit;
+}
+
+/**
+ *  \brief Finds the largest node count whose frame fits in period_ns
+ */
+static uint32_t MaxNodesForPeriod(bench_Topology topology, nBlocks_OutputType type, double period_ns, uint32_t frames) {
+    uint32_t low = 0;
+    uint32_t high = 16;
+    uint32_t mid;
+
+    // Grow until the period is exceeded
+    while (Measure(topology, type, high, ProbeFrames(high, frames)).ns_per_frame <= period_ns) {
+        low = high;
+        high *= 2;
+        if (high > (1u << 20)) return low;
+    }
+    // Then bisect down to 1% of the bound
+    while ((high - low) > ((low / 100) + 1)) {
+        mid = low + ((high - low) / 2);
+        if (Measure(topology, type, mid, ProbeFrames(mid, frames)).ns_per_frame <= period_ns) low = mid;
+        else high = mid;
+    }
+    return low;
+}
+
+int main(int argc, char ** argv) {
+    uint32_t frames = 2000;
+    double period_us = 1000.0;
+    int quick = 0;
+    int i, t, y;
+
+    static const uint32_t sizes[] = { 16, 64, 150, 512, 2048 };
+    static const bench_Topology topologies[] = { TOPOLOGY_CHAIN, TOPOLOGY_FANOUT, TOPOLOGY_DIAMOND };
+    static const nBlocks_OutputType types[] = { OUTPUT_TYPE_INT, OUTPUT_TYPE_STRING, OUTPUT_TYPE_FLOAT, OUTPUT_TYPE_ARRAY };
+
+    for (i=1; i<argc; i++) {
+        if ((strcmp(argv[i], "--frames") == 0) && (i+1 < argc)) frames = (uint32_t)atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--period-us") == 0) && (i+1 < argc)) period_us = atof(argv[++i]);
+        else if ((strcmp(argv[i], "--fire-every") == 0) && (i+1 < argc)) bench_fire_every = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--topological") == 0) bench_schedule = KERNEL_SCHEDULE_TOPOLOGICAL;
+        else if ((strcmp(argv[i], "--threads") == 0) && (i+1 < argc)) bench_threads = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--batched") == 0) bench_batched = 1;
+        else if (strcmp(argv[i], "--typed") == 0) bench_typed = 1;
+        else if (strcmp(argv[i], "--quick") == 0) quick = 1;
+        else {
+            printf("usage: %s [--frames N] [--period-us P] [--fire-every K] [--topological] [--threads T] [--batched] [--typed] [--quick]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (frames == 0) frames = 1;
+    if (bench_fire_every == 0) bench_fire_every = 1;
+
+    printf("# frames=%u period=%.1fus fire-every=%u schedule=%s threads=%u batched=%u typed=%u\n", frames, period_us, bench_fire_every,
+        (bench_schedule == KERNEL_SCHEDULE_TOPOLOGICAL) ? "topological" : "staged", bench_threads, bench_batched, bench_typed);
+    printf("%-8s %-6s %6s %6s %12s %10s %10s\n", "topology", "type", "nodes", "conns", "ns/frame", "ns/node", "ns/conn");
+
+    for (t=0; t<3; t++) {
+        for (y=0; y<4; y++) {
+            for (i=0; i<(int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+                if (quick && (sizes[i] > 150)) continue;
+                bench_Result graph = Measure(topologies[t], types[y], sizes[i], frames);
+                bench_Result alone = Measure(TOPOLOGY_NONE, types[y], sizes[i], frames);
+                double ns_node = alone.ns_per_frame / (double)sizes[i];
+                double ns_conn = 0.0;
+                if (graph.connections > 0) {
+                    ns_conn = (graph.ns_per_frame - alone.ns_per_frame) / (double)graph.connections;
+                }
+                printf("%-8s %-6s %6u %6u %12.1f %10.2f %10.2f\n",
+                    topology_names[topologies[t]], type_names[types[y]],
+                    sizes[i], graph.connections, graph.ns_per_frame, ns_node, ns_conn);
+            }
+        }
+    }
+
+    if (!quick) {
+        printf("\n%-8s %-6s %12s\n", "topology", "type", "max@period");
+        for (t=0; t<3; t++) {
+            for (y=0; y<4; y++) {
+                printf("%-8s %-6s %12u\n", topology_names[topologies[t]], type_names[types[y]],
+                    MaxNodesForPeriod(topologies[t], types[y], period_us * 1000.0, frames));
+            }
+        }
+    }
+
+    return 0;
+}
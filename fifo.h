@@ -6,19 +6,218 @@
 #define FIFO_SIZE 256
 #define FIFO_TYPE uint32_t
 
-class fifo
+/*
+ *  Acquire/release accessors for the fifo indices. Aligned 32-bit loads
+ *  and stores are atomic on every supported target; these only add the
+ *  ordering between index updates and buffer contents.
+ */
+#if defined(__GNUC__)
+#define FIFO_LOAD_ACQUIRE(x)        __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define FIFO_STORE_RELEASE(x, v)    __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#else
+// Single-core Cortex-M: a data memory barrier is enough
+static inline uint32_t fifo_load_acquire(volatile uint32_t * x) { uint32_t v = *x; __DMB(); return v; }
+static inline void fifo_store_release(volatile uint32_t * x, uint32_t v) { __DMB(); *x = v; }
+#define FIFO_LOAD_ACQUIRE(x)        fifo_load_acquire(&(x))
+#define FIFO_STORE_RELEASE(x, v)    fifo_store_release(&(x), (v))
+#endif
+
+/**
+ *  \brief Template used by basic_fifo to set the element type and the
+ *  capacity (a power of two) at compile time.
+ */
+template <typename T, uint32_t N>
+
+/**
+ *  Single-producer/single-consumer ring buffer of N values of type T.
+ *
+ *  One context (e.g. a UART interrupt) may call put()/put_n() while
+ *  another one (e.g. the node's endFrame()) calls get()/get_n()/read(),
+ *  without locks or disabling interrupts. Indices run freely and are
+ *  masked with N-1, so no division is needed (the Cortex-M0 has no
+ *  divider). The fifo holds up to N values.
+ *
+ *  Nodes should size their fifos for their actual needs, e.g.
+ *  basic_fifo<uint8_t, 16> for a short byte stream.
+ *
+ *  Implementation code has to be in this file (instead of fifo.cpp)
+ *  due to use of the template feature.
+ */
+class basic_fifo
 {
-    FIFO_TYPE buffer[FIFO_SIZE];
-    uint32_t head, tail;
+    static_assert((N >= 2) && ((N & (N - 1)) == 0), "basic_fifo capacity must be a power of two");
+
+    T buffer[N];
+    // Written by the producer only
+    volatile uint32_t head;
+    // Written by the consumer only
+    volatile uint32_t tail;
 
 public:
-    fifo();
-    uint8_t put(FIFO_TYPE data);// returns 0 on success
-    uint8_t get(FIFO_TYPE* data);
-    uint8_t read(FIFO_TYPE* data);
-    uint32_t available();
-    uint32_t free();
+    basic_fifo() {
+        this->head = 0;
+        this->tail = 0;
+    }
+
+    /**
+     *  \brief Returns the number of values in the fifo
+     */
+    uint32_t available() {
+        // Free-running indices: the difference is the fill level, also
+        // across the 32-bit wrap
+        return FIFO_LOAD_ACQUIRE(this->head) - FIFO_LOAD_ACQUIRE(this->tail);
+    }
+
+    /**
+     *  \brief Returns the number of values that can still be put
+     */
+    uint32_t free() {
+        return (N - available());
+    }
+
+    /**
+     *  \brief Appends one value (producer side)
+     *
+     *  \return 0 on success, 1 if the fifo is full
+     */
+    uint8_t put(T data) {
+        uint32_t h = this->head;
+
+        // check if FIFO has room
+        if ((h - FIFO_LOAD_ACQUIRE(this->tail)) >= N) {
+            // full
+            return 1;
+        }
+
+        this->buffer[h & (N - 1)] = data;
+        // Publish the value only after it is stored
+        FIFO_STORE_RELEASE(this->head, h + 1);
+
+        return 0;
+    }
+
+    /**
+     *  \brief Copies the oldest value without removing it (consumer side)
+     *
+     *  \return 0 on success, 1 if the fifo is empty
+     */
+    uint8_t read(T* data) {
+        uint32_t t = this->tail;
+
+        // check if FIFO has data
+        if (FIFO_LOAD_ACQUIRE(this->head) == t) {
+            return 1; // FIFO empty
+        }
+
+        *data = this->buffer[t & (N - 1)];
+
+        return 0;
+    }
+
+    /**
+     *  \brief Removes the oldest value (consumer side)
+     *
+     *  \return 0 on success, 1 if the fifo is empty
+     */
+    uint8_t get(T* data) {
+        uint32_t t = this->tail;
+
+        // check if FIFO has data
+        if (FIFO_LOAD_ACQUIRE(this->head) == t) {
+            return 1; // FIFO empty
+        }
+
+        *data = this->buffer[t & (N - 1)];
+        // Release the slot only after the value is copied out
+        FIFO_STORE_RELEASE(this->tail, t + 1);
+
+        return 0;
+    }
+
+    /**
+     *  \brief Copies up to count values into the fifo (producer side)
+     *
+     *  \param [in] data Values to be written
+     *  \param [in] count Number of values in data
+     *  \return Number of values actually written, limited by free space
+     */
+    uint32_t put_n(const T* data, uint32_t count) {
+        uint32_t h = this->head;
+        uint32_t room = N - (h - FIFO_LOAD_ACQUIRE(this->tail));
+        uint32_t start, first;
+
+        if (count > room) count = room;
+        if (count == 0) return 0;
+
+        // At most two copies: up to the end of the buffer, then from the start
+        start = h & (N - 1);
+        first = N - start;
+        if (first > count) first = count;
+        memcpy(&(this->buffer[start]), data, first * sizeof(T));
+        memcpy(&(this->buffer[0]), data + first, (count - first) * sizeof(T));
+
+        FIFO_STORE_RELEASE(this->head, h + count);
+        return count;
+    }
+
+    /**
+     *  \brief Removes up to count values from the fifo (consumer side)
+     *
+     *  \param [out] data Buffer receiving the values
+     *  \param [in] count Maximum number of values to read
+     *  \return Number of values actually read
+     */
+    uint32_t get_n(T* data, uint32_t count) {
+        uint32_t t = this->tail;
+        uint32_t filled = FIFO_LOAD_ACQUIRE(this->head) - t;
+        uint32_t start, first;
+
+        if (count > filled) count = filled;
+        if (count == 0) return 0;
+
+        start = t & (N - 1);
+        first = N - start;
+        if (first > count) first = count;
+        memcpy(data, &(this->buffer[start]), first * sizeof(T));
+        memcpy(data + first, &(this->buffer[0]), (count - first) * sizeof(T));
+
+        FIFO_STORE_RELEASE(this->tail, t + count);
+        return count;
+    }
+
+    /**
+     *  \brief Gives direct access to the free space of the fifo, so the
+     *  producer can write values in place (e.g. a DMA or a parser) and
+     *  then publish them with commit().
+     *
+     *  \param [out] span Receives the address of the first free slot
+     *  \return Number of contiguous free slots starting at span, which
+     *  may be less than free() when the free space wraps around
+     */
+    uint32_t peek_span(T** span) {
+        uint32_t h = this->head;
+        uint32_t room = N - (h - FIFO_LOAD_ACQUIRE(this->tail));
+        uint32_t contiguous = N - (h & (N - 1));
+
+        *span = &(this->buffer[h & (N - 1)]);
+        return (room < contiguous) ? room : contiguous;
+    }
+
+    /**
+     *  \brief Publishes count values written in place after peek_span()
+     *
+     *  \param [in] count Number of values written, at most the value
+     *  returned by peek_span()
+     */
+    void commit(uint32_t count) {
+        FIFO_STORE_RELEASE(this->head, this->head + count);
+    }
 };
 
+/**
+ *  \brief The classic fifo: FIFO_SIZE values of FIFO_TYPE
+ */
+typedef basic_fifo<FIFO_TYPE, FIFO_SIZE> fifo;
+
 
 #endif /* FIFO_H_ */
@@ -0,0 +1,328 @@
+/**
+ *  \file mbed.h
+ *  \brief Host (Linux) replacement for the subset of the mbed HAL used by
+ *  the n-Blocks Studio kernel.
+ *
+ *  \details Allows nworkbench.cpp and node code to be compiled
+ *  unmodified on a POSIX host, so graphs can be run, tested and
+ *  benchmarked without flashing a board. Put this directory first in
+ *  the include path and link host/mbed_host.cpp with the kernel:
+ *
+ *      g++ -Ihost -I. -O2 main.cpp nworkbench.cpp \
+ *          nprofile.cpp nexecutor.cpp host/mbed_host.cpp -pthread
+ *
+ *  Provided classes:
+ *    - Ticker: periodic callback driven by a POSIX monotonic clock
+ *      (clock_nanosleep with absolute deadlines) in a dedicated thread,
+ *      which plays the role of the timer interrupt
+ *    - InterruptIn: software interrupt pin, edges are generated by
+ *      calling HostSetPin() (or fire()) from tests
+ *    - DigitalOut: output pin recording every write with a timestamp
+ *
+ *  After HostSimEnable(), time is virtual: tickers and scripted pin
+ *  stimuli fire from HostSimRun()/HostSimStep() in timestamp order, as
+ *  fast as the CPU allows, instead of from real-time threads.
+ */
+
+#ifndef _NBLOCKS_HOST_MBED_H
+#define _NBLOCKS_HOST_MBED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define TARGET_HOST 1
+
+/**
+ *  \brief Pin names of the LPC17xx/LPC11Uxx families, so the pin_XX
+ *  definitions in nworkbench.h resolve on the host
+ */
+typedef enum {
+    P0_0 = 0, P0_1, P0_2, P0_3, P0_4, P0_5, P0_6, P0_7,
+    P0_8, P0_9, P0_10, P0_11, P0_12, P0_13, P0_14, P0_15,
+    P0_16, P0_17, P0_18, P0_19, P0_20, P0_21, P0_22, P0_23,
+    P0_24, P0_25, P0_26, P0_27, P0_28, P0_29, P0_30, P0_31,
+    P1_0, P1_1, P1_2, P1_3, P1_4, P1_5, P1_6, P1_7,
+    P1_8, P1_9, P1_10, P1_11, P1_12, P1_13, P1_14, P1_15,
+    P1_16, P1_17, P1_18, P1_19, P1_20, P1_21, P1_22, P1_23,
+    P1_24, P1_25, P1_26, P1_27, P1_28, P1_29, P1_30, P1_31,
+    P2_0, P2_1, P2_2, P2_3, P2_4, P2_5, P2_6, P2_7,
+    P2_8, P2_9, P2_10, P2_11, P2_12, P2_13, P2_14, P2_15,
+    P2_16, P2_17, P2_18, P2_19, P2_20, P2_21, P2_22, P2_23,
+    P2_24, P2_25, P2_26, P2_27, P2_28, P2_29, P2_30, P2_31,
+    P3_0, P3_1, P3_2, P3_3, P3_4, P3_5, P3_6, P3_7,
+    P3_8, P3_9, P3_10, P3_11, P3_12, P3_13, P3_14, P3_15,
+    P3_16, P3_17, P3_18, P3_19, P3_20, P3_21, P3_22, P3_23,
+    P3_24, P3_25, P3_26, P3_27, P3_28, P3_29, P3_30, P3_31,
+    P4_0, P4_1, P4_2, P4_3, P4_4, P4_5, P4_6, P4_7,
+    P4_8, P4_9, P4_10, P4_11, P4_12, P4_13, P4_14, P4_15,
+    P4_16, P4_17, P4_18, P4_19, P4_20, P4_21, P4_22, P4_23,
+    P4_24, P4_25, P4_26, P4_27, P4_28, P4_29, P4_30, P4_31,
+    HOST_PIN_COUNT,
+    NC = (int)0xFFFFFFFF
+} PinName;
+
+/**
+ *  \brief Monotonic host time in nanoseconds, used as timestamp base
+ *  by the recording classes. Virtual time after HostSimEnable().
+ */
+uint64_t HostTimeNs(void);
+
+/**
+ *  \brief Monotonic wall-clock time in nanoseconds, also in simulation
+ */
+uint64_t HostWallTimeNs(void);
+
+/**
+ *  \brief Periodic interrupt emulation. The callback runs in a timer
+ *  thread, concurrently with main(), as an ISR would on target.
+ */
+class Ticker {
+public:
+    Ticker(void);
+    ~Ticker(void);
+
+    /**
+     *  \brief Attaches a function to be called every t seconds
+     *
+     *  \param [in] fptr Function to be called
+     *  \param [in] t Period in seconds
+     */
+    void attach(void (*fptr)(void), float t);
+
+    /**
+     *  \brief Attaches a member function to be called every t seconds
+     */
+    template <typename T>
+    void attach(T * tptr, void (T::*mptr)(void), float t) {
+        _object = (void *)tptr;
+        memcpy(_method, &mptr, sizeof(mptr));
+        _thunk = &Ticker::methodThunk<T>;
+        start((uint64_t)(t * 1e9f));
+    }
+
+    /**
+     *  \brief Attaches a function to be called every t microseconds
+     */
+    void attach_us(void (*fptr)(void), uint32_t t);
+
+    /**
+     *  \brief Stops the periodic calls
+     */
+    void detach(void);
+
+private:
+    template <typename T>
+    static void methodThunk(void * object, const void * method) {
+        void (T::*mptr)(void);
+        memcpy(&mptr, method, sizeof(mptr));
+        (((T *)object)->*mptr)();
+    }
+    static void functionThunk(void * object, const void * method);
+    static void * threadEntry(void * arg);
+    void start(uint64_t period_ns);
+    void run(void);
+
+    void * _object;
+    char _method[2 * sizeof(void *)];
+    void (*_thunk)(void * object, const void * method);
+    uint64_t _period_ns;
+    pthread_t _thread;
+    volatile int _running;
+    // Virtual time: next deadline and the list of attached tickers
+    uint64_t _deadline;
+    Ticker * _sim_next;
+
+    friend uint32_t HostSimStep(void);
+    friend uint64_t HostSimRun(uint64_t until_ns, uint32_t (*idle)(void));
+};
+
+/**
+ *  \brief Software interrupt pin. There is no electrical input on the
+ *  host: edges are produced by HostSetPin() or fire(), and the handlers
+ *  are called synchronously from the caller's thread.
+ */
+class InterruptIn {
+public:
+    InterruptIn(PinName pin);
+    ~InterruptIn(void);
+
+    /** \brief Attaches a function to the rising edge */
+    void rise(void (*fptr)(void));
+    /** \brief Attaches a function to the falling edge */
+    void fall(void (*fptr)(void));
+    /** \brief Attaches a member function to the rising edge */
+    template <typename T>
+    void rise(T * tptr, void (T::*mptr)(void)) { setHandler(&_rise, tptr, mptr); }
+    /** \brief Attaches a member function to the falling edge */
+    template <typename T>
+    void fall(T * tptr, void (T::*mptr)(void)) { setHandler(&_fall, tptr, mptr); }
+    /** \brief Returns the current (simulated) pin level */
+    int read(void);
+    operator int() { return read(); }
+
+    /**
+     *  \brief Drives the simulated pin level, calling the rise or fall
+     *  handler when the level changes.
+     *
+     *  \param [in] level New pin level (0 or 1)
+     */
+    void fire(int level);
+
+    /** \brief Pin this instance is bound to */
+    PinName pin(void) { return _pin; }
+
+private:
+    // Edge handler: a function, or a member function and its object
+    typedef struct Handler {
+        void * object;
+        char method[2 * sizeof(void *)];
+        void (*thunk)(void * object, const void * method);
+    } Handler;
+
+    template <typename T>
+    static void methodThunk(void * object, const void * method) {
+        void (T::*mptr)(void);
+        memcpy(&mptr, method, sizeof(mptr));
+        (((T *)object)->*mptr)();
+    }
+    template <typename T>
+    static void setHandler(Handler * handler, T * tptr, void (T::*mptr)(void)) {
+        handler->object = (void *)tptr;
+        memcpy(handler->method, &mptr, sizeof(mptr));
+        handler->thunk = &InterruptIn::methodThunk<T>;
+    }
+    static void functionThunk(void * object, const void * method);
+    static void call(Handler * handler);
+
+    PinName _pin;
+    int _level;
+    Handler _rise;
+    Handler _fall;
+    InterruptIn * _next;
+
+    friend void HostSetPin(PinName pin, int level);
+};
+
+/**
+ *  \brief A single write recorded by DigitalOut
+ */
+typedef struct HostPinEvent {
+    uint64_t timestamp;
+    int value;
+} HostPinEvent;
+
+#define HOST_PIN_HISTORY 1024
+
+/**
+ *  \brief Output pin recording its writes. The last HOST_PIN_HISTORY
+ *  writes are kept in a circular log with timestamps, and the total
+ *  number of writes is counted.
+ */
+class DigitalOut {
+public:
+    DigitalOut(PinName pin);
+    DigitalOut(PinName pin, int value);
+
+    void write(int value);
+    int read(void) { return _value; }
+    DigitalOut & operator= (int value) { write(value); return *this; }
+    operator int() { return read(); }
+
+    /** \brief Total number of writes since construction */
+    uint32_t writeCount(void) { return _count; }
+
+    /**
+     *  \brief Retrieves a recorded write, 0 being the oldest one still
+     *  in the log.
+     *
+     *  \param [in] index Position in the log
+     *  \return The recorded event (zeroed if index is out of range)
+     */
+    HostPinEvent event(uint32_t index);
+
+    /** \brief Number of events currently held in the log */
+    uint32_t eventCount(void);
+
+    /** \brief Pin this instance is bound to */
+    PinName pin(void) { return _pin; }
+
+private:
+    PinName _pin;
+    int _value;
+    uint32_t _count;
+    HostPinEvent _history[HOST_PIN_HISTORY];
+};
+
+/**
+ *  \brief Drives the level of a simulated input pin. Every InterruptIn
+ *  bound to this pin gets its edge handler called if the level changes.
+ *
+ *  \param [in] pin Pin to be driven
+ *  \param [in] level New level (0 or 1)
+ */
+void HostSetPin(PinName pin, int level);
+
+/**
+ *  \brief Generates a full pulse (rise then fall) in a simulated pin
+ */
+void HostPulsePin(PinName pin);
+
+/**
+ *  \brief Switches to virtual time, starting at 0. Must be called before
+ *  any Ticker is attached (e.g. before SetupWorkbench() ). Attached
+ *  tickers then have no thread: they fire from HostSimStep(), as do
+ *  the stimuli scheduled below. wait() advances virtual time, like a
+ *  busy CPU.
+ */
+void HostSimEnable(void);
+
+/**
+ *  \brief Returns 1 after HostSimEnable()
+ */
+int HostSimActive(void);
+
+/**
+ *  \brief Schedules HostSetPin(pin, level) at a virtual time
+ */
+void HostSimSetPin(uint64_t time_ns, PinName pin, int level);
+
+/**
+ *  \brief Schedules count pulses (HostPulsePin() ) on a pin, the first
+ *  one at time_ns, then every period_ns. count 0 repeats forever. E.g.
+ *  frame ticks for KERNEL_TICK_EXT.
+ */
+void HostSimPulses(uint64_t time_ns, PinName pin, uint64_t period_ns, uint32_t count);
+
+/**
+ *  \brief Schedules a call to fptr(context) at a virtual time
+ */
+void HostSimCall(uint64_t time_ns, void (*fptr)(void * context), void * context);
+
+/**
+ *  \brief Advances virtual time to the next timestamp with a ticker or
+ *  stimulus due, and fires all of them: tickers first, then stimuli in
+ *  the order they were scheduled.
+ *
+ *  \return 0 if nothing is scheduled, 1 otherwise
+ */
+uint32_t HostSimStep(void);
+
+/**
+ *  \brief Runs virtual time up to until_ns, calling idle() after each
+ *  timestamp, e.g. with ProgressNodes() to process the frames ticked.
+ *
+ *  \param [in] until_ns Virtual time to stop at
+ *  \param [in] idle Function called after each step, or 0
+ *  \return Sum of the values returned by idle()
+ */
+uint64_t HostSimRun(uint64_t until_ns, uint32_t (*idle)(void));
+
+void wait(float s);
+void wait_ms(int ms);
+void wait_us(int us);
+
+#endif
@@ -0,0 +1,415 @@
+#include "mbed.h"
+
+#include <time.h>
+#include <errno.h>
+
+// Virtual time, see HostSimEnable()
+static int __host_sim = 0;
+static uint64_t __host_sim_now = 0;
+
+uint64_t HostWallTimeNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t HostTimeNs(void) {
+    if (__host_sim) return __host_sim_now;
+    return HostWallTimeNs();
+}
+
+static void HostSleepUntil(uint64_t deadline_ns) {
+    struct timespec ts;
+    if (__host_sim) {
+        // Time spent by a busy CPU: events due meanwhile fire late
+        if (deadline_ns > __host_sim_now) __host_sim_now = deadline_ns;
+        return;
+    }
+    ts.tv_sec = (time_t)(deadline_ns / 1000000000ull);
+    ts.tv_nsec = (long)(deadline_ns % 1000000000ull);
+    // Absolute deadlines keep the period free of accumulated drift
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR) { }
+}
+
+
+
+// TICKER
+// Tickers attached in virtual time
+static Ticker * __host_sim_tickers = 0;
+
+Ticker::Ticker(void) {
+    this->_object = 0;
+    this->_thunk = 0;
+    this->_period_ns = 0;
+    this->_running = 0;
+    this->_deadline = 0;
+    this->_sim_next = 0;
+}
+
+Ticker::~Ticker(void) {
+    detach();
+}
+
+void Ticker::functionThunk(void * object, const void * method) {
+    ((void (*)(void))object)();
+}
+
+void Ticker::attach(void (*fptr)(void), float t) {
+    this->_object = (void *)fptr;
+    this->_thunk = &Ticker::functionThunk;
+    start((uint64_t)((double)t * 1e9));
+}
+
+void Ticker::attach_us(void (*fptr)(void), uint32_t t) {
+    this->_object = (void *)fptr;
+    this->_thunk = &Ticker::functionThunk;
+    start((uint64_t)t * 1000ull);
+}
+
+void Ticker::start(uint64_t period_ns) {
+    // Re-attaching replaces the previous schedule, as in mbed
+    detach();
+    if (period_ns == 0) return;
+    this->_period_ns = period_ns;
+    this->_running = 1;
+    if (__host_sim) {
+        // No thread: HostSimStep() fires the ticker
+        this->_deadline = __host_sim_now + period_ns;
+        this->_sim_next = __host_sim_tickers;
+        __host_sim_tickers = this;
+        return;
+    }
+    if (pthread_create(&(this->_thread), 0, &Ticker::threadEntry, this) != 0) {
+        this->_running = 0;
+    }
+}
+
+void Ticker::detach(void) {
+    Ticker ** cursor;
+    if (!this->_running) return;
+    this->_running = 0;
+    if (__host_sim) {
+        cursor = &__host_sim_tickers;
+        while (*cursor != 0) {
+            if (*cursor == this) {
+                *cursor = this->_sim_next;
+                break;
+            }
+            cursor = &((*cursor)->_sim_next);
+        }
+    }
+    else pthread_join(this->_thread, 0);
+}
+
+void * Ticker::threadEntry(void * arg) {
+    ((Ticker *)arg)->run();
+    return 0;
+}
+
+void Ticker::run(void) {
+    uint64_t deadline = HostTimeNs();
+    while (this->_running) {
+        deadline += this->_period_ns;
+        HostSleepUntil(deadline);
+        if (!this->_running) break;
+        // Equivalent to the timer interrupt firing
+        this->_thunk(this->_object, this->_method);
+    }
+}
+
+
+
+// INTERRUPTIN
+// All live InterruptIn objects, so HostSetPin() can find them by pin
+static InterruptIn * __host_interrupts = 0;
+static pthread_mutex_t __host_interrupts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+InterruptIn::InterruptIn(PinName pin) {
+    this->_pin = pin;
+    this->_level = 0;
+    this->_rise.thunk = 0;
+    this->_fall.thunk = 0;
+    pthread_mutex_lock(&__host_interrupts_lock);
+    this->_next = __host_interrupts;
+    __host_interrupts = this;
+    pthread_mutex_unlock(&__host_interrupts_lock);
+}
+
+InterruptIn::~InterruptIn(void) {
+    InterruptIn ** cursor;
+    pthread_mutex_lock(&__host_interrupts_lock);
+    cursor = &__host_interrupts;
+    while (*cursor != 0) {
+        if (*cursor == this) {
+            *cursor = this->_next;
+            break;
+        }
+        cursor = &((*cursor)->_next);
+    }
+    pthread_mutex_unlock(&__host_interrupts_lock);
+}
+
+void InterruptIn::functionThunk(void * object, const void * method) {
+    ((void (*)(void))object)();
+}
+
+void InterruptIn::call(Handler * handler) {
+    if (handler->thunk) handler->thunk(handler->object, handler->method);
+}
+
+void InterruptIn::rise(void (*fptr)(void)) {
+    this->_rise.object = (void *)fptr;
+    this->_rise.thunk = (fptr != 0) ? &InterruptIn::functionThunk : 0;
+}
+void InterruptIn::fall(void (*fptr)(void)) {
+    this->_fall.object = (void *)fptr;
+    this->_fall.thunk = (fptr != 0) ? &InterruptIn::functionThunk : 0;
+}
+int InterruptIn::read(void) { return this->_level; }
+
+void InterruptIn::fire(int level) {
+    level = (level != 0);
+    if (level == this->_level) return;
+    this->_level = level;
+    if (level) call(&(this->_rise));
+    else call(&(this->_fall));
+}
+
+void HostSetPin(PinName pin, int level) {
+    InterruptIn * cursor;
+    pthread_mutex_lock(&__host_interrupts_lock);
+    cursor = __host_interrupts;
+    pthread_mutex_unlock(&__host_interrupts_lock);
+    // Objects are only expected to be created/destroyed at setup, so
+    // the list is walked without holding the lock while calling handlers
+    while (cursor != 0) {
+        if (cursor->_pin == pin) cursor->fire(level);
+        cursor = cursor->_next;
+    }
+}
+
+void HostPulsePin(PinName pin) {
+    HostSetPin(pin, 1);
+    HostSetPin(pin, 0);
+}
+
+
+
+// VIRTUAL TIME
+enum HostSimKinds {
+    HOST_SIM_PIN,
+    HOST_SIM_PULSE,
+    HOST_SIM_CALL
+};
+
+/**
+ *  Scheduled stimulus. Pulses with a period are rescheduled in place.
+ */
+typedef struct HostSimEvent {
+    uint64_t time;
+    uint64_t sequence;
+    uint64_t period;
+    uint32_t remaining;     // 0: forever
+    uint32_t kind;
+    PinName pin;
+    int level;
+    void (*fptr)(void * context);
+    void * context;
+} HostSimEvent;
+
+// Binary min-heap of stimuli, by time then scheduling order
+static HostSimEvent * __host_sim_events = 0;
+static uint32_t __host_sim_count = 0;
+static uint32_t __host_sim_capacity = 0;
+static uint64_t __host_sim_sequence = 0;
+
+static inline int HostSimBefore(const HostSimEvent * a, const HostSimEvent * b) {
+    return (a->time < b->time) || ((a->time == b->time) && (a->sequence < b->sequence));
+}
+
+static void HostSimSiftDown(uint32_t i) {
+    HostSimEvent e = __host_sim_events[i];
+    uint32_t child;
+    while ((child = (2 * i) + 1) < __host_sim_count) {
+        if (((child + 1) < __host_sim_count) && HostSimBefore(&(__host_sim_events[child + 1]), &(__host_sim_events[child]))) child++;
+        if (!HostSimBefore(&(__host_sim_events[child]), &e)) break;
+        __host_sim_events[i] = __host_sim_events[child];
+        i = child;
+    }
+    __host_sim_events[i] = e;
+}
+
+static void HostSimPush(HostSimEvent * e) {
+    HostSimEvent * events;
+    uint32_t i, parent, capacity;
+    if (__host_sim_count == __host_sim_capacity) {
+        capacity = (__host_sim_capacity == 0) ? 64 : (2 * __host_sim_capacity);
+        events = (HostSimEvent *)realloc(__host_sim_events, capacity * sizeof(HostSimEvent));
+        // Out of memory: the event is dropped, scheduled ones are kept
+        if (events == 0) return;
+        __host_sim_events = events;
+        __host_sim_capacity = capacity;
+    }
+    e->sequence = __host_sim_sequence++;
+    i = __host_sim_count++;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!HostSimBefore(e, &(__host_sim_events[parent]))) break;
+        __host_sim_events[i] = __host_sim_events[parent];
+        i = parent;
+    }
+    __host_sim_events[i] = *e;
+}
+
+void HostSimEnable(void) {
+    __host_sim = 1;
+    __host_sim_now = 0;
+}
+
+int HostSimActive(void) {
+    return __host_sim;
+}
+
+void HostSimSetPin(uint64_t time_ns, PinName pin, int level) {
+    HostSimEvent e;
+    memset(&e, 0, sizeof(e));
+    e.time = time_ns;
+    e.kind = HOST_SIM_PIN;
+    e.pin = pin;
+    e.level = level;
+    HostSimPush(&e);
+}
+
+void HostSimPulses(uint64_t time_ns, PinName pin, uint64_t period_ns, uint32_t count) {
+    HostSimEvent e;
+    memset(&e, 0, sizeof(e));
+    e.time = time_ns;
+    e.period = period_ns;
+    e.remaining = count;
+    e.kind = HOST_SIM_PULSE;
+    e.pin = pin;
+    HostSimPush(&e);
+}
+
+void HostSimCall(uint64_t time_ns, void (*fptr)(void * context), void * context) {
+    HostSimEvent e;
+    memset(&e, 0, sizeof(e));
+    e.time = time_ns;
+    e.kind = HOST_SIM_CALL;
+    e.fptr = fptr;
+    e.context = context;
+    HostSimPush(&e);
+}
+
+uint32_t HostSimStep(void) {
+    Ticker * t;
+    HostSimEvent e;
+    uint64_t next = 0;
+    int found = 0;
+    
+    for (t=__host_sim_tickers; t!=0; t=t->_sim_next) {
+        if (!found || (t->_deadline < next)) next = t->_deadline;
+        found = 1;
+    }
+    if ((__host_sim_count > 0) && (!found || (__host_sim_events[0].time < next))) next = __host_sim_events[0].time;
+    found |= (__host_sim_count > 0);
+    if (!found) return 0;
+    // Events already late (after a wait() ) fire now
+    if (next > __host_sim_now) __host_sim_now = next;
+    
+    // Equivalent to the timer interrupts firing
+    for (t=__host_sim_tickers; t!=0; t=t->_sim_next) {
+        if (t->_deadline <= next) {
+            t->_deadline += t->_period_ns;
+            t->_thunk(t->_object, t->_method);
+        }
+    }
+    while ((__host_sim_count > 0) && (__host_sim_events[0].time <= next)) {
+        // Taken out of the heap first: handlers may schedule events,
+        // which moves or reallocates the heap
+        e = __host_sim_events[0];
+        __host_sim_events[0] = __host_sim_events[--__host_sim_count];
+        if (__host_sim_count > 0) HostSimSiftDown(0);
+        switch (e.kind) {
+            case HOST_SIM_PIN:
+                HostSetPin(e.pin, e.level);
+                break;
+            case HOST_SIM_PULSE:
+                HostPulsePin(e.pin);
+                break;
+            case HOST_SIM_CALL:
+                e.fptr(e.context);
+                break;
+        }
+        if ((e.kind == HOST_SIM_PULSE) && (e.period > 0) && (e.remaining != 1)) {
+            // Next pulse
+            if (e.remaining > 1) e.remaining--;
+            e.time += e.period;
+            HostSimPush(&e);
+        }
+    }
+    return 1;
+}
+
+uint64_t HostSimRun(uint64_t until_ns, uint32_t (*idle)(void)) {
+    Ticker * t;
+    uint64_t total = 0;
+    uint64_t next;
+    int due;
+    
+    while (1) {
+        // Stop before the first timestamp past until_ns
+        due = 0;
+        for (t=__host_sim_tickers; t!=0; t=t->_sim_next) due |= (t->_deadline <= until_ns);
+        next = (__host_sim_count > 0) ? __host_sim_events[0].time : until_ns + 1;
+        due |= (next <= until_ns);
+        if (!due || (__host_sim_now > until_ns)) break;
+        HostSimStep();
+        if (idle) total += idle();
+    }
+    if (__host_sim_now < until_ns) __host_sim_now = until_ns;
+    return total;
+}
+
+
+
+// DIGITALOUT
+DigitalOut::DigitalOut(PinName pin) {
+    this->_pin = pin;
+    this->_value = 0;
+    this->_count = 0;
+}
+
+DigitalOut::DigitalOut(PinName pin, int value) {
+    this->_pin = pin;
+    this->_value = 0;
+    this->_count = 0;
+    write(value);
+}
+
+void DigitalOut::write(int value) {
+    HostPinEvent * entry;
+    this->_value = (value != 0);
+    entry = &(this->_history[this->_count % HOST_PIN_HISTORY]);
+    entry->timestamp = HostTimeNs();
+    entry->value = this->_value;
+    this->_count++;
+}
+
+uint32_t DigitalOut::eventCount(void) {
+    return (this->_count < HOST_PIN_HISTORY) ? this->_count : HOST_PIN_HISTORY;
+}
+
+HostPinEvent DigitalOut::event(uint32_t index) {
+    HostPinEvent empty = { 0, 0 };
+    uint32_t held = eventCount();
+    if (index >= held) return empty;
+    return this->_history[(this->_count - held + index) % HOST_PIN_HISTORY];
+}
+
+
+
+// WAIT
+void wait(float s) { HostSleepUntil(HostTimeNs() + (uint64_t)((double)s * 1e9)); }
+void wait_ms(int ms) { HostSleepUntil(HostTimeNs() + (uint64_t)ms * 1000000ull); }
+void wait_us(int us) { HostSleepUntil(HostTimeNs() + (uint64_t)us * 1000ull); }
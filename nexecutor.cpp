@@ -0,0 +1,166 @@
+#include "nexecutor.h"
+
+#ifdef TARGET_HOST
+
+// Arguments of a worker thread
+typedef struct nBlocks_WorkerArg {
+    nBlockExecutor * executor;
+    uint32_t worker;
+} nBlocks_WorkerArg;
+
+static inline void CpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+nBlockExecutor::nBlockExecutor(uint32_t num_threads) {
+    uint32_t i;
+    nBlocks_WorkerArg * arg;
+
+    if (num_threads == 0) num_threads = 1;
+    this->_num_threads = num_threads;
+    this->_shares = new Share [num_threads];
+    this->_threads = new pthread_t [num_threads];
+    this->_function = 0;
+    this->_context = 0;
+    this->_count = 0;
+    this->_chunk_size = 1;
+    this->_generation = 0;
+    this->_active = 0;
+    this->_stop = 0;
+    pthread_mutex_init(&(this->_lock), 0);
+    pthread_cond_init(&(this->_start_cond), 0);
+    pthread_cond_init(&(this->_done_cond), 0);
+
+    // Worker 0 is the thread calling parallelFor()
+    for (i=1; i<num_threads; i++) {
+        arg = new nBlocks_WorkerArg;
+        arg->executor = this;
+        arg->worker = i;
+        pthread_create(&(this->_threads[i]), 0, &nBlockExecutor::threadEntry, arg);
+    }
+}
+
+nBlockExecutor::~nBlockExecutor(void) {
+    uint32_t i;
+
+    pthread_mutex_lock(&(this->_lock));
+    __atomic_store_n(&(this->_stop), 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&(this->_generation), 1, __ATOMIC_ACQ_REL);
+    pthread_cond_broadcast(&(this->_start_cond));
+    pthread_mutex_unlock(&(this->_lock));
+    for (i=1; i<this->_num_threads; i++) pthread_join(this->_threads[i], 0);
+
+    pthread_mutex_destroy(&(this->_lock));
+    pthread_cond_destroy(&(this->_start_cond));
+    pthread_cond_destroy(&(this->_done_cond));
+    delete[] this->_shares;
+    delete[] this->_threads;
+}
+
+void * nBlockExecutor::threadEntry(void * arg) {
+    nBlocks_WorkerArg * worker_arg = (nBlocks_WorkerArg *)arg;
+    nBlockExecutor * executor = worker_arg->executor;
+    uint32_t worker = worker_arg->worker;
+    delete worker_arg;
+    executor->workerLoop(worker);
+    return 0;
+}
+
+void nBlockExecutor::workerLoop(uint32_t worker) {
+    uint32_t seen = 0;
+    uint32_t spin;
+
+    while (1) {
+        // Wait for a new task: spin first, then block
+        for (spin=0; spin<NBLOCKS_EXECUTOR_SPIN; spin++) {
+            if (__atomic_load_n(&(this->_generation), __ATOMIC_ACQUIRE) != seen) break;
+            CpuRelax();
+        }
+        if (__atomic_load_n(&(this->_generation), __ATOMIC_ACQUIRE) == seen) {
+            pthread_mutex_lock(&(this->_lock));
+            while (__atomic_load_n(&(this->_generation), __ATOMIC_ACQUIRE) == seen) {
+                pthread_cond_wait(&(this->_start_cond), &(this->_lock));
+            }
+            pthread_mutex_unlock(&(this->_lock));
+        }
+        seen = __atomic_load_n(&(this->_generation), __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(this->_stop), __ATOMIC_ACQUIRE)) return;
+
+        runShares(worker);
+
+        // The last worker to finish wakes the caller if it blocked
+        if (__atomic_sub_fetch(&(this->_active), 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&(this->_lock));
+            pthread_cond_signal(&(this->_done_cond));
+            pthread_mutex_unlock(&(this->_lock));
+        }
+    }
+}
+
+void nBlockExecutor::runShares(uint32_t worker) {
+    uint32_t victim, chunk, begin, end, i;
+
+    // Own share first, then the other shares in turn. Every chunk is
+    // claimed by an atomic increment of its share cursor, so each one
+    // runs exactly once whoever takes it.
+    for (i=0; i<this->_num_threads; i++) {
+        victim = (worker + i) % this->_num_threads;
+        while (1) {
+            chunk = __atomic_fetch_add(&(this->_shares[victim].next), 1, __ATOMIC_ACQ_REL);
+            if (chunk >= this->_shares[victim].end) break;
+            begin = chunk * this->_chunk_size;
+            end = begin + this->_chunk_size;
+            if (end > this->_count) end = this->_count;
+            this->_function(this->_context, begin, end);
+        }
+    }
+}
+
+void nBlockExecutor::parallelFor(uint32_t count, uint32_t chunk_size, nBlocks_RangeFunction function, void * context) {
+    uint32_t num_chunks, i, spin;
+
+    if (count == 0) return;
+    if (chunk_size == 0) chunk_size = 1;
+    num_chunks = (count + chunk_size - 1) / chunk_size;
+
+    // Not worth waking anyone for a single chunk
+    if ((this->_num_threads == 1) || (num_chunks == 1)) {
+        function(context, 0, count);
+        return;
+    }
+
+    this->_function = function;
+    this->_context = context;
+    this->_count = count;
+    this->_chunk_size = chunk_size;
+    for (i=0; i<this->_num_threads; i++) {
+        this->_shares[i].next = (num_chunks * i) / this->_num_threads;
+        this->_shares[i].end = (num_chunks * (i + 1)) / this->_num_threads;
+    }
+    __atomic_store_n(&(this->_active), this->_num_threads - 1, __ATOMIC_RELEASE);
+
+    // Publishing the new generation releases the task to the workers
+    pthread_mutex_lock(&(this->_lock));
+    __atomic_fetch_add(&(this->_generation), 1, __ATOMIC_ACQ_REL);
+    pthread_cond_broadcast(&(this->_start_cond));
+    pthread_mutex_unlock(&(this->_lock));
+
+    runShares(0);
+
+    // Barrier: wait for the other workers, spinning first
+    for (spin=0; spin<NBLOCKS_EXECUTOR_SPIN; spin++) {
+        if (__atomic_load_n(&(this->_active), __ATOMIC_ACQUIRE) == 0) return;
+        CpuRelax();
+    }
+    pthread_mutex_lock(&(this->_lock));
+    while (__atomic_load_n(&(this->_active), __ATOMIC_ACQUIRE) != 0) {
+        pthread_cond_wait(&(this->_done_cond), &(this->_lock));
+    }
+    pthread_mutex_unlock(&(this->_lock));
+}
+
+#endif
@@ -0,0 +1,98 @@
+/**
+ *  \file nexecutor.h
+ *  \brief Fixed worker pool used by the kernel to run frame stages on
+ *  several cores. Available on the host only (TARGET_HOST).
+ *
+ *  \details parallelFor() splits a range of items into chunks. Each
+ *  worker (the calling thread being worker 0) owns an equal share of
+ *  the chunks and takes them in order; a worker done with its share
+ *  steals the next chunks of the other workers. parallelFor() returns
+ *  once every chunk has been processed, which acts as the frame barrier.
+ *
+ *  Idle workers spin for a short while before blocking, so back to back
+ *  frames don't pay a thread wake-up each.
+ */
+
+#ifndef _NEXECUTOR
+#define _NEXECUTOR
+
+#include "mbed.h"
+
+#ifdef TARGET_HOST
+
+/**
+ *  \brief Spin iterations of an idle worker before it blocks
+ */
+#ifndef NBLOCKS_EXECUTOR_SPIN
+#define NBLOCKS_EXECUTOR_SPIN 20000
+#endif
+
+/**
+ *  \brief Function processing items begin to end-1 of a parallelFor()
+ */
+typedef void (*nBlocks_RangeFunction)(void * context, uint32_t begin, uint32_t end);
+
+class nBlockExecutor {
+public:
+    /**
+     *  \brief Starts num_threads-1 worker threads (the caller of
+     *  parallelFor() is the remaining one).
+     *
+     *  \param [in] num_threads Total number of threads, at least 1
+     */
+    nBlockExecutor(uint32_t num_threads);
+
+    /**
+     *  \brief Stops and joins the worker threads
+     */
+    ~nBlockExecutor(void);
+
+    /**
+     *  \brief Processes count items in chunks of chunk_size items on all
+     *  threads, and returns when all of them are done.
+     *
+     *  \param [in] count Number of items
+     *  \param [in] chunk_size Items per chunk (at least 1)
+     *  \param [in] function Function called for each chunk
+     *  \param [in] context Passed to function
+     */
+    void parallelFor(uint32_t count, uint32_t chunk_size, nBlocks_RangeFunction function, void * context);
+
+    /** \brief Total number of threads, including the caller */
+    uint32_t threads(void) { return _num_threads; }
+
+private:
+    // Per worker share of chunks, padded to its own cache line
+    typedef struct Share {
+        volatile uint32_t next;
+        volatile uint32_t end;
+        char padding[64 - (2 * sizeof(uint32_t))];
+    } Share;
+
+    static void * threadEntry(void * arg);
+    void workerLoop(uint32_t worker);
+    void runShares(uint32_t worker);
+
+    uint32_t _num_threads;
+    pthread_t * _threads;
+    Share * _shares;
+
+    // Current task
+    nBlocks_RangeFunction _function;
+    void * _context;
+    uint32_t _count;
+    uint32_t _chunk_size;
+
+    // Incremented to start a task; workers still running it
+    volatile uint32_t _generation;
+    volatile uint32_t _active;
+    volatile uint32_t _stop;
+
+    pthread_mutex_t _lock;
+    pthread_cond_t _start_cond;
+    pthread_cond_t _done_cond;
+};
+
+#endif
+
+#endif
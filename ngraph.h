@@ -0,0 +1,281 @@
+/**
+ *  \file ngraph.h
+ *  \brief Graphs described at compile time
+ *
+ *  \details nBlockStaticGraph holds a fixed set of nodes, given as a
+ *  list of classes, and a fixed list of links between them. From these
+ *  the compiler generates one straight-line runFrame(): every
+ *  readOutput(), triggerInput() and step() is a direct call on an object
+ *  of known class, so it can be inlined, and no list or table is walked.
+ *  The graph's nodes are not registered in the kernel lists, so they
+ *  can not be wired with nBlockConnection: such connections, e.g. from
+ *  a registered sensor node to graph.node<I>(), are ignored. Data
+ *  enters and leaves the graph through its own nodes only.
+ *
+ *      // Nodes needing constructor arguments get a small wrapper class
+ *      struct Led: nBlock_DigitalOut { Led(): nBlock_DigitalOut(LED1) { } };
+ *
+ *      nBlockStaticGraph<
+ *          nBlocks_Nodes<nBlock_Ticker, nBlock_Counter, Led>,
+ *          nBlocks_Links<nBlockLink<0, 0, 1, 0>, nBlockLink<1, 0, 2, 0> >
+ *      > graph;
+ *
+ *      int main(void) {
+ *          graph.attach();
+ *          SetupWorkbench();
+ *          while (1) ProgressNodes();
+ *      }
+ *
+ *  Frames follow KERNEL_SCHEDULE_STAGED: all links are propagated, then
+ *  all nodes are stepped, in list order. Each node receives the messages
+ *  of a frame in one batch, ordered as its links are listed; links
+ *  listed by source node and output deliver in the same order as
+ *  nBlockConnection. Rate divisors (setRate() ) do not apply: every
+ *  node steps every frame.
+ *
+ *  Requires C++11 (variadic templates). With older compilers this file
+ *  declares nothing, and graphs are built with nBlockConnection or
+ *  nBlockTypedConnection as usual.
+ */
+
+#ifndef _NGRAPH
+#define _NGRAPH
+
+#include "nworkbench.h"
+
+#if __cplusplus >= 201103L
+
+/**
+ *  \brief Connection from output OutIdx of node SrcIdx to input InIdx of
+ *  node DstIdx, nodes numbered by position in nBlocks_Nodes
+ */
+template <uint32_t SrcIdx, uint32_t OutIdx, uint32_t DstIdx, uint32_t InIdx>
+struct nBlockLink {
+    static const uint32_t src = SrcIdx;
+    static const uint32_t output = OutIdx;
+    static const uint32_t dst = DstIdx;
+    static const uint32_t input = InIdx;
+};
+
+/** \brief List of node classes of a nBlockStaticGraph */
+template <typename... Nodes>
+struct nBlocks_Nodes { };
+
+/** \brief List of nBlockLink of a nBlockStaticGraph */
+template <typename... Links>
+struct nBlocks_Links { };
+
+// Compile time helpers
+
+template <uint32_t... Is>
+struct nBlocks_Indices { };
+
+template <uint32_t N, uint32_t... Is>
+struct nBlocks_MakeIndices: nBlocks_MakeIndices<N - 1, N - 1, Is...> { };
+
+template <uint32_t... Is>
+struct nBlocks_MakeIndices<0, Is...> {
+    typedef nBlocks_Indices<Is...> type;
+};
+
+template <uint32_t I, typename... Nodes>
+struct nBlocks_NodeAt;
+
+template <typename Head, typename... Tail>
+struct nBlocks_NodeAt<0, Head, Tail...> {
+    typedef Head type;
+};
+
+template <uint32_t I, typename Head, typename... Tail>
+struct nBlocks_NodeAt<I, Head, Tail...> {
+    typedef typename nBlocks_NodeAt<I - 1, Tail...>::type type;
+};
+
+template <uint32_t N, typename... Links>
+struct nBlocks_LinksValid {
+    static const bool value = true;
+};
+
+template <uint32_t N, typename Link, typename... Rest>
+struct nBlocks_LinksValid<N, Link, Rest...> {
+    static const bool value = (Link::src < N) && (Link::dst < N) && nBlocks_LinksValid<N, Rest...>::value;
+};
+
+/**
+ *  \brief Node I of a graph. Distinct base classes of nBlocks_NodeTable,
+ *  constructed in list order.
+ */
+template <uint32_t I, typename Node>
+struct nBlocks_NodeSlot {
+    Node node;
+};
+
+template <typename Indices, typename... Nodes>
+struct nBlocks_NodeTable;
+
+template <uint32_t... Is, typename... Nodes>
+struct nBlocks_NodeTable<nBlocks_Indices<Is...>, Nodes...>: nBlocks_NodeSlot<Is, Nodes>... { };
+
+/**
+ *  \brief Members bracketing the node table of a graph, so its nodes are
+ *  constructed with kernel registration suspended
+ */
+struct nBlocks_RegistrationSuspend {
+    nBlocks_RegistrationSuspend(void) { KernelSuspendRegistration(); }
+};
+
+struct nBlocks_RegistrationResume {
+    nBlocks_RegistrationResume(void) { KernelResumeRegistration(); }
+};
+
+template <typename NodeList, typename LinkList>
+class nBlockStaticGraph;
+
+/**
+ *  \brief Graph of nodes of the classes in nBlocks_Nodes, connected by
+ *  the nBlockLink in nBlocks_Links. See ngraph.h.
+ */
+template <typename... Nodes, typename... Links>
+class nBlockStaticGraph<nBlocks_Nodes<Nodes...>, nBlocks_Links<Links...> > {
+    typedef typename nBlocks_MakeIndices<sizeof...(Nodes)>::type Indices;
+
+    static_assert(sizeof...(Nodes) > 0, "nBlockStaticGraph needs at least one node");
+    static_assert(nBlocks_LinksValid<sizeof...(Nodes), Links...>::value, "nBlockLink refers to a node not in the graph");
+
+public:
+    static const uint32_t num_nodes = sizeof...(Nodes);
+    static const uint32_t num_links = sizeof...(Links);
+
+    /**
+     *  \brief Returns node I, e.g. to configure it before the first frame
+     */
+    template <uint32_t I>
+    typename nBlocks_NodeAt<I, Nodes...>::type & node(void) {
+        return static_cast<nBlocks_NodeSlot<I, typename nBlocks_NodeAt<I, Nodes...>::type> &>(this->_nodes).node;
+    }
+
+    /**
+     *  \brief Processes one frame: propagates all links, then steps all
+     *  nodes. Called by ProgressNodes() after attach(), or directly by
+     *  applications running their own loop.
+     */
+    void runFrame(void) {
+        this->propagate(Indices());
+        this->step(Indices());
+    }
+
+    /**
+     *  \brief Passes the kernel data to all nodes. Called by
+     *  SetupWorkbench() after attach().
+     */
+    void setKernelData(nBlocks_KernelData kernel_data) {
+        this->setup(Indices(), kernel_data);
+    }
+
+    /**
+     *  \brief Makes the kernel run this graph (see KernelAttachGraph() ).
+     *  Call before SetupWorkbench().
+     */
+    void attach(void) {
+        KernelAttachGraph(&nBlockStaticGraph::frameFunction, &nBlockStaticGraph::setupFunction, this);
+    }
+
+private:
+    static void frameFunction(void * context) {
+        static_cast<nBlockStaticGraph *>(context)->runFrame();
+    }
+
+    static void setupFunction(void * context, nBlocks_KernelData kernel_data) {
+        static_cast<nBlockStaticGraph *>(context)->setKernelData(kernel_data);
+    }
+
+    // Message slots of node D start at the number of links to nodes
+    // before D. Counted by halves, so constexpr recursion stays shallow
+    // for long link lists.
+    static constexpr uint32_t countBelow(uint32_t d, uint32_t lo, uint32_t hi) {
+        return ((hi - lo) == 0) ? 0 :
+            ((hi - lo) == 1) ? ((_link_dst[lo] < d) ? 1 : 0) :
+            (countBelow(d, lo, lo + ((hi - lo) / 2)) + countBelow(d, lo + ((hi - lo) / 2), hi));
+    }
+
+    static constexpr uint32_t firstSlot(uint32_t d) {
+        return countBelow(d, 0, sizeof...(Links));
+    }
+
+    // Reads one link into the next slot of its destination
+    template <typename Link>
+    void readLink(void) {
+        typedef typename nBlocks_NodeAt<Link::src, Nodes...>::type Source;
+        nBlocks_Message * message = &(this->_messages[firstSlot(Link::dst) + this->_counts[Link::dst]]);
+
+        if (nBlocks_OutputReader<Source, Link::output>::read(&(this->node<Link::src>()), message) > 0) {
+            message->inputNumber = Link::input;
+            this->_counts[Link::dst]++;
+        }
+    }
+
+    // Delivers the messages read for node D, if it has links
+    template <uint32_t D>
+    void deliverNode(void) {
+        typedef typename nBlocks_NodeAt<D, Nodes...>::type Destination;
+
+        if (firstSlot(D + 1) == firstSlot(D)) return;
+        if (this->_counts[D] == 0) return;
+        nBlocks_InputTraits<Destination>::deliver(&(this->node<D>()), &(this->_messages[firstSlot(D)]), this->_counts[D]);
+        this->_counts[D] = 0;
+    }
+
+    template <uint32_t I>
+    void stepNode(void) {
+        typedef typename nBlocks_NodeAt<I, Nodes...>::type Node;
+        this->node<I>().Node::step();
+    }
+
+    template <uint32_t I>
+    void setupNode(nBlocks_KernelData kernel_data) {
+        typedef typename nBlocks_NodeAt<I, Nodes...>::type Node;
+        this->node<I>().Node::setKernelData(kernel_data);
+    }
+
+    // Pack expansions over all node indices, in order
+    template <uint32_t... Is>
+    void propagate(nBlocks_Indices<Is...>) {
+        int read_order[] = { 0, (this->readLink<Links>(), 0)... };
+        int deliver_order[] = { 0, (this->deliverNode<Is>(), 0)... };
+        (void)read_order;
+        (void)deliver_order;
+    }
+
+    template <uint32_t... Is>
+    void step(nBlocks_Indices<Is...>) {
+        int order[] = { 0, (this->stepNode<Is>(), 0)... };
+        (void)order;
+    }
+
+    template <uint32_t... Is>
+    void setup(nBlocks_Indices<Is...>, nBlocks_KernelData kernel_data) {
+        int order[] = { 0, (this->setupNode<Is>(kernel_data), 0)... };
+        (void)order;
+    }
+
+    // Declaration order matters: nodes are constructed between the
+    // suspend and resume members
+    nBlocks_RegistrationSuspend _suspend;
+    nBlocks_NodeTable<Indices, Nodes...> _nodes;
+    nBlocks_RegistrationResume _resume;
+
+    // Destination of each link, in list order (plus one unused entry)
+    static constexpr uint32_t _link_dst[sizeof...(Links) + 1] = { Links::dst..., 0 };
+
+    // Messages read in the current frame, grouped by destination node,
+    // and the number read for each node
+    nBlocks_Message _messages[(sizeof...(Links) > 0) ? sizeof...(Links) : 1];
+    uint32_t _counts[sizeof...(Nodes)] = { };
+};
+
+template <typename... Nodes, typename... Links>
+constexpr uint32_t nBlockStaticGraph<nBlocks_Nodes<Nodes...>, nBlocks_Links<Links...> >::_link_dst[sizeof...(Links) + 1];
+
+#endif
+
+#endif
@@ -0,0 +1,600 @@
+#include "nlink.h"
+
+#ifdef TARGET_HOST
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#else
+#include "us_ticker_api.h"
+#endif
+
+#define LINK_MAGIC      0x4B4C424Eu     // "NBLK"
+
+/**
+ *  Packet header, followed by count records
+ */
+typedef struct LinkHeader {
+    uint32_t magic;
+    uint32_t frame;
+    uint32_t size;          // Bytes of records following the header
+    uint32_t count;
+} LinkHeader;
+
+/**
+ *  Message record, followed by payload bytes of payload, padded to a
+ *  multiple of 4
+ */
+typedef struct LinkRecord {
+    uint16_t channel;
+    uint8_t type;
+    uint8_t reserved;
+    uint32_t length;        // dataLength
+    uint32_t payload;
+    uint32_t value[2];      // INT and FLOAT in value[0], 64-bit values in both
+} LinkRecord;
+
+/**
+ *  \brief Microseconds of the wall clock, for the lockstep timeout
+ *  (virtual time does not move while waiting)
+ */
+static uint32_t LinkClock(void) {
+#ifdef TARGET_HOST
+    return (uint32_t)(HostWallTimeNs() / 1000);
+#else
+    return us_ticker_read();
+#endif
+}
+
+/**
+ *  \brief Bytes of the payload a message carries in a packet
+ *
+ *  \param [in] element_size Bytes of each ARRAY element
+ */
+static uint32_t PayloadSize(const nBlocks_Message * message, uint32_t element_size) {
+    switch (message->dataType) {
+        case OUTPUT_TYPE_STRING:
+            return message->dataLength;
+        case OUTPUT_TYPE_ARRAY:
+            return message->dataLength * element_size;
+        case OUTPUT_TYPE_INT_BLOCK:
+        case OUTPUT_TYPE_FLOAT_BLOCK:
+            // Samples and their availability mask
+            return (message->dataLength + ((message->dataLength + 31) >> 5)) * sizeof(uint32_t);
+        default:
+            return 0;
+    }
+}
+
+
+
+// NBLOCKLINK
+nBlockPeerLink::nBlockPeerLink(nBlocks_LinkTransport transport, uint32_t num_channels, uint32_t latency, nBlocks_LinkModes mode) {
+    uint32_t c;
+
+    this->_transport = transport;
+    this->_num_channels = num_channels;
+    this->_latency = (latency > 0) ? latency : 1;
+    this->_mode = mode;
+    this->_frame = 0;
+    memset(&(this->_stats), 0, sizeof(this->_stats));
+
+    this->_packet = new uint8_t [NBLOCKS_LINK_BUFFER];
+    this->_packet_used = sizeof(LinkHeader);
+    this->_packet_count = 0;
+    this->_tx = new uint8_t [NBLOCKS_LINK_BUFFER];
+    this->_tx_used = 0;
+    this->_tx_sent = 0;
+    this->_rx = new uint8_t [NBLOCKS_LINK_BUFFER];
+    this->_rx_used = 0;
+
+    this->_element_size = new uint8_t [num_channels];
+    this->_out_type = new nBlocks_OutputType [num_channels];
+    this->_out_value = new uint64_t [num_channels];
+    this->_out_available = new uint32_t [num_channels];
+    for (c=0; c<num_channels; c++) {
+        this->_element_size[c] = sizeof(uint32_t);
+        this->_out_type[c] = OUTPUT_TYPE_INT;
+        this->_out_value[c] = 0;
+        this->_out_available[c] = 0;
+    }
+    this->setDirtyOutputs(0);
+}
+
+nBlockPeerLink::~nBlockPeerLink(void) {
+    delete[] this->_packet;
+    delete[] this->_tx;
+    delete[] this->_rx;
+    delete[] this->_element_size;
+    delete[] this->_out_type;
+    delete[] this->_out_value;
+    delete[] this->_out_available;
+}
+
+void nBlockPeerLink::setElementSize(uint32_t channel, uint32_t size) {
+    if ((channel < this->_num_channels) && (size > 0) && (size < 256)) this->_element_size[channel] = size;
+}
+
+uint32_t nBlockPeerLink::outputAvailable(uint32_t outputNumber) {
+    return (outputNumber < this->_num_channels) ? this->_out_available[outputNumber] : 0;
+}
+
+nBlocks_OutputType nBlockPeerLink::readOutputType(uint32_t outputNumber) {
+    return (outputNumber < this->_num_channels) ? this->_out_type[outputNumber] : OUTPUT_TYPE_INT;
+}
+
+nBlocks_Handle nBlockPeerLink::readOutput(uint32_t outputNumber) {
+    return (outputNumber < this->_num_channels) ? (nBlocks_Handle)(this->_out_value[outputNumber]) : 0;
+}
+
+uint64_t nBlockPeerLink::readOutput64(uint32_t outputNumber) {
+    return (outputNumber < this->_num_channels) ? this->_out_value[outputNumber] : 0;
+}
+
+void nBlockPeerLink::triggerInput(nBlocks_Message message) {
+    this->triggerInputs(&message, 1);
+}
+
+/**
+ *  \brief Appends the messages to the packet of this frame, payloads
+ *  included, since those are only valid until the end of the frame
+ */
+void nBlockPeerLink::triggerInputs(const nBlocks_Message * messages, uint32_t count) {
+    const nBlocks_Message * message;
+    const uint8_t * payload;
+    LinkRecord record;
+    uint64_t value;
+    uint32_t i, size;
+
+    for (i=0; i<count; i++) {
+        message = &(messages[i]);
+        if (message->inputNumber >= this->_num_channels) continue;
+        record.channel = (uint16_t)(message->inputNumber);
+        record.type = (uint8_t)(message->dataType);
+        record.reserved = 0;
+        record.length = message->dataLength;
+        record.payload = PayloadSize(message, this->_element_size[message->inputNumber]);
+        size = sizeof(record) + ((record.payload + 3) & ~3u);
+        if ((this->_packet_used + size) > NBLOCKS_LINK_BUFFER) {
+            this->_stats.droppedMessages++;
+            continue;
+        }
+
+        value = 0;
+        payload = 0;
+        switch (message->dataType) {
+            case OUTPUT_TYPE_INT:
+                value = message->intValue;
+                break;
+            case OUTPUT_TYPE_FLOAT:
+                memcpy(&value, &(message->floatValue), sizeof(message->floatValue));
+                break;
+            case OUTPUT_TYPE_INT64:
+            case OUTPUT_TYPE_DOUBLE:
+                memcpy(&value, &(message->int64Value), sizeof(value));
+                break;
+            case OUTPUT_TYPE_STRING:
+                payload = (const uint8_t *)(message->stringValue);
+                break;
+            default:
+                payload = (const uint8_t *)(uintptr_t)(message->pointerValue);
+                break;
+        }
+        memcpy(record.value, &value, sizeof(value));
+
+        memcpy(&(this->_packet[this->_packet_used]), &record, sizeof(record));
+        if (record.payload > 0) {
+            memcpy(&(this->_packet[this->_packet_used + sizeof(record)]), payload, record.payload);
+            memset(&(this->_packet[this->_packet_used + sizeof(record) + record.payload]), 0, size - sizeof(record) - record.payload);
+        }
+        this->_packet_used += size;
+        this->_packet_count++;
+    }
+}
+
+/**
+ *  \brief Writes as many waiting bytes as the transport takes
+ *
+ *  \return Bytes still waiting
+ */
+uint32_t nBlockPeerLink::flush(void) {
+    uint32_t n;
+
+    if (this->_tx_used > this->_tx_sent) {
+        n = this->_transport.write(this->_transport.context, &(this->_tx[this->_tx_sent]), this->_tx_used - this->_tx_sent);
+        this->_tx_sent += n;
+        this->_stats.bytesSent += n;
+    }
+    if (this->_tx_sent == this->_tx_used) {
+        this->_tx_sent = 0;
+        this->_tx_used = 0;
+    }
+    return this->_tx_used - this->_tx_sent;
+}
+
+/**
+ *  \brief Closes the packet of this frame and queues it, waiting for
+ *  room if the bytes of previous frames are still being written
+ */
+void nBlockPeerLink::send(void) {
+    LinkHeader header;
+    uint32_t start = LinkClock();
+
+    header.magic = LINK_MAGIC;
+    header.frame = this->_frame;
+    header.size = this->_packet_used - sizeof(header);
+    header.count = this->_packet_count;
+    memcpy(this->_packet, &header, sizeof(header));
+
+    while ((this->_tx_used + this->_packet_used) > NBLOCKS_LINK_BUFFER) {
+        if (this->_tx_sent > 0) {
+            memmove(this->_tx, &(this->_tx[this->_tx_sent]), this->_tx_used - this->_tx_sent);
+            this->_tx_used -= this->_tx_sent;
+            this->_tx_sent = 0;
+            continue;
+        }
+        this->flush();
+        if ((LinkClock() - start) > NBLOCKS_LINK_TIMEOUT_US) {
+            // The peer stopped reading: lose this frame's packet
+            this->_stats.timeouts++;
+            this->_stats.droppedMessages += this->_packet_count;
+            this->_packet_used = sizeof(header);
+            this->_packet_count = 0;
+            return;
+        }
+    }
+    memcpy(&(this->_tx[this->_tx_used]), this->_packet, this->_packet_used);
+    this->_tx_used += this->_packet_used;
+    this->_stats.packetsSent++;
+    this->_packet_used = sizeof(header);
+    this->_packet_count = 0;
+    this->flush();
+}
+
+/**
+ *  \brief Reads as many bytes as the transport has and there is room for
+ *
+ *  \return Bytes read
+ */
+uint32_t nBlockPeerLink::receive(void) {
+    uint32_t n = 0;
+
+    if (this->_rx_used < NBLOCKS_LINK_BUFFER) {
+        n = this->_transport.read(this->_transport.context, &(this->_rx[this->_rx_used]), NBLOCKS_LINK_BUFFER - this->_rx_used);
+        this->_rx_used += n;
+        this->_stats.bytesReceived += n;
+    }
+    return n;
+}
+
+/**
+ *  \brief Decodes the complete packets received up to frame wanted into
+ *  the outputs, older packets first. Packets of later frames are kept.
+ *
+ *  \return Nonzero if the packet of frame wanted was decoded
+ */
+uint32_t nBlockPeerLink::decode(uint32_t wanted) {
+    LinkHeader header;
+    LinkRecord record;
+    uint8_t * data;
+    uint32_t offset, i, c, found = 0;
+
+    while ((found == 0) && (this->_rx_used >= sizeof(header))) {
+        memcpy(&header, this->_rx, sizeof(header));
+        if ((header.magic != LINK_MAGIC) || (header.size > (NBLOCKS_LINK_BUFFER - sizeof(header)))) {
+            // Not at a packet start (e.g. a serial link joined midway)
+            memmove(this->_rx, &(this->_rx[1]), this->_rx_used - 1);
+            this->_rx_used--;
+            this->_stats.resyncBytes++;
+            continue;
+        }
+        if (this->_rx_used < (sizeof(header) + header.size)) break;
+        if ((int32_t)(header.frame - wanted) > 0) break;
+
+        offset = sizeof(header);
+        for (i=0; (i < header.count) && ((offset + sizeof(record)) <= (sizeof(header) + header.size)); i++) {
+            memcpy(&record, &(this->_rx[offset]), sizeof(record));
+            offset += sizeof(record);
+            c = record.channel;
+            if (c < this->_num_channels) {
+                this->_out_type[c] = (nBlocks_OutputType)(record.type);
+                this->_out_available[c] = record.length;
+                if (record.payload > 0) {
+                    // Valid until the end of the next frame, when receivers are done
+                    data = (uint8_t *)KernelFrameAlloc(record.payload + 1);
+                    if (data == 0) {
+                        this->_out_available[c] = 0;
+                        this->_stats.droppedMessages++;
+                    }
+                    else {
+                        memcpy(data, &(this->_rx[offset]), record.payload);
+                        // Strings get their terminator back
+                        data[record.payload] = 0;
+                        this->_out_value[c] = (uint64_t)(uintptr_t)data;
+                    }
+                }
+                else memcpy(&(this->_out_value[c]), record.value, sizeof(uint64_t));
+            }
+            offset += (record.payload + 3) & ~3u;
+        }
+
+        this->_rx_used -= sizeof(header) + header.size;
+        memmove(this->_rx, &(this->_rx[sizeof(header) + header.size]), this->_rx_used);
+        this->_stats.packetsReceived++;
+        if (header.frame == wanted) found = 1;
+    }
+    return found;
+}
+
+void nBlockPeerLink::step(void) {
+    uint32_t wanted, start, found, c, dirty = 0;
+
+    // One packet per frame, empty ones included, keeps both ends aligned
+    this->send();
+
+    for (c=0; c<this->_num_channels; c++) this->_out_available[c] = 0;
+    this->receive();
+    if (this->_frame >= this->_latency) {
+        wanted = this->_frame - this->_latency;
+        found = this->decode(wanted);
+        if (found == 0) {
+            this->_stats.lateFrames++;
+            if (this->_mode == LINK_LOCKSTEP) {
+                start = LinkClock();
+                while (found == 0) {
+                    // The peer may be waiting for our bytes too
+                    this->flush();
+                    this->receive();
+                    found = this->decode(wanted);
+                    if ((found == 0) && ((LinkClock() - start) > NBLOCKS_LINK_TIMEOUT_US)) {
+                        this->_stats.timeouts++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    this->_frame++;
+
+    for (c=0; c<this->_num_channels; c++) {
+        if (this->_out_available[c]) dirty |= NBLOCKS_OUTPUT_BIT(c);
+    }
+    this->setDirtyOutputs(dirty);
+}
+
+
+
+// TRANSPORTS
+void LinkClose(nBlocks_LinkTransport * transport) {
+    if (transport->close) transport->close(transport->context);
+    transport->close = 0;
+    transport->context = 0;
+}
+
+#ifdef TARGET_HOST
+
+/**
+ *  File descriptors of LinkOpenFd()
+ */
+typedef struct LinkFd {
+    int read_fd;
+    int write_fd;
+} LinkFd;
+
+static uint32_t FdWrite(void * context, const uint8_t * data, uint32_t size) {
+    LinkFd * fds = (LinkFd *)context;
+    ssize_t n;
+
+    // No SIGPIPE when the peer is gone
+    n = send(fds->write_fd, data, size, MSG_NOSIGNAL);
+    if ((n < 0) && (errno == ENOTSOCK)) n = write(fds->write_fd, data, size);
+    return (n > 0) ? (uint32_t)n : 0;
+}
+
+static uint32_t FdRead(void * context, uint8_t * data, uint32_t size) {
+    LinkFd * fds = (LinkFd *)context;
+    ssize_t n = read(fds->read_fd, data, size);
+    return (n > 0) ? (uint32_t)n : 0;
+}
+
+static void FdClose(void * context) {
+    LinkFd * fds = (LinkFd *)context;
+    close(fds->read_fd);
+    if (fds->write_fd != fds->read_fd) close(fds->write_fd);
+    delete fds;
+}
+
+int LinkOpenFd(nBlocks_LinkTransport * transport, int read_fd, int write_fd) {
+    LinkFd * fds;
+
+    if ((fcntl(read_fd, F_SETFL, fcntl(read_fd, F_GETFL) | O_NONBLOCK) < 0) ||
+        (fcntl(write_fd, F_SETFL, fcntl(write_fd, F_GETFL) | O_NONBLOCK) < 0)) return -1;
+    fds = new LinkFd;
+    fds->read_fd = read_fd;
+    fds->write_fd = write_fd;
+    transport->write = &FdWrite;
+    transport->read = &FdRead;
+    transport->close = &FdClose;
+    transport->context = fds;
+    return 0;
+}
+
+int LinkOpenSocketPair(nBlocks_LinkTransport * a, nBlocks_LinkTransport * b) {
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) return -1;
+    if ((LinkOpenFd(a, fds[0], fds[0]) < 0) || (LinkOpenFd(b, fds[1], fds[1]) < 0)) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    return 0;
+}
+
+int LinkOpenUnix(nBlocks_LinkTransport * transport, const char * path, uint32_t listen) {
+    struct sockaddr_un address;
+    int fd, peer;
+
+    if (strlen(path) >= sizeof(address.sun_path)) return -1;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    if (listen) {
+        unlink(path);
+        if ((bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) || (::listen(fd, 1) < 0)) {
+            close(fd);
+            return -1;
+        }
+        peer = accept(fd, 0, 0);
+        close(fd);
+        unlink(path);
+        fd = peer;
+        if (fd < 0) return -1;
+    }
+    else if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (LinkOpenFd(transport, fd, fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ *  Byte ring of LinkOpenShm(), written by one side only. Indices run
+ *  free and wrap modulo the ring size. Each one has its own cache line.
+ */
+typedef struct LinkShmRing {
+    volatile uint32_t head;
+    uint32_t pad0[15];
+    volatile uint32_t tail;
+    uint32_t pad1[15];
+} LinkShmRing;
+
+/**
+ *  Mapping of LinkOpenShm(): two rings (side 0 writes ring 0), then the
+ *  bytes of ring 0 and of ring 1
+ */
+typedef struct LinkShm {
+    uint8_t * map;
+    uint32_t map_size;
+    uint32_t size;
+    LinkShmRing * out;
+    LinkShmRing * in;
+    uint8_t * out_data;
+    uint8_t * in_data;
+    uint32_t side;
+    char name[64];
+} LinkShm;
+
+static uint32_t ShmWrite(void * context, const uint8_t * data, uint32_t size) {
+    LinkShm * shm = (LinkShm *)context;
+    uint32_t head = shm->out->head;
+    uint32_t tail = __atomic_load_n(&(shm->out->tail), __ATOMIC_ACQUIRE);
+    uint32_t offset = head & (shm->size - 1);
+    uint32_t n, first;
+
+    n = shm->size - (head - tail);
+    if (n > size) n = size;
+    first = shm->size - offset;
+    if (first > n) first = n;
+    memcpy(&(shm->out_data[offset]), data, first);
+    memcpy(shm->out_data, &(data[first]), n - first);
+    __atomic_store_n(&(shm->out->head), head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+static uint32_t ShmRead(void * context, uint8_t * data, uint32_t size) {
+    LinkShm * shm = (LinkShm *)context;
+    uint32_t tail = shm->in->tail;
+    uint32_t head = __atomic_load_n(&(shm->in->head), __ATOMIC_ACQUIRE);
+    uint32_t offset = tail & (shm->size - 1);
+    uint32_t n, first;
+
+    n = head - tail;
+    if (n > size) n = size;
+    first = shm->size - offset;
+    if (first > n) first = n;
+    memcpy(data, &(shm->in_data[offset]), first);
+    memcpy(&(data[first]), shm->in_data, n - first);
+    __atomic_store_n(&(shm->in->tail), tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+static void ShmClose(void * context) {
+    LinkShm * shm = (LinkShm *)context;
+    munmap(shm->map, shm->map_size);
+    if (shm->side == 0) shm_unlink(shm->name);
+    delete shm;
+}
+
+int LinkOpenShm(nBlocks_LinkTransport * transport, const char * name, uint32_t side, uint32_t size) {
+    LinkShm * shm;
+    LinkShmRing * rings;
+    uint32_t map_size;
+    void * map;
+    int fd;
+
+    if ((size == 0) || (size & (size - 1)) || (side > 1) || (strlen(name) >= sizeof(shm->name))) return -1;
+    map_size = 2 * sizeof(LinkShmRing) + 2 * size;
+    // Both sides may create it: a new object is zero filled, so both
+    // rings start empty
+    fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, map_size) < 0) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    shm = new LinkShm;
+    shm->map = (uint8_t *)map;
+    shm->map_size = map_size;
+    shm->size = size;
+    rings = (LinkShmRing *)map;
+    shm->out = &(rings[side]);
+    shm->in = &(rings[side ^ 1]);
+    shm->out_data = &(shm->map[2 * sizeof(LinkShmRing) + side * size]);
+    shm->in_data = &(shm->map[2 * sizeof(LinkShmRing) + (side ^ 1) * size]);
+    shm->side = side;
+    strcpy(shm->name, name);
+    transport->write = &ShmWrite;
+    transport->read = &ShmRead;
+    transport->close = &ShmClose;
+    transport->context = shm;
+    return 0;
+}
+
+#else
+
+static uint32_t SerialWrite(void * context, const uint8_t * data, uint32_t size) {
+    Serial * port = (Serial *)context;
+    uint32_t i;
+    for (i=0; (i < size) && port->writeable(); i++) port->putc(data[i]);
+    return i;
+}
+
+static uint32_t SerialRead(void * context, uint8_t * data, uint32_t size) {
+    Serial * port = (Serial *)context;
+    uint32_t i;
+    for (i=0; (i < size) && port->readable(); i++) data[i] = port->getc();
+    return i;
+}
+
+void LinkOpenSerial(nBlocks_LinkTransport * transport, Serial * port) {
+    transport->write = &SerialWrite;
+    transport->read = &SerialRead;
+    transport->close = 0;
+    transport->context = port;
+}
+
+#endif
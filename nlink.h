@@ -0,0 +1,249 @@
+/**
+ *  \file nlink.h
+ *  \brief Links between kernels: graphs partitioned across boards and
+ *  processes
+ *
+ *  \details An nBlockPeerLink node stands for a peer kernel (another
+ *  board, process or workbench). Local outputs connected to its inputs
+ *  (channels) are shipped to the peer, and the peer's messages come out
+ *  of its outputs, on the same channel numbers:
+ *
+ *      // Board A
+ *      nBlockPeerLink link(transport, 4);
+ *      nBlockRemoteConnection n_conn_1(&adc, 0, &link, 0);
+ *      // Board B
+ *      nBlockPeerLink link(transport, 4);
+ *      nBlockRemoteConnection n_conn_1(&link, 0, &filter, 0);
+ *
+ *  Each frame, the link step() sends one packet holding every message
+ *  it received in that frame, tagged with the frame number, then takes
+ *  the peer's packet of frame (current - latency). Payloads of STRING,
+ *  ARRAY and block messages travel inside the packet, and are copied
+ *  into the frame arena on arrival (see KernelFrameAlloc() ), so the
+ *  arena must hold the payloads of one frame.
+ *
+ *  With LINK_LOCKSTEP, step() waits for the expected packet, so both
+ *  kernels process the same messages in the same frames and the
+ *  partitioned graph gives the same results on every run: a value takes
+ *  latency + 1 frames more than through a local connection. Kernels
+ *  must share the frame period; the one started first waits for the
+ *  other. A packet missing for NBLOCKS_LINK_TIMEOUT_US is given up
+ *  (counted in timeouts). Frames spent waiting count as overruns, so a
+ *  kernel whose peer may stop should skip them rather than replay them
+ *  (see KernelOverrunPolicy() ). With LINK_FREE_RUNNING, step() never
+ *  waits and takes whatever packets arrived, which tolerates drifting
+ *  clocks but is not deterministic.
+ *
+ *  Transports move bytes without blocking (nBlocks_LinkTransport):
+ *    - a Serial port on the target (LinkOpenSerial() ). Other buses such
+ *      as SPI plug in by filling an nBlocks_LinkTransport.
+ *    - pipes, Unix sockets and a shared memory ring on the host
+ *
+ *  Packets are little endian on both sides, as on every supported
+ *  target. A link steps every frame: setRate() does not apply to it.
+ */
+
+#ifndef _NLINK
+#define _NLINK
+
+#include "nworkbench.h"
+
+/**
+ *  \brief Bytes of each of the link buffers (outgoing packet, bytes
+ *  waiting to be sent, bytes received)
+ */
+#ifndef NBLOCKS_LINK_BUFFER
+#ifdef TARGET_HOST
+#define NBLOCKS_LINK_BUFFER     65536
+#else
+#define NBLOCKS_LINK_BUFFER     512
+#endif
+#endif
+
+/**
+ *  \brief Longest wait for a packet with LINK_LOCKSTEP, in microseconds
+ */
+#ifndef NBLOCKS_LINK_TIMEOUT_US
+#define NBLOCKS_LINK_TIMEOUT_US 1000000
+#endif
+
+/**
+ *  \brief Byte mover used by a link. Both functions must return at
+ *  once, having moved as many bytes as possible (0 included).
+ */
+typedef struct nBlocks_LinkTransport {
+    /** Writes up to size bytes, returns the number written */
+    uint32_t (*write)(void * context, const uint8_t * data, uint32_t size);
+    /** Reads up to size bytes, returns the number read */
+    uint32_t (*read)(void * context, uint8_t * data, uint32_t size);
+    /** Releases the context, called by LinkClose(). May be 0. */
+    void (*close)(void * context);
+    void * context;
+} nBlocks_LinkTransport;
+
+/**
+ *  \brief Link synchronization modes, see nlink.h
+ */
+enum nBlocks_LinkModes {
+    LINK_LOCKSTEP,
+    LINK_FREE_RUNNING
+};
+
+/**
+ *  \brief Link counters, see nBlockPeerLink::getStats()
+ */
+typedef struct nBlocks_LinkStats {
+    uint32_t packetsSent;
+    uint32_t packetsReceived;
+    uint32_t bytesSent;
+    uint32_t bytesReceived;
+    /** Frames whose packet from the peer was not there in time */
+    uint32_t lateFrames;
+    /** LINK_LOCKSTEP waits given up after NBLOCKS_LINK_TIMEOUT_US */
+    uint32_t timeouts;
+    /** Messages lost: outgoing packet full, or no frame arena left */
+    uint32_t droppedMessages;
+    /** Bytes skipped to find the start of a packet */
+    uint32_t resyncBytes;
+} nBlocks_LinkStats;
+
+#ifdef TARGET_HOST
+
+/**
+ *  \brief Transport over file descriptors, e.g. the two ends of two
+ *  pipes, or a socket (same descriptor twice). The descriptors are set
+ *  non-blocking, and closed by LinkClose().
+ *
+ *  \return 0 on success, -1 on error
+ */
+int LinkOpenFd(nBlocks_LinkTransport * transport, int read_fd, int write_fd);
+
+/**
+ *  \brief Two connected transports over a Unix socket pair, e.g. for
+ *  two workbenches of one process, or a parent and a forked child
+ *
+ *  \return 0 on success, -1 on error
+ */
+int LinkOpenSocketPair(nBlocks_LinkTransport * a, nBlocks_LinkTransport * b);
+
+/**
+ *  \brief Transport over a Unix stream socket at path. The listening
+ *  side (listen nonzero) waits for the peer to connect.
+ *
+ *  \return 0 on success, -1 on error
+ */
+int LinkOpenUnix(nBlocks_LinkTransport * transport, const char * path, uint32_t listen);
+
+/**
+ *  \brief Transport over two lock-free byte rings in POSIX shared
+ *  memory. Both processes open the same name (as for shm_open(), e.g.
+ *  "/nblocks_link"), one with side 0 and the other with side 1, and the
+ *  same ring size in bytes (a power of two). Side 0 removes the name
+ *  when closed.
+ *
+ *  \return 0 on success, -1 on error
+ */
+int LinkOpenShm(nBlocks_LinkTransport * transport, const char * name, uint32_t side, uint32_t size);
+
+#else
+
+/**
+ *  \brief Transport over a Serial port. Bytes are only written while
+ *  the port is writeable, and only read while it is readable.
+ */
+void LinkOpenSerial(nBlocks_LinkTransport * transport, Serial * port);
+
+#endif
+
+/**
+ *  \brief Releases a transport
+ */
+void LinkClose(nBlocks_LinkTransport * transport);
+
+/**
+ *  \brief Node standing for a peer kernel, see nlink.h. Inputs and
+ *  outputs are the channels, messages sent on input channel c come out
+ *  of output c of the peer's link.
+ */
+class nBlockPeerLink: public nBlockNode {
+public:
+    /**
+     *  \param [in] transport Transport to the peer. The link does not
+     *  close it: call LinkClose() after deleting the link.
+     *  \param [in] num_channels Number of channels in each direction
+     *  \param [in] latency Frames between sending a packet and using
+     *  the peer's packet of the same frame, at least 1
+     *  \param [in] mode One of nBlocks_LinkModes
+     */
+    nBlockPeerLink(nBlocks_LinkTransport transport, uint32_t num_channels, uint32_t latency = 1,
+        nBlocks_LinkModes mode = LINK_LOCKSTEP);
+    ~nBlockPeerLink(void);
+
+    /**
+     *  \brief Sets the size in bytes of the elements of ARRAY messages
+     *  sent on a channel, 4 by default
+     */
+    void setElementSize(uint32_t channel, uint32_t size);
+
+    /**
+     *  \brief Returns the link counters
+     */
+    nBlocks_LinkStats getStats(void) { return _stats; }
+
+    uint32_t outputAvailable(uint32_t outputNumber);
+    nBlocks_OutputType readOutputType(uint32_t outputNumber);
+    nBlocks_Handle readOutput(uint32_t outputNumber);
+    uint64_t readOutput64(uint32_t outputNumber);
+    void triggerInput(nBlocks_Message message);
+    void triggerInputs(const nBlocks_Message * messages, uint32_t count);
+    void step(void);
+
+private:
+    uint32_t flush(void);
+    void send(void);
+    uint32_t receive(void);
+    uint32_t decode(uint32_t wanted);
+
+    nBlocks_LinkTransport _transport;
+    uint32_t _num_channels;
+    uint32_t _latency;
+    uint32_t _mode;
+    uint32_t _frame;
+    nBlocks_LinkStats _stats;
+
+    // Messages of the frame, after room for the packet header
+    uint8_t * _packet;
+    uint32_t _packet_used;
+    uint32_t _packet_count;
+    // Bytes _tx[_tx_sent] to [_tx_used-1] wait to be written
+    uint8_t * _tx;
+    uint32_t _tx_used;
+    uint32_t _tx_sent;
+    // Bytes received, not yet decoded
+    uint8_t * _rx;
+    uint32_t _rx_used;
+
+    // Per channel: element size of outgoing arrays, and the output
+    // received in the last step (available 0 if none)
+    uint8_t * _element_size;
+    nBlocks_OutputType * _out_type;
+    uint64_t * _out_value;
+    uint32_t * _out_available;
+};
+
+/**
+ *  \brief Connection between a local node and a link channel. It is an
+ *  nBlockConnection to or from the link node, spelled after what it
+ *  stands for: a connection to or from a node of the peer kernel.
+ */
+class nBlockRemoteConnection: public nBlockConnection {
+public:
+    /** \brief Ships output outputNumber of srcBlock on a link channel */
+    nBlockRemoteConnection(nBlockNode * srcBlock, uint32_t outputNumber, nBlockPeerLink * link, uint32_t channel):
+        nBlockConnection(srcBlock, outputNumber, link, channel) { }
+    /** \brief Delivers a link channel to input inputNumber of dstBlock */
+    nBlockRemoteConnection(nBlockPeerLink * link, uint32_t channel, nBlockNode * dstBlock, uint32_t inputNumber):
+        nBlockConnection(link, channel, dstBlock, inputNumber) { }
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include "nprofile.h"
+
+#ifdef NBLOCKS_PROFILE
+
+#include "nworkbench.h"
+
+#ifdef TARGET_HOST
+#include <time.h>
+#elif !defined(TARGET_LPC1768)
+#include "us_ticker_api.h"
+#endif
+
+// Per node statistics, indexed by node table index
+uint32_t __profile_nodes = 0;
+nBlocks_ProfileStats * __profile_step = 0;
+nBlocks_ProfileStats * __profile_propagate = 0;
+// Frame statistics, indexed by nBlocks_ProfileStages
+nBlocks_ProfileStats __profile_frame[3];
+
+static void ClearStats(nBlocks_ProfileStats * stats, uint32_t count) {
+    uint32_t i;
+    memset(stats, 0, count * sizeof(nBlocks_ProfileStats));
+    for (i=0; i<count; i++) stats[i].min = 0xFFFFFFFF;
+}
+
+static inline void RecordStats(nBlocks_ProfileStats * stats, uint32_t elapsed) {
+    uint32_t bin = 0;
+    uint32_t v = elapsed;
+
+    stats->count++;
+    stats->total += elapsed;
+    if (elapsed < stats->min) stats->min = elapsed;
+    if (elapsed > stats->max) stats->max = elapsed;
+    // Integer log2
+    while ((v > 1) && (bin < (NBLOCKS_PROFILE_BINS - 1))) {
+        v >>= 1;
+        bin++;
+    }
+    stats->histogram[bin]++;
+}
+
+const char * KernelProfileUnit(void) {
+#if defined(TARGET_HOST)
+    return "ns";
+#elif defined(TARGET_LPC1768)
+    return "cycles";
+#else
+    return "us";
+#endif
+}
+
+uint32_t ProfileClock(void) {
+#if defined(TARGET_HOST)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec);
+#elif defined(TARGET_LPC1768)
+    return DWT->CYCCNT;
+#else
+    return us_ticker_read();
+#endif
+}
+
+void ProfileSetup(uint32_t num_nodes) {
+#if defined(TARGET_LPC1768)
+    // Enable the DWT cycle counter
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+    delete[] __profile_step;
+    delete[] __profile_propagate;
+    __profile_nodes = num_nodes;
+    __profile_step = new nBlocks_ProfileStats [num_nodes];
+    __profile_propagate = new nBlocks_ProfileStats [num_nodes];
+    KernelProfileReset();
+}
+
+void ProfileRecordNode(uint32_t index, uint32_t stage, uint32_t elapsed) {
+    if (index >= __profile_nodes) return;
+    if (stage == PROFILE_STAGE_STEP) RecordStats(&(__profile_step[index]), elapsed);
+    else RecordStats(&(__profile_propagate[index]), elapsed);
+}
+
+void ProfileRecordFrame(uint32_t stage, uint32_t elapsed) {
+    RecordStats(&(__profile_frame[stage]), elapsed);
+}
+
+void KernelProfileReset(void) {
+    ClearStats(__profile_step, __profile_nodes);
+    ClearStats(__profile_propagate, __profile_nodes);
+    ClearStats(__profile_frame, 3);
+}
+
+const nBlocks_ProfileStats * KernelProfileNode(nBlockNode * node, nBlocks_ProfileStages stage) {
+    uint32_t index = node->getIndex();
+    if (index >= __profile_nodes) return 0;
+    if (stage == PROFILE_STAGE_STEP) return &(__profile_step[index]);
+    if (stage == PROFILE_STAGE_PROPAGATE) return &(__profile_propagate[index]);
+    return 0;
+}
+
+const nBlocks_ProfileStats * KernelProfileFrame(nBlocks_ProfileStages stage) {
+    return &(__profile_frame[stage]);
+}
+
+/**
+ *  \brief Formats one statistics line: label, count, min/avg/max and
+ *  the histogram as "bin:count" pairs for non-empty bins
+ */
+static void DumpStats(void (*print)(const char * line), const char * label, const nBlocks_ProfileStats * stats) {
+    char line[64 + (NBLOCKS_PROFILE_BINS * 16)];
+    uint32_t len, i;
+
+    if (stats->count == 0) {
+        snprintf(line, sizeof(line), "%s n=0", label);
+        print(line);
+        return;
+    }
+    len = snprintf(line, sizeof(line), "%s n=%lu min=%lu avg=%lu max=%lu hist",
+        label, (unsigned long)(stats->count), (unsigned long)(stats->min),
+        (unsigned long)(stats->total / stats->count), (unsigned long)(stats->max));
+    for (i=0; (i<NBLOCKS_PROFILE_BINS) && (len < sizeof(line)); i++) {
+        if (stats->histogram[i] == 0) continue;
+        len += snprintf(line + len, sizeof(line) - len, " %lu:%lu", (unsigned long)i, (unsigned long)(stats->histogram[i]));
+    }
+    print(line);
+}
+
+void KernelProfileDump(void (*print)(const char * line)) {
+    char label[64];
+    uint32_t i;
+
+    snprintf(label, sizeof(label), "unit %s, hist bin i = [2^i, 2^(i+1))", KernelProfileUnit());
+    print(label);
+    DumpStats(print, "frame", &(__profile_frame[PROFILE_STAGE_FRAME]));
+    DumpStats(print, "propagate", &(__profile_frame[PROFILE_STAGE_PROPAGATE]));
+    DumpStats(print, "step", &(__profile_frame[PROFILE_STAGE_STEP]));
+    for (i=0; i<__profile_nodes; i++) {
+        snprintf(label, sizeof(label), "node %lu step", (unsigned long)i);
+        DumpStats(print, label, &(__profile_step[i]));
+        snprintf(label, sizeof(label), "node %lu propagate", (unsigned long)i);
+        DumpStats(print, label, &(__profile_propagate[i]));
+    }
+}
+
+#endif
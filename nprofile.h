@@ -0,0 +1,134 @@
+/**
+ *  \file nprofile.h
+ *  \brief n-Blocks Studio Kernel frame profiler
+ *
+ *  \details Optional instrumentation of ProgressNodes(), enabled by
+ *  defining NBLOCKS_PROFILE when compiling the kernel. It records, for
+ *  every node, the cost of its step() and of propagating its outputs,
+ *  plus the cost of whole frames and of each frame stage.
+ *
+ *  Times are measured with:
+ *    - the DWT cycle counter on Cortex-M3 (TARGET_LPC1768): CPU cycles
+ *    - the monotonic clock on the host (TARGET_HOST): nanoseconds
+ *    - the mbed microsecond ticker elsewhere: microseconds
+ *
+ *  Stage totals (PROFILE_STAGE_STEP/PROPAGATE in KernelProfileFrame)
+ *  are only recorded with KERNEL_SCHEDULE_STAGED, where stages are
+ *  separate. Frames processed before SetupWorkbench() compiled the node
+ *  table are not profiled. Per node propagate times cover reading the
+ *  node outputs, plus delivering them (triggerInputs() ) to receivers
+ *  with a single input connection, which get them right away. Delivery
+ *  to receivers with several inputs is batched per receiver, and is
+ *  only in the stage total. With KernelParallelStages(), connections are
+ *  propagated by destination, so per node propagate times are not
+ *  recorded. Only the default workbench is profiled (see nWorkbench).
+ *
+ *  When NBLOCKS_PROFILE is not defined the kernel hooks expand to
+ *  nothing, and the API below is not available.
+ */
+
+#ifndef _NPROFILE
+#define _NPROFILE
+
+#include "mbed.h"
+
+#ifdef NBLOCKS_PROFILE
+
+/**
+ *  \brief Number of histogram bins. Bin i counts samples in
+ *  [2^i, 2^(i+1)) time units, bin 0 also counts 0, and the last bin
+ *  counts everything above.
+ */
+#ifndef NBLOCKS_PROFILE_BINS
+#define NBLOCKS_PROFILE_BINS 24
+#endif
+
+class nBlockNode;
+
+/**
+ *  \brief Profiled stages
+ */
+enum nBlocks_ProfileStages {
+    PROFILE_STAGE_STEP,         /**< step() of a node / step stage of a frame */
+    PROFILE_STAGE_PROPAGATE,    /**< outputs of a node / propagate stage of a frame */
+    PROFILE_STAGE_FRAME         /**< whole frame (frame totals only) */
+};
+
+/**
+ *  \brief Statistics of one profiled item
+ */
+typedef struct nBlocks_ProfileStats {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t histogram[NBLOCKS_PROFILE_BINS];
+} nBlocks_ProfileStats;
+
+/**
+ *  \brief Name of the profiler time unit ("cycles", "ns" or "us")
+ */
+const char * KernelProfileUnit(void);
+
+/**
+ *  \brief Clears all statistics
+ */
+void KernelProfileReset(void);
+
+/**
+ *  \brief Returns the statistics of one node.
+ *
+ *  \param [in] node Node registered in the kernel
+ *  \param [in] stage PROFILE_STAGE_STEP or PROFILE_STAGE_PROPAGATE
+ *  \return Statistics, or 0 if the node is unknown (e.g. created after
+ *  SetupWorkbench() )
+ */
+const nBlocks_ProfileStats * KernelProfileNode(nBlockNode * node, nBlocks_ProfileStages stage);
+
+/**
+ *  \brief Returns the statistics of whole frames or of a frame stage.
+ *
+ *  \param [in] stage One of nBlocks_ProfileStages
+ */
+const nBlocks_ProfileStats * KernelProfileFrame(nBlocks_ProfileStages stage);
+
+/**
+ *  \brief Prints all statistics as text, one line per call to print.
+ *  Lines have no line terminator. Suitable for dumping over serial:
+ *
+ *      void printLine(const char * line) { pc.printf("%s\r\n", line); }
+ *      ...
+ *      KernelProfileDump(&printLine);
+ *
+ *  \param [in] print Function called for each line
+ */
+void KernelProfileDump(void (*print)(const char * line));
+
+// Kernel interface
+void ProfileSetup(uint32_t num_nodes);
+uint32_t ProfileClock(void);
+void ProfileRecordNode(uint32_t index, uint32_t stage, uint32_t elapsed);
+void ProfileRecordFrame(uint32_t stage, uint32_t elapsed);
+
+// Condition for the hooks to record, see nWorkbench
+#ifndef NBLOCKS_INSTRUMENTED
+#define NBLOCKS_INSTRUMENTED 1
+#endif
+
+#define NBLOCKS_PROFILE_VAR(t)                  uint32_t t
+#define NBLOCKS_PROFILE_START(t)                t = ProfileClock()
+#define NBLOCKS_PROFILE_NODE(index, stage, t)   do { if (NBLOCKS_INSTRUMENTED) ProfileRecordNode((index), (stage), ProfileClock() - (t)); } while (0)
+#define NBLOCKS_PROFILE_FRAME(stage, t)         do { if (NBLOCKS_INSTRUMENTED) ProfileRecordFrame((stage), ProfileClock() - (t)); } while (0)
+#define NBLOCKS_PROFILE_SETUP(num_nodes)        do { if (NBLOCKS_INSTRUMENTED) ProfileSetup(num_nodes); } while (0)
+
+#else
+
+#define NBLOCKS_PROFILE_VAR(t)
+#define NBLOCKS_PROFILE_START(t)
+#define NBLOCKS_PROFILE_NODE(index, stage, t)
+#define NBLOCKS_PROFILE_FRAME(stage, t)
+#define NBLOCKS_PROFILE_SETUP(num_nodes)
+
+#endif
+
+#endif
@@ -0,0 +1,478 @@
+#include "ntrace.h"
+
+#ifdef NBLOCKS_TRACE
+
+#include "nworkbench.h"
+#include "fifo.h"
+
+#ifdef TARGET_HOST
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#else
+#include "us_ticker_api.h"
+#endif
+
+// Records waiting to be drained: the frame loop puts, the drain gets
+basic_fifo<nBlocks_TraceRecord, NBLOCKS_TRACE_RECORDS> __trace_fifo;
+uint32_t __trace_enabled = 1;
+uint32_t __trace_frame = 0;
+// Records dropped in total, and since the last TRACE_LOST record
+uint32_t __trace_lost = 0;
+uint32_t __trace_lost_pending = 0;
+// Nonzero per connection with NBLOCKS_TRACE_BACK_EDGE
+uint8_t * __trace_back = 0;
+uint32_t __trace_connections = 0;
+// Nonzero if the graph has too many connections to be recorded
+uint32_t __trace_oversized = 0;
+
+// Writer, and the record being written by the drain
+nBlocks_TraceWriter __trace_writer = 0;
+void * __trace_writer_context = 0;
+nBlocks_TraceRecord __trace_out;
+uint32_t __trace_out_offset = sizeof(nBlocks_TraceRecord);
+
+// One of nBlocks_TraceReplayModes while replaying, else 0
+uint32_t __trace_replay = 0;
+
+#ifdef TARGET_HOST
+/**
+ *  Trace file header, followed by the records
+ */
+typedef struct TraceFileHeader {
+    char magic[4];          // "NBTR"
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t records;
+    uint32_t lost;
+    uint32_t reserved[3];
+} TraceFileHeader;
+
+// Mapped trace file
+int __trace_fd = -1;
+uint8_t * __trace_map = 0;
+uint32_t __trace_map_size = 0;
+uint32_t __trace_map_used = 0;
+uint32_t __trace_file_lost = 0;
+
+// Message records of the frame being replayed
+nBlocks_TraceRecord * __replay_messages = 0;
+uint32_t __replay_count = 0;
+uint32_t __replay_cursor = 0;
+nBlocks_TraceReplayStats __replay_stats;
+#endif
+
+static uint32_t TraceClock(void) {
+#ifdef TARGET_HOST
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec);
+#else
+    return us_ticker_read();
+#endif
+}
+
+/**
+ *  \brief 32-bit FNV-1a hash of a payload
+ */
+static uint32_t TraceHash(const uint8_t * data, uint32_t size) {
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+    for (i=0; i<size; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ *  \brief Fills the type, value and extra fields of a message record.
+ *  Arrays are hashed over dataLength bytes, the least any element size
+ *  guarantees.
+ */
+static void TraceEncode(const nBlocks_Message * message, nBlocks_TraceRecord * record) {
+    record->type = (uint8_t)(message->dataType);
+    record->extra = message->dataLength & ~NBLOCKS_TRACE_BACK_EDGE;
+    switch (message->dataType) {
+        case OUTPUT_TYPE_INT:
+            record->value = message->intValue;
+            break;
+        case OUTPUT_TYPE_FLOAT:
+            memcpy(&(record->value), &(message->floatValue), sizeof(record->value));
+            break;
+        case OUTPUT_TYPE_STRING:
+            record->value = TraceHash((const uint8_t *)(message->stringValue), message->dataLength);
+            break;
+        case OUTPUT_TYPE_INT_BLOCK:
+        case OUTPUT_TYPE_FLOAT_BLOCK:
+            record->value = TraceHash((const uint8_t *)(uintptr_t)(message->pointerValue), message->dataLength * sizeof(uint32_t));
+            break;
+        case OUTPUT_TYPE_INT64:
+        case OUTPUT_TYPE_DOUBLE:
+            record->value = TraceHash((const uint8_t *)&(message->int64Value), sizeof(message->int64Value));
+            break;
+        default:
+            record->value = TraceHash((const uint8_t *)(uintptr_t)(message->pointerValue), message->dataLength);
+            break;
+    }
+}
+
+static void TracePush(uint32_t kind, uint32_t type, uint32_t id, uint32_t value, uint32_t extra) {
+    nBlocks_TraceRecord record;
+
+    if ((__trace_enabled == 0) || (__trace_replay != 0) || (__trace_oversized != 0)) return;
+    record.frame = __trace_frame;
+    if (__trace_lost_pending > 0) {
+        // Report the gap as soon as there is room again
+        record.kind = TRACE_LOST;
+        record.type = 0;
+        record.id = 0;
+        record.value = __trace_lost_pending;
+        record.extra = 0;
+        if (__trace_fifo.put(record) == 0) __trace_lost_pending = 0;
+    }
+    record.kind = (uint8_t)kind;
+    record.type = (uint8_t)type;
+    record.id = (uint16_t)id;
+    record.value = value;
+    record.extra = extra;
+    if ((__trace_lost_pending > 0) || (__trace_fifo.put(record) != 0)) {
+        __trace_lost++;
+        __trace_lost_pending++;
+    }
+}
+
+const char * KernelTraceUnit(void) {
+#ifdef TARGET_HOST
+    return "ns";
+#else
+    return "us";
+#endif
+}
+
+void KernelTraceEnable(uint32_t enable) {
+    __trace_enabled = enable;
+}
+
+void KernelTraceAttach(nBlocks_TraceWriter writer, void * context) {
+    __trace_writer_context = context;
+    __trace_writer = writer;
+}
+
+uint32_t KernelTraceDrain(void) {
+    uint32_t written = 0;
+    uint32_t n;
+
+    if (__trace_writer == 0) return 0;
+    while (1) {
+        if (__trace_out_offset == sizeof(nBlocks_TraceRecord)) {
+            if (__trace_fifo.get(&__trace_out) != 0) break;
+            __trace_out_offset = 0;
+        }
+        n = __trace_writer(__trace_writer_context, ((const uint8_t *)&__trace_out) + __trace_out_offset,
+                sizeof(nBlocks_TraceRecord) - __trace_out_offset);
+        __trace_out_offset += n;
+        written += n;
+        if (__trace_out_offset < sizeof(nBlocks_TraceRecord)) break;
+    }
+    return written;
+}
+
+uint32_t KernelTraceLost(void) {
+    return __trace_lost;
+}
+
+void TraceSetup(uint32_t num_connections) {
+    delete[] __trace_back;
+    __trace_connections = num_connections;
+    // Ids above the 16 bit id field would alias other connections
+    __trace_oversized = (num_connections > NBLOCKS_TRACE_MAX_CONNECTIONS);
+    __trace_back = new uint8_t [num_connections];
+    memset(__trace_back, 0, num_connections);
+}
+
+void TraceSetBackEdge(uint32_t connection) {
+    if (connection < __trace_connections) __trace_back[connection] = 1;
+}
+
+void TraceFrameStart(uint32_t frame, uint32_t pending) {
+    __trace_frame = frame;
+    TracePush(TRACE_FRAME_START, 0, 0, TraceClock(), pending);
+}
+
+void TraceStageEnd(uint32_t stage) {
+    TracePush(TRACE_STAGE_END, stage, 0, TraceClock(), 0);
+}
+
+void TraceFrameEnd(void) {
+    TracePush(TRACE_FRAME_END, 0, 0, TraceClock(), 0);
+}
+
+#ifdef TARGET_HOST
+static void ReplayMismatch(uint32_t connection) {
+    if (__replay_stats.mismatches == 0) {
+        __replay_stats.firstMismatchFrame = __trace_frame;
+        __replay_stats.firstMismatchConnection = connection;
+    }
+    __replay_stats.mismatches++;
+}
+#endif
+
+void TraceMessage(uint32_t connection, const nBlocks_Message * message) {
+    nBlocks_TraceRecord record;
+
+#ifdef TARGET_HOST
+    if (__trace_replay == TRACE_REPLAY_VERIFY) {
+        // Compare with the next recorded message
+        if ((__replay_cursor < __replay_count) && (__replay_messages[__replay_cursor].id == connection)) {
+            TraceReplayCheck(&(__replay_messages[__replay_cursor]), message);
+        }
+        else ReplayMismatch(connection);
+        if (__replay_cursor < __replay_count) __replay_cursor++;
+        return;
+    }
+#endif
+    if ((__trace_enabled == 0) || (__trace_replay != 0) || (__trace_oversized != 0)) return;
+    TraceEncode(message, &record);
+    if ((connection < __trace_connections) && __trace_back[connection]) record.extra |= NBLOCKS_TRACE_BACK_EDGE;
+    TracePush(TRACE_MESSAGE, record.type, connection, record.value, record.extra);
+}
+
+void TraceIdle(void) {
+    if (__trace_writer != 0) KernelTraceDrain();
+}
+
+#ifdef TARGET_HOST
+
+static uint32_t FileWriter(void * context, const uint8_t * data, uint32_t size) {
+    uint32_t room = __trace_map_size - __trace_map_used;
+    uint32_t n = (size < room) ? size : room;
+
+    memcpy(__trace_map + __trace_map_used, data, n);
+    __trace_map_used += n;
+    // Records past the end of the file are dropped, not held in the ring
+    if (n < size) __trace_file_lost++;
+    return size;
+}
+
+int KernelTraceOpenFile(const char * path, uint32_t max_records) {
+    TraceFileHeader * header;
+
+    KernelTraceCloseFile();
+    __trace_map_size = sizeof(TraceFileHeader) + (max_records * sizeof(nBlocks_TraceRecord));
+    __trace_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (__trace_fd < 0) return -1;
+    if (ftruncate(__trace_fd, __trace_map_size) != 0) {
+        close(__trace_fd);
+        __trace_fd = -1;
+        return -1;
+    }
+    __trace_map = (uint8_t *)mmap(0, __trace_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, __trace_fd, 0);
+    if (__trace_map == MAP_FAILED) {
+        __trace_map = 0;
+        close(__trace_fd);
+        __trace_fd = -1;
+        return -1;
+    }
+    header = (TraceFileHeader *)__trace_map;
+    memset(header, 0, sizeof(TraceFileHeader));
+    memcpy(header->magic, "NBTR", 4);
+    header->version = 1;
+    header->recordSize = sizeof(nBlocks_TraceRecord);
+    __trace_map_used = sizeof(TraceFileHeader);
+    __trace_file_lost = 0;
+    KernelTraceAttach(&FileWriter, 0);
+    return 0;
+}
+
+void KernelTraceCloseFile(void) {
+    TraceFileHeader * header;
+
+    if (__trace_map == 0) return;
+    KernelTraceDrain();
+    KernelTraceAttach(0, 0);
+    // Drop a record left half written by a full file
+    __trace_map_used -= (__trace_map_used - sizeof(TraceFileHeader)) % sizeof(nBlocks_TraceRecord);
+    __trace_out_offset = sizeof(nBlocks_TraceRecord);
+    header = (TraceFileHeader *)__trace_map;
+    header->records = (__trace_map_used - sizeof(TraceFileHeader)) / sizeof(nBlocks_TraceRecord);
+    header->lost = __trace_file_lost + __trace_lost;
+    msync(__trace_map, __trace_map_size, MS_SYNC);
+    munmap(__trace_map, __trace_map_size);
+    if (ftruncate(__trace_fd, __trace_map_used) != 0) {
+        // The file keeps its full size, the header has the record count
+    }
+    close(__trace_fd);
+    __trace_map = 0;
+    __trace_fd = -1;
+}
+
+/**
+ *  \brief Reads all records of a trace file, or of a raw capture of the
+ *  serial stream (no header)
+ *
+ *  \return Records, to be deleted by the caller, or 0 on error
+ */
+static nBlocks_TraceRecord * TraceLoad(const char * path, uint32_t * count, uint32_t * lost) {
+    FILE * f = fopen(path, "rb");
+    TraceFileHeader header;
+    nBlocks_TraceRecord * records;
+    long size, offset = 0;
+
+    *count = 0;
+    *lost = 0;
+    if (f == 0) return 0;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if ((size >= (long)sizeof(TraceFileHeader)) && (fread(&header, sizeof(header), 1, f) == 1)
+            && (memcmp(header.magic, "NBTR", 4) == 0)) {
+        offset = sizeof(TraceFileHeader);
+        *lost = header.lost;
+    }
+    fseek(f, offset, SEEK_SET);
+    *count = (uint32_t)((size - offset) / (long)sizeof(nBlocks_TraceRecord));
+    records = new nBlocks_TraceRecord [*count + 1];
+    if (fread(records, sizeof(nBlocks_TraceRecord), *count, f) != *count) *count = 0;
+    fclose(f);
+    return records;
+}
+
+const nBlocks_TraceRecord * TraceReplayMessages(uint32_t * count) {
+    *count = __replay_count;
+    return __replay_messages;
+}
+
+uint32_t TraceReplayFill(const nBlocks_TraceRecord * record, nBlocks_Message * message) {
+    if ((record->type != OUTPUT_TYPE_INT) && (record->type != OUTPUT_TYPE_FLOAT)) return 0;
+    nBlocks_FillMessage(record->type, record->value, record->extra & ~NBLOCKS_TRACE_BACK_EDGE, message);
+    return 1;
+}
+
+void TraceReplayCheck(const nBlocks_TraceRecord * record, const nBlocks_Message * message) {
+    nBlocks_TraceRecord live;
+
+    TraceEncode(message, &live);
+    if ((live.type == record->type) && (live.value == record->value)
+            && (live.extra == (record->extra & ~NBLOCKS_TRACE_BACK_EDGE))) return;
+    ReplayMismatch(record->id);
+}
+
+nBlocks_TraceReplayStats KernelTraceReplay(const char * path, uint32_t mode) {
+    nBlocks_TraceRecord * records;
+    uint32_t count, i, j;
+
+    memset(&__replay_stats, 0, sizeof(__replay_stats));
+    records = TraceLoad(path, &count, &(__replay_stats.lost));
+    if (records == 0) return __replay_stats;
+    // Message records of a frame are gathered in place, at most as many
+    __replay_messages = new nBlocks_TraceRecord [count + 1];
+
+    i = 0;
+    while (i < count) {
+        if (records[i].kind == TRACE_LOST) __replay_stats.lost += records[i].value;
+        if (records[i].kind != TRACE_FRAME_START) {
+            i++;
+            continue;
+        }
+        __trace_frame = records[i].frame;
+        __replay_count = 0;
+        for (j=i+1; (j < count) && (records[j].kind != TRACE_FRAME_START); j++) {
+            if (records[j].kind == TRACE_MESSAGE) __replay_messages[__replay_count++] = records[j];
+            else if (records[j].kind == TRACE_LOST) __replay_stats.lost += records[j].value;
+            if (records[j].kind == TRACE_FRAME_END) break;
+        }
+        __replay_cursor = 0;
+        __replay_stats.messages += __replay_count;
+
+        __trace_replay = mode;
+        TraceRunFrame(records[i].frame);
+        __trace_replay = 0;
+
+        // Recorded messages not seen live
+        if (mode == TRACE_REPLAY_VERIFY) {
+            for (; __replay_cursor < __replay_count; __replay_cursor++) ReplayMismatch(__replay_messages[__replay_cursor].id);
+        }
+        __replay_stats.frames++;
+        i = j;
+    }
+
+    delete[] records;
+    delete[] __replay_messages;
+    __replay_messages = 0;
+    __replay_count = 0;
+    return __replay_stats;
+}
+
+int KernelTraceDump(const char * path, void (*print)(const char * line)) {
+    static const char * stage_names[2] = { "propagate", "step" };
+    static const char * type_names[8] = { "int", "string", "float", "array", "int_block", "float_block", "int64", "double" };
+    nBlocks_TraceRecord * records;
+    nBlocks_TraceRecord * r;
+    uint32_t count, lost, i;
+    float f;
+    char line[96];
+
+    records = TraceLoad(path, &count, &lost);
+    if (records == 0) return -1;
+    snprintf(line, sizeof(line), "trace %u records, %u lost, timestamps in %s", count, lost, KernelTraceUnit());
+    print(line);
+    for (i=0; i<count; i++) {
+        r = &(records[i]);
+        switch (r->kind) {
+            case TRACE_FRAME_START:
+                snprintf(line, sizeof(line), "%u start t=%u pending=%u", r->frame, r->value, r->extra);
+                break;
+            case TRACE_STAGE_END:
+                snprintf(line, sizeof(line), "%u %s t=%u", r->frame, (r->type < 2) ? stage_names[r->type] : "?", r->value);
+                break;
+            case TRACE_FRAME_END:
+                snprintf(line, sizeof(line), "%u end t=%u", r->frame, r->value);
+                break;
+            case TRACE_MESSAGE:
+                if (r->type == OUTPUT_TYPE_INT) {
+                    snprintf(line, sizeof(line), "%u c%u int %u%s", r->frame, r->id, r->value,
+                            (r->extra & NBLOCKS_TRACE_BACK_EDGE) ? " back" : "");
+                }
+                else if (r->type == OUTPUT_TYPE_FLOAT) {
+                    memcpy(&f, &(r->value), sizeof(f));
+                    snprintf(line, sizeof(line), "%u c%u float %g%s", r->frame, r->id, f,
+                            (r->extra & NBLOCKS_TRACE_BACK_EDGE) ? " back" : "");
+                }
+                else {
+                    snprintf(line, sizeof(line), "%u c%u %s len=%u hash=%08x%s", r->frame, r->id,
+                            (r->type < 8) ? type_names[r->type] : "?", r->extra & ~NBLOCKS_TRACE_BACK_EDGE, r->value,
+                            (r->extra & NBLOCKS_TRACE_BACK_EDGE) ? " back" : "");
+                }
+                break;
+            case TRACE_LOST:
+                snprintf(line, sizeof(line), "%u lost %u", r->frame, r->value);
+                break;
+            default:
+                snprintf(line, sizeof(line), "%u ? kind=%u", r->frame, r->kind);
+                break;
+        }
+        print(line);
+    }
+    delete[] records;
+    return (int)count;
+}
+
+#else
+
+static uint32_t SerialWriter(void * context, const uint8_t * data, uint32_t size) {
+    Serial * port = (Serial *)context;
+    uint32_t i;
+    for (i=0; (i < size) && port->writeable(); i++) port->putc(data[i]);
+    return i;
+}
+
+void KernelTraceAttachSerial(Serial * port) {
+    KernelTraceAttach(&SerialWriter, port);
+}
+
+#endif
+
+#endif
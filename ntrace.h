@@ -0,0 +1,260 @@
+/**
+ *  \file ntrace.h
+ *  \brief n-Blocks Studio Kernel frame tracer
+ *
+ *  \details Optional recording of what happens in ProgressNodes(),
+ *  enabled by defining NBLOCKS_TRACE when compiling the kernel. Every
+ *  frame appends fixed size binary records to a lock-free ring buffer:
+ *  frame start and end, the end of each stage (staged frames), and one
+ *  record per message crossing a connection, holding its value (INT,
+ *  FLOAT) or a hash of its payload (STRING, ARRAY, sample blocks).
+ *
+ *  The ring is drained, at the end of each ProgressNodes() call, into
+ *  the writer attached with KernelTraceAttach(): a serial port on the
+ *  target (KernelTraceAttachSerial(), never blocking the frame loop) or
+ *  a memory-mapped file on the host (KernelTraceOpenFile() ). Records
+ *  which do not fit in the ring are counted and reported by a
+ *  TRACE_LOST record.
+ *
+ *  On the host, KernelTraceReplay() feeds a trace back into the same
+ *  graph, frame by frame, either delivering the recorded messages in
+ *  place of the live ones (e.g. to profile a production input sequence
+ *  off-line) or checking the live messages against the recording.
+ *
+ *  Messages are only recorded from the compiled tables, that is after
+ *  SetupWorkbench(), and not while connections are propagated by
+ *  KernelParallelStages() workers or by a graph attached with
+ *  KernelAttachGraph(). Connection ids are indices in the compiled
+ *  connection table, which is sorted by source node: the same graph
+ *  built in the same order gets the same ids.
+ *
+ *  Only the default workbench is traced (see nWorkbench).
+ *
+ *  When NBLOCKS_TRACE is not defined the kernel hooks expand to
+ *  nothing, and the API below is not available.
+ */
+
+#ifndef _NTRACE
+#define _NTRACE
+
+#include "mbed.h"
+
+#ifdef NBLOCKS_TRACE
+
+/**
+ *  \brief Number of records held by the ring buffer, a power of two.
+ *  Records are 16 bytes.
+ */
+#ifndef NBLOCKS_TRACE_RECORDS
+#ifdef TARGET_HOST
+#define NBLOCKS_TRACE_RECORDS 4096
+#else
+#define NBLOCKS_TRACE_RECORDS 64
+#endif
+#endif
+
+/**
+ *  \brief Most connections of a traced graph, as records carry 16 bit
+ *  connection ids. Larger graphs are not recorded (see
+ *  KernelTraceEnable() ).
+ */
+#define NBLOCKS_TRACE_MAX_CONNECTIONS 65536
+
+/**
+ *  \brief Set in the extra field of TRACE_MESSAGE records of connections
+ *  delivered after their destination was stepped in the frame (back
+ *  edges in KERNEL_SCHEDULE_TOPOLOGICAL)
+ */
+#define NBLOCKS_TRACE_BACK_EDGE  0x80000000u
+
+/**
+ *  \brief Trace record kinds
+ */
+enum nBlocks_TraceKinds {
+    TRACE_FRAME_START,  /**< value: timestamp, extra: ticks pending */
+    TRACE_STAGE_END,    /**< type: nBlocks_TraceStages, value: timestamp */
+    TRACE_FRAME_END,    /**< value: timestamp */
+    TRACE_MESSAGE,      /**< id: connection, type: output type, value: value or payload hash, extra: data length and flags */
+    TRACE_LOST          /**< value: records dropped because the ring was full */
+};
+
+/**
+ *  \brief Frame stages in TRACE_STAGE_END records
+ */
+enum nBlocks_TraceStages {
+    TRACE_STAGE_PROPAGATE,
+    TRACE_STAGE_STEP
+};
+
+/**
+ *  \brief One trace record. frame is the tick index of the frame, so
+ *  frames dropped by the overrun policy show as gaps.
+ */
+typedef struct nBlocks_TraceRecord {
+    uint32_t frame;
+    uint8_t kind;
+    uint8_t type;
+    uint16_t id;
+    uint32_t value;
+    uint32_t extra;
+} nBlocks_TraceRecord;
+
+/**
+ *  \brief Writer receiving drained trace bytes. Records may be split
+ *  across calls.
+ *
+ *  \param [in] context Pointer given to KernelTraceAttach()
+ *  \param [in] data Bytes to write
+ *  \param [in] size Number of bytes
+ *  \return Number of bytes accepted. Fewer than size stops the drain,
+ *  the rest is offered again on the next one.
+ */
+typedef uint32_t (*nBlocks_TraceWriter)(void * context, const uint8_t * data, uint32_t size);
+
+/**
+ *  \brief Name of the timestamp unit ("ns" or "us")
+ */
+const char * KernelTraceUnit(void);
+
+/**
+ *  \brief Pauses (0) or resumes (1) recording. Recording is on by default,
+ *  but stays off for graphs with more than NBLOCKS_TRACE_MAX_CONNECTIONS
+ *  connections, whose ids would alias.
+ */
+void KernelTraceEnable(uint32_t enable);
+
+/**
+ *  \brief Sets the writer the ring is drained into at the end of each
+ *  ProgressNodes() call. Pass 0 to detach, e.g. to drain manually.
+ */
+void KernelTraceAttach(nBlocks_TraceWriter writer, void * context);
+
+/**
+ *  \brief Drains the ring into the attached writer, until it is empty
+ *  or the writer accepts fewer bytes than offered. Only one thread or
+ *  interrupt may drain.
+ *
+ *  \return Number of bytes written
+ */
+uint32_t KernelTraceDrain(void);
+
+/**
+ *  \brief Number of records dropped because the ring was full
+ */
+uint32_t KernelTraceLost(void);
+
+#ifdef TARGET_HOST
+
+/**
+ *  \brief Modes of KernelTraceReplay()
+ */
+enum nBlocks_TraceReplayModes {
+    TRACE_REPLAY_INJECT = 1,    /**< Recorded messages replace propagation */
+    TRACE_REPLAY_VERIFY = 2     /**< Live messages are compared with the recording */
+};
+
+/**
+ *  \brief Result of KernelTraceReplay()
+ */
+typedef struct nBlocks_TraceReplayStats {
+    uint32_t frames;                    /**< Frames replayed */
+    uint32_t messages;                  /**< Message records read */
+    uint32_t mismatches;                /**< Messages differing from the recording, missing or extra */
+    uint32_t firstMismatchFrame;        /**< Frame of the first mismatch */
+    uint32_t firstMismatchConnection;   /**< Connection of the first mismatch */
+    uint32_t lost;                      /**< Records lost while recording */
+} nBlocks_TraceReplayStats;
+
+/**
+ *  \brief Creates a trace file of up to max_records records, mapped in
+ *  memory, and attaches it as the writer. Records past the end of the
+ *  file are counted as lost.
+ *
+ *  \return 0 on success, -1 on error
+ */
+int KernelTraceOpenFile(const char * path, uint32_t max_records);
+
+/**
+ *  \brief Drains the ring, writes the header and closes the trace file,
+ *  truncated to the records written
+ */
+void KernelTraceCloseFile(void);
+
+/**
+ *  \brief Replays a trace into the graph, one frame per recorded frame,
+ *  with the frames' original tick indices. Call it after
+ *  SetupWorkbench(), on the graph the trace was recorded from, built
+ *  from the same initial state. Recording is suspended meanwhile.
+ *
+ *  With TRACE_REPLAY_INJECT, nodes are stepped as usual, but the
+ *  propagation of outputs is replaced by the recorded messages, each
+ *  delivered alone to the destination of its connection, in recorded
+ *  order. Payloads of STRING, ARRAY and block messages are not in the
+ *  trace: those are read from the live source output and counted as
+ *  mismatches if their hash differs.
+ *
+ *  With TRACE_REPLAY_VERIFY, frames run as usual and every message is
+ *  compared with the recorded one. Requires serial propagation.
+ *
+ *  \param [in] path Trace file, or a raw capture of the serial stream
+ *  \param [in] mode One of nBlocks_TraceReplayModes
+ */
+nBlocks_TraceReplayStats KernelTraceReplay(const char * path, uint32_t mode);
+
+/**
+ *  \brief Prints a trace file as text, one line per record and per
+ *  call to print. Lines have no line terminator.
+ *
+ *  \return Number of records, or -1 if the file can not be read
+ */
+int KernelTraceDump(const char * path, void (*print)(const char * line));
+
+#else
+
+/**
+ *  \brief Attaches a serial port as the writer. Bytes are only written
+ *  while the port is writeable, so draining never blocks.
+ */
+void KernelTraceAttachSerial(Serial * port);
+
+#endif
+
+// Kernel interface
+struct nBlocks_Message;
+extern uint32_t __trace_replay;
+void TraceSetup(uint32_t num_connections);
+void TraceSetBackEdge(uint32_t connection);
+void TraceFrameStart(uint32_t frame, uint32_t pending);
+void TraceStageEnd(uint32_t stage);
+void TraceFrameEnd(void);
+void TraceMessage(uint32_t connection, const struct nBlocks_Message * message);
+void TraceIdle(void);
+const nBlocks_TraceRecord * TraceReplayMessages(uint32_t * count);
+uint32_t TraceReplayFill(const nBlocks_TraceRecord * record, struct nBlocks_Message * message);
+void TraceReplayCheck(const nBlocks_TraceRecord * record, const struct nBlocks_Message * message);
+void TraceRunFrame(uint32_t frame);
+
+// Condition for the hooks to record, see nWorkbench
+#ifndef NBLOCKS_INSTRUMENTED
+#define NBLOCKS_INSTRUMENTED 1
+#endif
+
+#define NBLOCKS_TRACE_SETUP()                   do { if (NBLOCKS_INSTRUMENTED) setupTrace(); } while (0)
+#define NBLOCKS_TRACE_FRAME_START(frame, pending)   do { if (NBLOCKS_INSTRUMENTED) TraceFrameStart((frame), (pending)); } while (0)
+#define NBLOCKS_TRACE_STAGE(stage)              do { if (NBLOCKS_INSTRUMENTED) TraceStageEnd(stage); } while (0)
+#define NBLOCKS_TRACE_FRAME_END()               do { if (NBLOCKS_INSTRUMENTED) TraceFrameEnd(); } while (0)
+#define NBLOCKS_TRACE_MESSAGE(c, message)       do { if (NBLOCKS_INSTRUMENTED) TraceMessage((c), (message)); } while (0)
+#define NBLOCKS_TRACE_IDLE()                    do { if (NBLOCKS_INSTRUMENTED) TraceIdle(); } while (0)
+
+#else
+
+#define NBLOCKS_TRACE_SETUP()
+#define NBLOCKS_TRACE_FRAME_START(frame, pending)
+#define NBLOCKS_TRACE_STAGE(stage)
+#define NBLOCKS_TRACE_FRAME_END()
+#define NBLOCKS_TRACE_MESSAGE(c, message)
+#define NBLOCKS_TRACE_IDLE()
+
+#endif
+
+#endif
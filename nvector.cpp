@@ -0,0 +1,317 @@
+#include "nvector.h"
+
+#ifndef NBLOCKS_VECTOR_CMSIS
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#endif
+
+// Float SIMD helpers: VF_WIDTH floats per vector, unaligned loads and
+// stores (aligned buffers make them as fast as aligned ones)
+#ifndef NBLOCKS_VECTOR_CMSIS
+#if defined(__AVX__)
+typedef __m256 nBlocks_vf;
+#define VF_WIDTH            8
+#define VF_LOAD(p)          _mm256_loadu_ps(p)
+#define VF_STORE(p, v)      _mm256_storeu_ps((p), (v))
+#define VF_SET(x)           _mm256_set1_ps(x)
+#define VF_ZERO()           _mm256_setzero_ps()
+#define VF_ADD(a, b)        _mm256_add_ps((a), (b))
+#define VF_MUL(a, b)        _mm256_mul_ps((a), (b))
+
+static inline float VfSum(nBlocks_vf v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#elif defined(__SSE2__)
+typedef __m128 nBlocks_vf;
+#define VF_WIDTH            4
+#define VF_LOAD(p)          _mm_loadu_ps(p)
+#define VF_STORE(p, v)      _mm_storeu_ps((p), (v))
+#define VF_SET(x)           _mm_set1_ps(x)
+#define VF_ZERO()           _mm_setzero_ps()
+#define VF_ADD(a, b)        _mm_add_ps((a), (b))
+#define VF_MUL(a, b)        _mm_mul_ps((a), (b))
+
+static inline float VfSum(nBlocks_vf v) {
+    __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#endif
+#endif
+
+static inline nBlocks_q15 SaturateQ15(int32_t value) {
+    if (value > 32767) return 32767;
+    if (value < -32768) return -32768;
+    return (nBlocks_q15)(value);
+}
+
+void nBlocks_GainSet(nBlocks_Gain * gain, float value) {
+    float fract = value;
+    int8_t shift = 0;
+    int32_t q;
+
+    gain->value = value;
+    // Largest representable magnitude is 2^15
+    while (((fract >= 1.0f) || (fract < -1.0f)) && (shift < 15)) {
+        fract *= 0.5f;
+        shift++;
+    }
+    q = (int32_t)(floorf((fract * 32768.0f) + 0.5f));
+    if (q > 32767) q = 32767;
+    if (q < -32768) q = -32768;
+    gain->fract = (nBlocks_q15)(q);
+    gain->shift = shift;
+}
+
+void nBlocks_VectorScale(const float * src, const nBlocks_Gain * gain, float * dst, uint32_t length) {
+    uint32_t i = 0;
+#ifdef NBLOCKS_VECTOR_CMSIS
+    arm_scale_f32((float32_t *)(src), gain->value, dst, length);
+    i = length;
+#elif defined(VF_WIDTH)
+    nBlocks_vf g = VF_SET(gain->value);
+    for (; (i + VF_WIDTH) <= length; i += VF_WIDTH) VF_STORE(&(dst[i]), VF_MUL(VF_LOAD(&(src[i])), g));
+#endif
+    for (; i<length; i++) dst[i] = src[i] * gain->value;
+}
+
+void nBlocks_VectorScale(const nBlocks_q15 * src, const nBlocks_Gain * gain, nBlocks_q15 * dst, uint32_t length) {
+    uint32_t i = 0;
+    int32_t fract = gain->fract;
+    int32_t down = 15 - gain->shift;
+#ifdef NBLOCKS_VECTOR_CMSIS
+    arm_scale_q15((q15_t *)(src), gain->fract, gain->shift, dst, length);
+    i = length;
+#elif defined(__SSE2__)
+    // 32 bit products from the low and high halves, shifted and packed
+    // back with saturation
+    __m128i g = _mm_set1_epi16(gain->fract);
+    __m128i count = _mm_cvtsi32_si128(down);
+    for (; (i + 8) <= length; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(&(src[i])));
+        __m128i lo = _mm_mullo_epi16(x, g);
+        __m128i hi = _mm_mulhi_epi16(x, g);
+        __m128i p0 = _mm_sra_epi32(_mm_unpacklo_epi16(lo, hi), count);
+        __m128i p1 = _mm_sra_epi32(_mm_unpackhi_epi16(lo, hi), count);
+        _mm_storeu_si128((__m128i *)(&(dst[i])), _mm_packs_epi32(p0, p1));
+    }
+#endif
+    for (; i<length; i++) dst[i] = SaturateQ15(((int32_t)(src[i]) * fract) >> down);
+}
+
+void nBlocks_VectorAdd(const float * a, const float * b, float * dst, uint32_t length) {
+    uint32_t i = 0;
+#ifdef NBLOCKS_VECTOR_CMSIS
+    arm_add_f32((float32_t *)(a), (float32_t *)(b), dst, length);
+    i = length;
+#elif defined(VF_WIDTH)
+    for (; (i + VF_WIDTH) <= length; i += VF_WIDTH) VF_STORE(&(dst[i]), VF_ADD(VF_LOAD(&(a[i])), VF_LOAD(&(b[i]))));
+#endif
+    for (; i<length; i++) dst[i] = a[i] + b[i];
+}
+
+void nBlocks_VectorAdd(const nBlocks_q15 * a, const nBlocks_q15 * b, nBlocks_q15 * dst, uint32_t length) {
+    uint32_t i = 0;
+#ifdef NBLOCKS_VECTOR_CMSIS
+    arm_add_q15((q15_t *)(a), (q15_t *)(b), dst, length);
+    i = length;
+#elif defined(__SSE2__)
+    for (; (i + 8) <= length; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(&(a[i])));
+        __m128i y = _mm_loadu_si128((const __m128i *)(&(b[i])));
+        _mm_storeu_si128((__m128i *)(&(dst[i])), _mm_adds_epi16(x, y));
+    }
+#endif
+    for (; i<length; i++) dst[i] = SaturateQ15((int32_t)(a[i]) + (int32_t)(b[i]));
+}
+
+float nBlocks_VectorDot(const float * a, const float * b, uint32_t length) {
+    uint32_t i = 0;
+    float sum = 0.0f;
+#ifdef NBLOCKS_VECTOR_CMSIS
+    arm_dot_prod_f32((float32_t *)(a), (float32_t *)(b), length, &sum);
+    i = length;
+#elif defined(VF_WIDTH)
+    // Two accumulators to hide the add latency
+    nBlocks_vf acc0 = VF_ZERO();
+    nBlocks_vf acc1 = VF_ZERO();
+    for (; (i + (2 * VF_WIDTH)) <= length; i += 2 * VF_WIDTH) {
+        acc0 = VF_ADD(acc0, VF_MUL(VF_LOAD(&(a[i])), VF_LOAD(&(b[i]))));
+        acc1 = VF_ADD(acc1, VF_MUL(VF_LOAD(&(a[i + VF_WIDTH])), VF_LOAD(&(b[i + VF_WIDTH]))));
+    }
+    for (; (i + VF_WIDTH) <= length; i += VF_WIDTH) {
+        acc0 = VF_ADD(acc0, VF_MUL(VF_LOAD(&(a[i])), VF_LOAD(&(b[i]))));
+    }
+    sum = VfSum(VF_ADD(acc0, acc1));
+#endif
+    for (; i<length; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+float nBlocks_VectorRms(const float * src, uint32_t length) {
+    if (length == 0) return 0.0f;
+#ifdef NBLOCKS_VECTOR_CMSIS
+    float result;
+    arm_rms_f32((float32_t *)(src), length, &result);
+    return result;
+#else
+    return sqrtf(nBlocks_VectorDot(src, src, length) / (float)(length));
+#endif
+}
+
+nBlocks_q15 nBlocks_VectorRms(const nBlocks_q15 * src, uint32_t length) {
+    if (length == 0) return 0;
+#ifdef NBLOCKS_VECTOR_CMSIS
+    nBlocks_q15 result;
+    arm_rms_q15((q15_t *)(src), length, &result);
+    return result;
+#else
+    uint32_t i;
+    int64_t sum = 0;
+    for (i=0; i<length; i++) sum += (int32_t)(src[i]) * (int32_t)(src[i]);
+    // Mean square is Q30, its square root Q15
+    return SaturateQ15((int32_t)(sqrtf((float)(sum / (int64_t)(length)))));
+#endif
+}
+
+void nBlocks_VectorFirInit(nBlocks_FirF32 * fir, const float * coeffs, float * state, uint32_t taps, uint32_t length) {
+    fir->coeffs = coeffs;
+    fir->state = state;
+    fir->taps = taps;
+    fir->length = length;
+    memset(state, 0, (taps + length) * sizeof(float));
+#ifdef NBLOCKS_VECTOR_CMSIS
+    arm_fir_init_f32(&(fir->instance), taps, (float32_t *)(coeffs), state, length);
+#endif
+}
+
+void nBlocks_VectorFir(nBlocks_FirF32 * fir, const float * src, float * dst, uint32_t length) {
+#ifdef NBLOCKS_VECTOR_CMSIS
+    arm_fir_f32(&(fir->instance), (float32_t *)(src), dst, length);
+#else
+    // state holds the last taps - 1 samples followed by the new block
+    uint32_t i = 0;
+    uint32_t k;
+    uint32_t history = fir->taps - 1;
+    const float * x = fir->state;
+    const float * c = fir->coeffs;
+    if (length > fir->length) length = fir->length;
+    memcpy(&(fir->state[history]), src, length * sizeof(float));
+#ifdef VF_WIDTH
+    // Outputs computed side by side, one coefficient broadcast per tap,
+    // so no horizontal sums are needed. Four independent accumulators
+    // hide the add latency.
+    for (; (i + (4 * VF_WIDTH)) <= length; i += 4 * VF_WIDTH) {
+        nBlocks_vf acc0 = VF_ZERO();
+        nBlocks_vf acc1 = VF_ZERO();
+        nBlocks_vf acc2 = VF_ZERO();
+        nBlocks_vf acc3 = VF_ZERO();
+        for (k=0; k<fir->taps; k++) {
+            nBlocks_vf ck = VF_SET(c[k]);
+            const float * xk = &(x[i + k]);
+            acc0 = VF_ADD(acc0, VF_MUL(ck, VF_LOAD(xk)));
+            acc1 = VF_ADD(acc1, VF_MUL(ck, VF_LOAD(xk + VF_WIDTH)));
+            acc2 = VF_ADD(acc2, VF_MUL(ck, VF_LOAD(xk + (2 * VF_WIDTH))));
+            acc3 = VF_ADD(acc3, VF_MUL(ck, VF_LOAD(xk + (3 * VF_WIDTH))));
+        }
+        VF_STORE(&(dst[i]), acc0);
+        VF_STORE(&(dst[i + VF_WIDTH]), acc1);
+        VF_STORE(&(dst[i + (2 * VF_WIDTH)]), acc2);
+        VF_STORE(&(dst[i + (3 * VF_WIDTH)]), acc3);
+    }
+    for (; (i + VF_WIDTH) <= length; i += VF_WIDTH) {
+        nBlocks_vf acc = VF_ZERO();
+        for (k=0; k<fir->taps; k++) acc = VF_ADD(acc, VF_MUL(VF_SET(c[k]), VF_LOAD(&(x[i + k]))));
+        VF_STORE(&(dst[i]), acc);
+    }
+#endif
+    for (; i<length; i++) {
+        float sum = 0.0f;
+        for (k=0; k<fir->taps; k++) sum += x[i + k] * c[k];
+        dst[i] = sum;
+    }
+    memmove(fir->state, &(fir->state[length]), history * sizeof(float));
+#endif
+}
+
+void nBlocks_VectorFirInit(nBlocks_FirQ15 * fir, const nBlocks_q15 * coeffs, nBlocks_q15 * state, uint32_t taps, uint32_t length) {
+    fir->coeffs = coeffs;
+    fir->state = state;
+    fir->taps = taps;
+    fir->length = length;
+    memset(state, 0, (taps + length) * sizeof(nBlocks_q15));
+#ifdef NBLOCKS_VECTOR_CMSIS
+    fir->cmsis = (arm_fir_init_q15(&(fir->instance), taps, (q15_t *)(coeffs), state, length) == ARM_MATH_SUCCESS) ? 1 : 0;
+#endif
+}
+
+void nBlocks_VectorFir(nBlocks_FirQ15 * fir, const nBlocks_q15 * src, nBlocks_q15 * dst, uint32_t length) {
+    uint32_t i, k;
+    uint32_t history = fir->taps - 1;
+    int64_t acc;
+
+#ifdef NBLOCKS_VECTOR_CMSIS
+    if (fir->cmsis) {
+        arm_fir_q15(&(fir->instance), (q15_t *)(src), dst, length);
+        return;
+    }
+#endif
+    if (length > fir->length) length = fir->length;
+    memcpy(&(fir->state[history]), src, length * sizeof(nBlocks_q15));
+    for (i=0; i<length; i++) {
+        // Products are Q30, accumulated in 64 bits as CMSIS-DSP does
+        acc = 0;
+        for (k=0; k<fir->taps; k++) acc += (int32_t)(fir->state[i + k]) * (int32_t)(fir->coeffs[k]);
+        acc >>= 15;
+        dst[i] = (acc > 32767) ? 32767 : ((acc < -32768) ? -32768 : (nBlocks_q15)(acc));
+    }
+    memmove(fir->state, &(fir->state[length]), history * sizeof(nBlocks_q15));
+}
+
+void nBlocks_VectorBiquadInit(nBlocks_BiquadF32 * biquad, const float * coeffs, float * state, uint32_t stages) {
+    biquad->coeffs = coeffs;
+    biquad->state = state;
+    biquad->stages = stages;
+    memset(state, 0, 4 * stages * sizeof(float));
+#ifdef NBLOCKS_VECTOR_CMSIS
+    arm_biquad_cascade_df1_init_f32(&(biquad->instance), stages, (float32_t *)(coeffs), state);
+#endif
+}
+
+void nBlocks_VectorBiquad(nBlocks_BiquadF32 * biquad, const float * src, float * dst, uint32_t length) {
+#ifdef NBLOCKS_VECTOR_CMSIS
+    arm_biquad_cascade_df1_f32(&(biquad->instance), (float32_t *)(src), dst, length);
+#else
+    // Each sample depends on the previous ones: no vectorization, but the
+    // stage state stays in registers over the block
+    uint32_t s, i;
+    const float * in = src;
+    for (s=0; s<biquad->stages; s++) {
+        const float * c = &(biquad->coeffs[5 * s]);
+        float * st = &(biquad->state[4 * s]);
+        float x1 = st[0], x2 = st[1], y1 = st[2], y2 = st[3];
+        for (i=0; i<length; i++) {
+            float x = in[i];
+            float y = (c[0] * x) + (c[1] * x1) + (c[2] * x2) + (c[3] * y1) + (c[4] * y2);
+            x2 = x1;
+            x1 = x;
+            y2 = y1;
+            y1 = y;
+            dst[i] = y;
+        }
+        st[0] = x1;
+        st[1] = x2;
+        st[2] = y1;
+        st[3] = y2;
+        // Later stages filter the output in place
+        in = dst;
+    }
+    if (biquad->stages == 0) memmove(dst, src, length * sizeof(float));
+#endif
+}
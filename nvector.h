@@ -0,0 +1,481 @@
+/**
+ *  \file nvector.h
+ *  \brief Vector (block) signal processing nodes
+ *
+ *  \details Nodes exchanging blocks of samples through OUTPUT_TYPE_ARRAY
+ *  outputs: the output value is a pointer to the samples and the data
+ *  available is the number of samples. Samples are float, or Q15
+ *  fixed point (nBlocks_q15, int16_t scaled by 2^-15).
+ *
+ *  The processing functions below use:
+ *    - CMSIS-DSP when NBLOCKS_VECTOR_CMSIS is defined (Cortex-M targets
+ *      linking the CMSIS-DSP / mbed-dsp library)
+ *    - AVX or SSE2 intrinsics on the host, as enabled by the compiler
+ *      flags (e.g. -mavx)
+ *    - plain C loops otherwise
+ *  Biquad filters and Q15 FIR/RMS have no host intrinsics (plain C).
+ *
+ *  nBlockVectorNode is the base class of these nodes. It keeps its
+ *  output blocks in node owned buffers aligned to NBLOCKS_VECTOR_ALIGN,
+ *  so block pointers remain valid while downstream nodes use them. In
+ *  block mode (KernelBlockSize() ), float nodes also take FLOAT sample
+ *  blocks from nodes written for single values. Stock nodes:
+ *    - nBlock_VectorGain: multiplies by a constant
+ *    - nBlock_VectorMix: weighted sum of several inputs
+ *    - nBlock_VectorFir: FIR filter
+ *    - nBlock_VectorBiquad: cascade of biquad filters (float only)
+ *    - nBlock_VectorRms: RMS of each block (scalar output)
+ *    - nBlock_VectorBin: amplitude of one DFT bin of each block (float
+ *      only, scalar output)
+ *
+ *      nBlock_VectorGain<float, 64> gain(0.5f);
+ *      nBlock_VectorRms<float, 64> rms;
+ *      nBlockConnection n_conn_1(&source, 0, &gain, 0);
+ *      nBlockConnection n_conn_2(&gain, 0, &rms, 0);
+ */
+
+#ifndef _NVECTOR
+#define _NVECTOR
+
+#include "nworkbench.h"
+
+#include <math.h>
+
+#ifdef NBLOCKS_VECTOR_CMSIS
+#include "arm_math.h"
+#endif
+
+/**
+ *  \brief Alignment in bytes of the output buffers of nBlockVectorNode.
+ *  Defaults to what the heap guarantees, so it also holds for nodes
+ *  created with new.
+ */
+#ifndef NBLOCKS_VECTOR_ALIGN
+#ifdef TARGET_HOST
+#define NBLOCKS_VECTOR_ALIGN    16
+#else
+#define NBLOCKS_VECTOR_ALIGN    8
+#endif
+#endif
+
+/**
+ *  \brief Q15 fixed point sample, value / 32768 in [-1, 1)
+ */
+typedef int16_t nBlocks_q15;
+
+/**
+ *  \brief Gain usable with float and Q15 samples, see nBlocks_GainSet()
+ */
+typedef struct nBlocks_Gain {
+    float value;
+    /** Q15 gain is fract * 2^shift */
+    nBlocks_q15 fract;
+    int8_t shift;
+} nBlocks_Gain;
+
+/**
+ *  \brief Sets a gain from its float value. The Q15 form saturates at
+ *  +-32768.
+ */
+void nBlocks_GainSet(nBlocks_Gain * gain, float value);
+
+/**
+ *  \brief dst[i] = src[i] * gain. dst may be src.
+ */
+void nBlocks_VectorScale(const float * src, const nBlocks_Gain * gain, float * dst, uint32_t length);
+void nBlocks_VectorScale(const nBlocks_q15 * src, const nBlocks_Gain * gain, nBlocks_q15 * dst, uint32_t length);
+
+/**
+ *  \brief dst[i] = a[i] + b[i], saturated for Q15. dst may be a or b.
+ */
+void nBlocks_VectorAdd(const float * a, const float * b, float * dst, uint32_t length);
+void nBlocks_VectorAdd(const nBlocks_q15 * a, const nBlocks_q15 * b, nBlocks_q15 * dst, uint32_t length);
+
+/**
+ *  \brief Returns the sum of a[i] * b[i]
+ */
+float nBlocks_VectorDot(const float * a, const float * b, uint32_t length);
+
+/**
+ *  \brief Returns the root mean square of src (0 if length is 0)
+ */
+float nBlocks_VectorRms(const float * src, uint32_t length);
+nBlocks_q15 nBlocks_VectorRms(const nBlocks_q15 * src, uint32_t length);
+
+/**
+ *  \brief FIR filter state. Coefficients are stored time reversed
+ *  (coeffs[0] applies to the oldest sample), as in CMSIS-DSP.
+ */
+typedef struct nBlocks_FirF32 {
+    const float * coeffs;
+    float * state;
+    uint32_t taps;
+    uint32_t length;
+#ifdef NBLOCKS_VECTOR_CMSIS
+    arm_fir_instance_f32 instance;
+#endif
+} nBlocks_FirF32;
+
+typedef struct nBlocks_FirQ15 {
+    const nBlocks_q15 * coeffs;
+    nBlocks_q15 * state;
+    uint32_t taps;
+    uint32_t length;
+#ifdef NBLOCKS_VECTOR_CMSIS
+    /** Zero if CMSIS-DSP rejected the tap count (plain C is used) */
+    uint32_t cmsis;
+    arm_fir_instance_q15 instance;
+#endif
+} nBlocks_FirQ15;
+
+/**
+ *  \brief Initializes a FIR filter
+ *
+ *  \param [in] coeffs taps coefficients, time reversed
+ *  \param [in] state Buffer of taps + length samples
+ *  \param [in] length Largest block processed by nBlocks_VectorFir()
+ */
+void nBlocks_VectorFirInit(nBlocks_FirF32 * fir, const float * coeffs, float * state, uint32_t taps, uint32_t length);
+void nBlocks_VectorFirInit(nBlocks_FirQ15 * fir, const nBlocks_q15 * coeffs, nBlocks_q15 * state, uint32_t taps, uint32_t length);
+
+/**
+ *  \brief Filters one block. dst must not be src.
+ */
+void nBlocks_VectorFir(nBlocks_FirF32 * fir, const float * src, float * dst, uint32_t length);
+void nBlocks_VectorFir(nBlocks_FirQ15 * fir, const nBlocks_q15 * src, nBlocks_q15 * dst, uint32_t length);
+
+/**
+ *  \brief Biquad cascade state (direct form I). Each stage has the
+ *  coefficients { b0, b1, b2, a1, a2 } of
+ *  y[n] = b0 x[n] + b1 x[n-1] + b2 x[n-2] + a1 y[n-1] + a2 y[n-2]
+ *  (a1 and a2 negated with respect to the usual notation, as in
+ *  CMSIS-DSP)
+ */
+typedef struct nBlocks_BiquadF32 {
+    const float * coeffs;
+    float * state;
+    uint32_t stages;
+#ifdef NBLOCKS_VECTOR_CMSIS
+    arm_biquad_casd_df1_inst_f32 instance;
+#endif
+} nBlocks_BiquadF32;
+
+/**
+ *  \brief Initializes a biquad cascade
+ *
+ *  \param [in] coeffs 5 coefficients per stage
+ *  \param [in] state Buffer of 4 floats per stage
+ */
+void nBlocks_VectorBiquadInit(nBlocks_BiquadF32 * biquad, const float * coeffs, float * state, uint32_t stages);
+
+/**
+ *  \brief Filters one block. dst may be src.
+ */
+void nBlocks_VectorBiquad(nBlocks_BiquadF32 * biquad, const float * src, float * dst, uint32_t length);
+
+/**
+ *  \brief FIR filter state matching a sample type, for templates
+ */
+template <typename Sample> struct nBlocks_FirOf;
+template <> struct nBlocks_FirOf<float> { typedef nBlocks_FirF32 type; };
+template <> struct nBlocks_FirOf<nBlocks_q15> { typedef nBlocks_FirQ15 type; };
+
+/**
+ *  \brief Output type and value of a scalar result, for templates
+ */
+static inline nBlocks_OutputType nBlocks_ScalarType(float) { return OUTPUT_TYPE_FLOAT; }
+static inline nBlocks_OutputType nBlocks_ScalarType(nBlocks_q15) { return OUTPUT_TYPE_INT; }
+static inline uint32_t nBlocks_ScalarValue(float value) { return PackFloat(value); }
+static inline uint32_t nBlocks_ScalarValue(nBlocks_q15 value) { return (uint32_t)(int32_t)value; }
+
+
+/**
+ *  \brief Template used by nBlockVectorNode to set the sample type, the
+ *  number of inputs (up to 32), the block length and the output buffer
+ *  length.
+ */
+template <typename Sample, size_t vectorNode_Inputs, size_t vectorNode_Length, size_t vectorNode_OutputLength = vectorNode_Length>
+
+/**
+ *  \brief Base class for nodes processing blocks of samples. Has one
+ *  output, an array by default.
+ *
+ *  \details The node collects the array received at each input during
+ *  the frame. In endFrame(), if every input received a block, it calls
+ *  processBlock() with the blocks truncated to the shortest one (and to
+ *  vectorNode_Length). Blocks are not kept across frames: all inputs
+ *  must be fed in the same frame, e.g. by sources running at the same
+ *  rate.
+ *
+ *  processBlock() writes into outputBuffer() and calls publishBlock(),
+ *  or publishes a scalar with publishScalar(). The two output buffers
+ *  alternate, so the published block stays valid while the kernel
+ *  propagates it and the receivers process it in the next step.
+ */
+class nBlockVectorNode: public nBlockSimpleNode<1> {
+public:
+    nBlockVectorNode(void) {
+        unsigned int i;
+        outputType[0] = OUTPUT_TYPE_ARRAY;
+        _bank = 0;
+        _received = 0;
+        for (i=0; i<vectorNode_Inputs; i++) {
+            _input[i] = 0;
+            _inputLength[i] = 0;
+        }
+        for (i=0; i<vectorNode_OutputLength; i++) {
+            _bank0[i] = 0;
+            _bank1[i] = 0;
+        }
+    }
+
+    /**
+     *  \brief Stores the block received at an input. Messages which are
+     *  not arrays (or, for float samples, FLOAT blocks) are ignored.
+     */
+    void triggerInput(nBlocks_Message message) {
+        if (message.inputNumber >= vectorNode_Inputs) return;
+        if ((message.dataType != OUTPUT_TYPE_ARRAY) &&
+            ((message.dataType != OUTPUT_TYPE_FLOAT_BLOCK) || (nBlocks_ScalarType((Sample)0) != OUTPUT_TYPE_FLOAT))) return;
+        _input[message.inputNumber] = (const Sample *)(uintptr_t)(message.pointerValue);
+        _inputLength[message.inputNumber] = message.dataLength;
+        _received |= (1u << message.inputNumber);
+    }
+
+    /**
+     *  \brief Processes whole blocks in block mode (see KernelBlockSize() )
+     */
+    uint32_t handlesBlocks(void) { return 1; }
+
+    /**
+     *  \brief Calls processBlock() if all inputs received a block. Nodes
+     *  inheriting from this class implement processBlock() instead.
+     */
+    void endFrame(void) {
+        unsigned int i;
+        uint32_t length = vectorNode_Length;
+        uint32_t all = (vectorNode_Inputs >= 32) ? 0xFFFFFFFFu : ((1u << vectorNode_Inputs) - 1);
+
+        if (_received != all) {
+            _received = 0;
+            return;
+        }
+        _received = 0;
+        for (i=0; i<vectorNode_Inputs; i++) {
+            if (_inputLength[i] < length) length = _inputLength[i];
+        }
+        if (length == 0) return;
+        processBlock(_input, length);
+    }
+
+protected:
+    /**
+     *  \brief Processes the blocks of a frame
+     *
+     *  \param [in] inputs One block per input
+     *  \param [in] length Samples in each block, 1 to vectorNode_Length
+     */
+    virtual void processBlock(const Sample * const * inputs, uint32_t length) = 0;
+
+    /**
+     *  \brief Buffer for the next block, vectorNode_OutputLength samples
+     *  aligned to NBLOCKS_VECTOR_ALIGN
+     */
+    Sample * outputBuffer(void) { return (_bank == 0) ? _bank1 : _bank0; }
+
+    /**
+     *  \brief Publishes the first length samples of outputBuffer()
+     */
+    void publishBlock(uint32_t length) {
+        _bank ^= 1;
+        output[0] = (nBlocks_Handle)(uintptr_t)((_bank == 0) ? _bank0 : _bank1);
+        available[0] = length;
+    }
+
+    /**
+     *  \brief Publishes a scalar, for nodes whose output type was set to
+     *  nBlocks_ScalarType()
+     */
+    template <typename Value>
+    void publishScalar(Value value) {
+        output[0] = nBlocks_ScalarValue(value);
+        available[0] = 1;
+    }
+
+private:
+    Sample _bank0[vectorNode_OutputLength] __attribute__((aligned(NBLOCKS_VECTOR_ALIGN)));
+    Sample _bank1[vectorNode_OutputLength] __attribute__((aligned(NBLOCKS_VECTOR_ALIGN)));
+    uint32_t _bank;
+
+    const Sample * _input[vectorNode_Inputs];
+    uint32_t _inputLength[vectorNode_Inputs];
+    uint32_t _received;
+};
+
+
+/**
+ *  \brief Multiplies each block by a gain
+ */
+template <typename Sample, size_t Length>
+class nBlock_VectorGain: public nBlockVectorNode<Sample, 1, Length> {
+public:
+    nBlock_VectorGain(float gain = 1.0f) { nBlocks_GainSet(&_gain, gain); }
+
+    void setGain(float gain) { nBlocks_GainSet(&_gain, gain); }
+
+protected:
+    void processBlock(const Sample * const * inputs, uint32_t length) {
+        nBlocks_VectorScale(inputs[0], &_gain, this->outputBuffer(), length);
+        this->publishBlock(length);
+    }
+
+private:
+    nBlocks_Gain _gain;
+};
+
+
+/**
+ *  \brief Weighted sum of the blocks at Inputs inputs. Gains default
+ *  to 1.
+ */
+template <typename Sample, size_t Inputs, size_t Length>
+class nBlock_VectorMix: public nBlockVectorNode<Sample, Inputs, Length> {
+public:
+    nBlock_VectorMix(void) {
+        unsigned int i;
+        for (i=0; i<Inputs; i++) nBlocks_GainSet(&(_gain[i]), 1.0f);
+    }
+
+    void setGain(uint32_t input, float gain) {
+        if (input < Inputs) nBlocks_GainSet(&(_gain[input]), gain);
+    }
+
+protected:
+    void processBlock(const Sample * const * inputs, uint32_t length) {
+        unsigned int i;
+        Sample * out = this->outputBuffer();
+        nBlocks_VectorScale(inputs[0], &(_gain[0]), out, length);
+        for (i=1; i<Inputs; i++) {
+            nBlocks_VectorScale(inputs[i], &(_gain[i]), _scratch, length);
+            nBlocks_VectorAdd(out, _scratch, out, length);
+        }
+        this->publishBlock(length);
+    }
+
+private:
+    nBlocks_Gain _gain[Inputs];
+    Sample _scratch[Length] __attribute__((aligned(NBLOCKS_VECTOR_ALIGN)));
+};
+
+
+/**
+ *  \brief FIR filter with Taps coefficients
+ */
+template <typename Sample, size_t Length, size_t Taps>
+class nBlock_VectorFir: public nBlockVectorNode<Sample, 1, Length> {
+public:
+    /**
+     *  \param [in] coefficients Taps coefficients, coefficients[0]
+     *  applying to the newest sample
+     */
+    nBlock_VectorFir(const Sample * coefficients) {
+        unsigned int i;
+        for (i=0; i<Taps; i++) _coeffs[i] = coefficients[Taps - 1 - i];
+        nBlocks_VectorFirInit(&_fir, _coeffs, _state, Taps, Length);
+    }
+
+protected:
+    void processBlock(const Sample * const * inputs, uint32_t length) {
+        nBlocks_VectorFir(&_fir, inputs[0], this->outputBuffer(), length);
+        this->publishBlock(length);
+    }
+
+private:
+    typename nBlocks_FirOf<Sample>::type _fir;
+    Sample _coeffs[Taps] __attribute__((aligned(NBLOCKS_VECTOR_ALIGN)));
+    Sample _state[Taps + Length] __attribute__((aligned(NBLOCKS_VECTOR_ALIGN)));
+};
+
+
+/**
+ *  \brief Cascade of Stages biquad filters, float samples
+ */
+template <size_t Length, size_t Stages>
+class nBlock_VectorBiquad: public nBlockVectorNode<float, 1, Length> {
+public:
+    /**
+     *  \param [in] coefficients 5 per stage, see nBlocks_BiquadF32
+     */
+    nBlock_VectorBiquad(const float * coefficients) {
+        unsigned int i;
+        for (i=0; i<(5 * Stages); i++) _coeffs[i] = coefficients[i];
+        nBlocks_VectorBiquadInit(&_biquad, _coeffs, _state, Stages);
+    }
+
+protected:
+    void processBlock(const float * const * inputs, uint32_t length) {
+        nBlocks_VectorBiquad(&_biquad, inputs[0], this->outputBuffer(), length);
+        this->publishBlock(length);
+    }
+
+private:
+    nBlocks_BiquadF32 _biquad;
+    float _coeffs[5 * Stages];
+    float _state[4 * Stages];
+};
+
+
+/**
+ *  \brief Root mean square of each block. Outputs a float for float
+ *  samples, or a Q15 integer for Q15 samples.
+ */
+template <typename Sample, size_t Length>
+class nBlock_VectorRms: public nBlockVectorNode<Sample, 1, Length, 1> {
+public:
+    nBlock_VectorRms(void) {
+        this->outputType[0] = nBlocks_ScalarType((Sample)0);
+    }
+
+protected:
+    void processBlock(const Sample * const * inputs, uint32_t length) {
+        this->publishScalar(nBlocks_VectorRms(inputs[0], length));
+    }
+};
+
+
+/**
+ *  \brief Amplitude of one DFT bin of each block of float samples:
+ *  |X[bin]| * 2 / Length, i.e. the amplitude of a sinusoid at
+ *  bin * sample rate / Length. Outputs a float.
+ *
+ *  \details Computes the single bin as two dot products against
+ *  precomputed cosine and sine tables (2 * Length floats), which
+ *  vectorize, instead of a full FFT. Shorter blocks are compared against
+ *  the start of the tables.
+ */
+template <size_t Length>
+class nBlock_VectorBin: public nBlockVectorNode<float, 1, Length, 1> {
+public:
+    nBlock_VectorBin(uint32_t bin) {
+        unsigned int i;
+        float w = 6.283185307f * (float)(bin) / (float)(Length);
+        this->outputType[0] = OUTPUT_TYPE_FLOAT;
+        for (i=0; i<Length; i++) {
+            _cos[i] = cosf(w * (float)(i));
+            _sin[i] = sinf(w * (float)(i));
+        }
+    }
+
+protected:
+    void processBlock(const float * const * inputs, uint32_t length) {
+        float re = nBlocks_VectorDot(inputs[0], _cos, length);
+        float im = nBlocks_VectorDot(inputs[0], _sin, length);
+        this->publishScalar(2.0f * sqrtf((re * re) + (im * im)) / (float)(Length));
+    }
+
+private:
+    float _cos[Length] __attribute__((aligned(NBLOCKS_VECTOR_ALIGN)));
+    float _sin[Length] __attribute__((aligned(NBLOCKS_VECTOR_ALIGN)));
+};
+
+#endif
@@ -1,4 +1,9 @@
 #include "nworkbench.h"
+// The profiler and the tracer only observe the default workbench
+#define NBLOCKS_INSTRUMENTED    (this->_instrumented)
+#include "nprofile.h"
+#include "ntrace.h"
+#include "nexecutor.h"
 
 #ifdef TARGET_LPC1768
 
@@ -9,24 +14,12 @@
 #endif
 
 
-
-Ticker PropagateTicker;
-DigitalOut * __framePulse = 0;
-InterruptIn * __tickPin = 0;
-
-nBlockNode * __firstNode = 0;
-nBlockNode * __last_node = 0;
-nBlockConnection * __first_connection = 0;
-nBlockConnection * __last_connection = 0;
-uint32_t __propagating = 0;
-
-uint32_t __tickerElapsed = 0;
-
-nBlocks_KernelData __kernel_data = {
-    .period = 0.001,
-    .tickSource = KERNEL_TICK_TIMER,
-    .sourcePin = NC
-};
+// Current workbench of each thread, 0 for the default one
+#ifdef TARGET_HOST
+static thread_local nWorkbench * __current_workbench = 0;
+#else
+static nWorkbench * __current_workbench = 0;
+#endif
 
 uint32_t PackFloat(float value) {
     uint32_t packed = 0;
@@ -36,21 +29,43 @@ uint32_t PackFloat(float value) {
     return packed;
 }
 
+uint64_t PackDouble(double value) {
+    uint64_t packed = 0;
+    memcpy(&packed, &value, sizeof(packed));
+    return packed;
+}
+
 
 
 // NBLOCK NODE BASIC CLASS
 nBlockNode::nBlockNode(void) {
-    // placeholder
-    if (__firstNode == 0) __firstNode = this;
-    if (__last_node != 0) __last_node->setNext(this);
-    __last_node = this;
+    this->_next = 0;
+    // Nodes built while registration is suspended belong to no workbench
+    this->_workbench = nWorkbench::current()->addNode(this) ? nWorkbench::current() : 0;
+    this->_index = 0;
+    this->_dirtyOutputs = NBLOCKS_ALL_OUTPUTS;
+    this->_rateDivisor = 1;
+    this->_ratePhase = 0;
 }
 void nBlockNode::setNext(nBlockNode * next) { this->_next = next; }
-uint32_t nBlockNode::getNext(void) { return (uint32_t)(this->_next); }
+nBlockNode * nBlockNode::getNext(void) { return this->_next; }
+void nBlockNode::setRate(uint32_t divisor, uint32_t phase) {
+    if (divisor == 0) divisor = 1;
+    this->_rateDivisor = divisor;
+    this->_ratePhase = (phase == NBLOCKS_AUTO_PHASE) ? phase : (phase % divisor);
+    if (this->_workbench) this->_workbench->invalidate();
+}
+void nBlockNode::setIndex(uint32_t index) { this->_index = index; }
+uint32_t nBlockNode::getIndex(void) { return this->_index; }
 void nBlockNode::setKernelData(nBlocks_KernelData kernel_data) { return; }
 uint32_t nBlockNode::outputAvailable(uint32_t outputNumber) { return 0; }
-uint32_t nBlockNode::readOutput(uint32_t outputNumber) { return 0; }
+nBlocks_Handle nBlockNode::readOutput(uint32_t outputNumber) { return 0; }
+uint64_t nBlockNode::readOutput64(uint32_t outputNumber) { return this->readOutput(outputNumber); }
 void nBlockNode::triggerInput(nBlocks_Message message) { return; }
+void nBlockNode::triggerInputs(const nBlocks_Message * messages, uint32_t count) {
+    uint32_t i;
+    for (i=0; i<count; i++) this->triggerInput(messages[i]);
+}
 void nBlockNode::step(void) { return; }
 
 
@@ -58,195 +73,1405 @@ void nBlockNode::step(void) { return; }
 
 // NBLOCKCONNECTION
 nBlockConnection::nBlockConnection(nBlockNode * srcBlock, uint32_t outputNumber, nBlockNode * dstBlock, uint32_t inputNumber) {
+    this->init(srcBlock, outputNumber, dstBlock, inputNumber, 0, 0);
+}
+
+nBlockConnection::nBlockConnection(nBlockNode * srcBlock, uint32_t outputNumber, nBlockNode * dstBlock, uint32_t inputNumber,
+        nBlocks_ReadFunction read, nBlocks_DeliverFunction deliver) {
+    this->init(srcBlock, outputNumber, dstBlock, inputNumber, read, deliver);
+}
+
+void nBlockConnection::init(nBlockNode * srcBlock, uint32_t outputNumber, nBlockNode * dstBlock, uint32_t inputNumber,
+        nBlocks_ReadFunction read, nBlocks_DeliverFunction deliver) {
     this->_srcBlock = srcBlock;
     this->_outputNumber = outputNumber;
     this->_dstBlock = dstBlock;
     this->_inputNumber = inputNumber;
+    this->_read = read;
+    this->_deliver = deliver;
     this->_next = 0;
 
-    if (__first_connection == 0) __first_connection = this;
-    if (__last_connection != 0) __last_connection->setNext(this);
-    __last_connection = this;
+    nWorkbench::current()->addConnection(this);
 }
 
-void nBlockConnection::propagate(void) {
+/**
+ *  \brief Reads one output of a node into a message. The input number
+ *  is left for the caller, since one read may be fanned out to several
+ *  destinations.
+ *  
+ *  \param [in] src Source node
+ *  \param [in] outputNumber Output number to read
+ *  \param [in] data_available Value returned by outputAvailable()
+ *  \param [out] message Message to be populated
+ */
+static inline void ReadOutputMessage(nBlockNode * src, uint32_t outputNumber, uint32_t data_available, nBlocks_Message * message) {
+    // Data is available. If the output type is string or array, 
+    // this is number of chars/values to be read. 
+    // Otherwise, this is a boolean flag
+    uint32_t type = src->readOutputType(outputNumber);
+    
+    if (NBLOCKS_OUTPUT_IS_64(type)) nBlocks_FillMessage64(type, src->readOutput64(outputNumber), data_available, message);
+    else nBlocks_FillMessage(type, src->readOutput(outputNumber), data_available, message);
+}
+
+/**
+ *  \brief Reads an output into a message, with the read function of a
+ *  typed connection if given, else through the virtual methods
+ *  
+ *  \return Data available, the message is filled only if not zero
+ */
+static inline uint32_t ReadMessage(nBlocks_ReadFunction read, nBlockNode * src, uint32_t outputNumber, nBlocks_Message * message) {
     uint32_t data_available;
-    nBlocks_OutputType data_type;
+    
+    if (read != 0) return read(src, message);
+    data_available = src->outputAvailable(outputNumber);
+    if (data_available > 0) ReadOutputMessage(src, outputNumber, data_available, message);
+    return data_available;
+}
+
+/**
+ *  \brief Delivers messages to a node, with the deliver function of a
+ *  typed connection if given, else through triggerInputs()
+ */
+static inline void DeliverMessages(nBlocks_DeliverFunction deliver, nBlockNode * dst, const nBlocks_Message * messages, uint32_t count) {
+    if (deliver != 0) deliver(dst, messages, count);
+    else dst->triggerInputs(messages, count);
+}
+
+void nBlockConnection::propagate(void) {
     nBlocks_Message message;
     
     // Check if the connected output has data available
-    data_available = this->_srcBlock->outputAvailable(this->_outputNumber);
-    if (data_available > 0) {
-        // Data is available. If the output type is string or array, 
-        // this is number of chars/values to be read. 
-        // Otherwise, this is a boolean flag
-                
-        // Retrieve data type
-        data_type = this->_srcBlock->readOutputType(this->_outputNumber);
-
-        // Populate message fields
+    if (ReadMessage(this->_read, this->_srcBlock, this->_outputNumber, &message) > 0) {
         message.inputNumber = this->_inputNumber;
-        message.dataType = data_type;
-        message.dataLength = data_available;
-        // Reset all values
-        message.intValue = 0;
-        message.floatValue = 0.0;
-        char * empty_string = (char *)(""); // 1-char string with null
-        message.stringValue = empty_string;
-        
-        // Assign the correct value based on type
-        
-        switch (data_type) {
-            case OUTPUT_TYPE_INT:
-                // INT type is direct read
-                message.intValue = this->_srcBlock->readOutput(this->_outputNumber);
-                break;
-
-            case OUTPUT_TYPE_STRING:
-                // STRINGs are passed as uint memory addresses (char *)
-                message.stringValue = (char *)(this->_srcBlock->readOutput(this->_outputNumber));
-                break;
-
-            case OUTPUT_TYPE_ARRAY:
-                // ARRAYs are passed as uint memory addresses
-                message.pointerValue = (this->_srcBlock->readOutput(this->_outputNumber));
-                break;
-                
-            case OUTPUT_TYPE_FLOAT:
-                uint32_t packed_value = (this->_srcBlock->readOutput(this->_outputNumber));
-                // Copy memory contents of the output value into the
-                // message field, reinterpreting the bits
-                memcpy(&(message.floatValue), &(packed_value), sizeof(packed_value));
-                break;
-        }
 
         // Finally trigger the message in the receiving node
-        this->_dstBlock->triggerInput(message);
+        DeliverMessages(this->_deliver, this->_dstBlock, &message, 1);
     }
 }
 void nBlockConnection::setNext(nBlockConnection * next) {
     this->_next = next;
 }
-uint32_t nBlockConnection::getNext(void) {
-    return (uint32_t)(this->_next);
+nBlockConnection * nBlockConnection::getNext(void) {
+    return this->_next;
 }
 
 
 ///////////////////
-void propagateTick(void) {
+// NWORKBENCH
+nWorkbench::nWorkbench(void) {
+    this->_ticker = 0;
+    this->_tick_pin = 0;
+    this->_frame_pulse = 0;
+    this->_first_node = 0;
+    this->_last_node = 0;
+    this->_first_connection = 0;
+    this->_last_connection = 0;
+    this->_propagating = 0;
+    this->_registration_suspended = 0;
+    this->_instrumented = 0;
+    this->_graph_frame = 0;
+    this->_graph_setup = 0;
+    this->_graph_context = 0;
+    
+    this->_compiled = 0;
+    this->_num_nodes = 0;
+    this->_nodes = 0;
+    this->_num_groups = 0;
+    this->_group_src = 0;
+    this->_group_output = 0;
+    this->_group_first = 0;
+    this->_group_read = 0;
+    this->_num_connections = 0;
+    this->_conn_dst = 0;
+    this->_conn_input = 0;
+    this->_node_first_group = 0;
+    this->_num_dirty = 0;
+    this->_dirty = 0;
+    this->_conn_dst_index = 0;
+    this->_node_deliver = 0;
+    this->_in_first = 0;
+    this->_in_count = 0;
+    this->_in_messages = 0;
+    this->_num_gathered = 0;
+    this->_num_rates = 0;
+    this->_rate_divisor = 0;
+    this->_rate_first = 0;
+    this->_rate_phase = 0;
+    this->_rate_cursor = 0;
+    this->_rate_nodes = 0;
+    this->_rate_node_phase = 0;
+    this->_frame_count = 0;
+    this->_node_due = 0;
+#ifdef TARGET_HOST
+    this->_stage_threads = 1;
+    this->_executor = 0;
+    this->_due_list = 0;
+    this->_in_src = 0;
+    this->_in_read = 0;
+    this->_in_output = 0;
+    this->_in_input = 0;
+    this->_num_in_nodes = 0;
+    this->_in_nodes = 0;
+    this->_src_pending = 0;
+#endif
+    this->_schedule_mode = KERNEL_SCHEDULE_STAGED;
+    this->_order = 0;
+    
+    this->_ticker_elapsed = 0;
+#ifdef TARGET_HOST
+    pthread_mutex_init(&this->_tick_lock, 0);
+    pthread_cond_init(&this->_tick_cond, 0);
+#endif
+    this->_ticks_taken = 0;
+    
+    this->_overrun_policy = KERNEL_OVERRUN_REPLAY_ALL;
+    this->_max_burst = 1;
+    this->resetStats();
+    
+    this->_kernel_data.period = 0.001;
+    this->_requested_period = 0.001;
+    this->_kernel_data.tickSource = KERNEL_TICK_TIMER;
+    this->_kernel_data.sourcePin = NC;
+    this->_kernel_data.blockSize = 1;
+    
+    this->_arena_half = 0;
+    this->_arena_used = 0;
+}
+
+nWorkbench::~nWorkbench(void) {
+    // Stop the tick source first: it calls tick() on this object
+    delete this->_ticker;
+    delete this->_tick_pin;
+    delete this->_frame_pulse;
+#ifdef TARGET_HOST
+    delete this->_executor;
+#endif
+    this->releaseTables();
+#ifdef TARGET_HOST
+    pthread_cond_destroy(&this->_tick_cond);
+    pthread_mutex_destroy(&this->_tick_lock);
+#endif
+}
+
+nWorkbench * nWorkbench::defaultInstance(void) {
+    // Constructed on first use, so nodes declared as globals in other
+    // files can register into it whatever the initialization order
+    static nWorkbench instance;
+    return &instance;
+}
+
+nWorkbench * nWorkbench::current(void) {
+    nWorkbench * workbench = __current_workbench;
+    return (workbench != 0) ? workbench : nWorkbench::defaultInstance();
+}
+
+nWorkbench * nWorkbench::select(void) {
+    nWorkbench * previous = nWorkbench::current();
+    __current_workbench = this;
+    return previous;
+}
+
+uint32_t nWorkbench::addNode(nBlockNode * node) {
+    if (this->_registration_suspended) return 0;
+    if (this->_first_node == 0) this->_first_node = node;
+    if (this->_last_node != 0) this->_last_node->setNext(node);
+    this->_last_node = node;
+    this->_compiled = 0;
+    return 1;
+}
+
+void nWorkbench::addConnection(nBlockConnection * connection) {
+    if (this->_registration_suspended) return;
+    // Nodes of another workbench are indexed in its own tables, and
+    // unregistered nodes (e.g. of an nBlockStaticGraph) in none: graphs
+    // of different workbenches exchange messages through nBlockPeerLink
+    if ((connection->getSource()->getWorkbench() != this) || (connection->getDestination()->getWorkbench() != this)) return;
+    if (this->_first_connection == 0) this->_first_connection = connection;
+    if (this->_last_connection != 0) this->_last_connection->setNext(connection);
+    this->_last_connection = connection;
+    this->_compiled = 0;
+}
+
+/**
+ *  \brief Returns the number of pending ticks
+ */
+inline uint32_t nWorkbench::ticksPending(void) {
+#ifdef TARGET_HOST
+    return __atomic_load_n(&this->_ticker_elapsed, __ATOMIC_ACQUIRE);
+#else
+    return this->_ticker_elapsed;
+#endif
+}
+
+/**
+ *  \brief Removes ticks from the counter, atomically with respect to
+ *  the tick interrupt
+ *  
+ *  \param [in] count Number of ticks to remove
+ */
+inline void nWorkbench::ticksTake(uint32_t count) {
+    this->_ticks_taken += count;
+#ifdef TARGET_HOST
+    __atomic_fetch_sub(&this->_ticker_elapsed, count, __ATOMIC_ACQ_REL);
+#else
+    // Cortex-M0 has no exclusive access instructions: mask interrupts
+    // for the read-modify-write, preserving the caller's mask state
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    this->_ticker_elapsed -= count;
+    __set_PRIMASK(primask);
+#endif
+}
+
+void nWorkbench::tick(void) {
     // tickerElapsed is not a boolean flag, it is a counter instead
     // This means two unserviced ticks will force ProgressNodes()
     // to run twice
     // This is a soft realtime system
-    __tickerElapsed++;
+#ifdef TARGET_HOST
+    // Ticks come from other threads on the host
+    __atomic_fetch_add(&this->_ticker_elapsed, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&this->_tick_lock);
+    pthread_cond_signal(&this->_tick_cond);
+    pthread_mutex_unlock(&this->_tick_lock);
+#else
+    // Runs in interrupt context, so main() can't interleave
+    this->_ticker_elapsed++;
+#endif
+}
+
+/**
+ *  \brief Blocks until at least one tick is pending
+ */
+void nWorkbench::waitForTick(void) {
+#ifdef TARGET_HOST
+    if (HostSimActive()) {
+        // Virtual time: run it up to the next tick
+        while ((this->ticksPending() == 0) && HostSimStep()) { }
+        return;
+    }
+    pthread_mutex_lock(&this->_tick_lock);
+    while (this->ticksPending() == 0) pthread_cond_wait(&this->_tick_cond, &this->_tick_lock);
+    pthread_mutex_unlock(&this->_tick_lock);
+#else
+    // With interrupts masked, a tick arriving between the test and WFI
+    // stays pending and makes WFI return at once, so no tick is missed
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    while (this->_ticker_elapsed == 0) {
+        __WFI();
+        // Let the pending interrupt run, then test again
+        __enable_irq();
+        __ISB();
+        __disable_irq();
+    }
+    __set_PRIMASK(primask);
+#endif
+}
+
+void nWorkbench::period(float new_period) {
+    // Kept to be checked again if the block size changes
+    this->_requested_period = new_period;
+    // Prevents too low a frame period
+    if ((new_period * (float)(this->_kernel_data.blockSize)) < 0.0001) return;
+    
+    this->_kernel_data.period = new_period;
+}
+
+void nWorkbench::blockSize(uint32_t samples) {
+    this->_kernel_data.blockSize = (samples > 0) ? samples : 1;
+    // A period ignored at the previous block size may be valid now
+    if ((this->_requested_period * (float)(this->_kernel_data.blockSize)) >= 0.0001) {
+        this->_kernel_data.period = this->_requested_period;
+    }
+}
+
+uint64_t nWorkbench::sampleIndex(void) {
+    if (this->_ticks_taken == 0) return 0;
+    return (this->_ticks_taken - 1) * this->_kernel_data.blockSize;
+}
+
+void nWorkbench::tickSource(nBlocks_KernelSources source_flag, PinName source_pin) {
+    this->_kernel_data.tickSource = source_flag;
+    this->_kernel_data.sourcePin = source_pin;
+}
+
+void nWorkbench::scheduleMode(nBlocks_ScheduleModes mode) {
+    this->_schedule_mode = mode;
+}
+
+void nWorkbench::overrunPolicy(nBlocks_OverrunPolicies policy, uint32_t max_burst) {
+    this->_overrun_policy = policy;
+    this->_max_burst = (max_burst > 0) ? max_burst : 1;
+}
+
+nBlocks_KernelStats nWorkbench::getStats(void) {
+    nBlocks_KernelStats stats = this->_stats;
+    
+    // Include the frame in progress or last processed
+    if (this->_arena_used > stats.arenaPeak) stats.arenaPeak = this->_arena_used;
+    stats.arenaFailures += this->_arena_failures;
+    return stats;
+}
+
+void nWorkbench::resetStats(void) {
+    this->_stats.frames = 0;
+    this->_stats.droppedFrames = 0;
+    this->_stats.overrunEvents = 0;
+    this->_stats.longestBurst = 0;
+    this->_stats.arenaPeak = 0;
+    this->_stats.arenaFailures = 0;
+    this->_arena_failures = 0;
+}
+
+void nWorkbench::suspendRegistration(void) {
+    this->_registration_suspended++;
+}
+
+void nWorkbench::resumeRegistration(void) {
+    if (this->_registration_suspended > 0) this->_registration_suspended--;
 }
 
-void KernelPeriod(float new_period) {
-    // Prevents too low a period
-    if (new_period < 0.0001) return;
+void nWorkbench::attachGraph(nBlocks_FrameFunction frame, nBlocks_SetupFunction setup, void * context) {
+    this->_graph_frame = frame;
+    this->_graph_setup = setup;
+    this->_graph_context = context;
+}
+
+void * nWorkbench::frameAlloc(uint32_t size) {
+#if NBLOCKS_FRAME_ARENA_SIZE > 0
+    uint32_t offset;
     
-    __kernel_data.period = new_period;
+    if (size <= NBLOCKS_FRAME_ARENA_SIZE) {
+        // Rounding also keeps _arena_used aligned
+        if (size == 0) size = 1;
+        size = (size + (NBLOCKS_FRAME_ARENA_ALIGN - 1)) & ~(uint32_t)(NBLOCKS_FRAME_ARENA_ALIGN - 1);
+#ifdef TARGET_HOST
+        // Nodes may be stepped on several threads
+        offset = __atomic_fetch_add(&this->_arena_used, size, __ATOMIC_RELAXED);
+#else
+        offset = this->_arena_used;
+        this->_arena_used = offset + size;
+#endif
+        if ((offset + size) <= NBLOCKS_FRAME_ARENA_SIZE) return &(this->_frame_arena[this->_arena_half][offset]);
+    }
+#endif
+#ifdef TARGET_HOST
+    __atomic_fetch_add(&this->_arena_failures, 1, __ATOMIC_RELAXED);
+#else
+    this->_arena_failures++;
+#endif
+    return 0;
+}
+
+/**
+ *  \brief Starts a frame in the frame arena: switches to the other half,
+ *  whose allocations are two frames old, and empties it
+ */
+inline void nWorkbench::arenaNextFrame(void) {
+    if (this->_arena_used > this->_stats.arenaPeak) this->_stats.arenaPeak = this->_arena_used;
+    this->_stats.arenaFailures += this->_arena_failures;
+    this->_arena_failures = 0;
+    this->_arena_used = 0;
+    this->_arena_half ^= 1;
+}
+
+#ifdef TARGET_HOST
+void nWorkbench::parallelStages(uint32_t num_threads) {
+    this->_stage_threads = (num_threads > 0) ? num_threads : 1;
 }
 
-void KernelTickSource(nBlocks_KernelSources source_flag, PinName source_pin) {
-    __kernel_data.tickSource = source_flag;
-    __kernel_data.sourcePin = source_pin;
+static uint32_t SimulationIdle(void) {
+    return nWorkbench::current()->progressNodes();
 }
 
-void KernelEnableFramePulse(PinName pin) {
-    if (!__framePulse && (pin != NC)) {
-        __framePulse = new DigitalOut(pin);
-        __framePulse->write(0);
+nBlocks_SimulationStats nWorkbench::simulate(float seconds) {
+    nBlocks_SimulationStats result = { 0, 0, 0, 0.0f };
+    uint64_t start, wall;
+    
+    nWorkbench * previous;
+    
+    if (!HostSimActive()) return result;
+    start = HostTimeNs();
+    wall = HostWallTimeNs();
+    previous = this->select();
+    result.frames = HostSimRun(start + (uint64_t)((double)seconds * 1e9), &SimulationIdle);
+    previous->select();
+    result.wallNs = HostWallTimeNs() - wall;
+    result.virtualNs = HostTimeNs() - start;
+    if (result.wallNs > 0) result.framesPerSecond = (float)((double)result.frames * 1e9 / (double)result.wallNs);
+    return result;
+}
+#endif
+
+void nWorkbench::enableFramePulse(PinName pin) {
+    if (!this->_frame_pulse && (pin != NC)) {
+        this->_frame_pulse = new DigitalOut(pin);
+        this->_frame_pulse->write(0);
+    }
+}
+
+/**
+ *  \brief Builds the rate groups from the divisors and phases declared
+ *  by the nodes. Groups are sorted by divisor, nodes within a group by
+ *  phase and then traversing order. Nodes with NBLOCKS_AUTO_PHASE are
+ *  dealt round-robin over the phases of their group, starting at a
+ *  different phase for each group, so slow nodes of different rates
+ *  don't pile up on the same frame.
+ */
+void nWorkbench::computeRates(void) {
+    uint32_t * group_of = new uint32_t [this->_num_nodes];
+    uint32_t * auto_count;
+    uint32_t i, j, r, k, d, phase;
+    
+    // Distinct divisors, in increasing order
+    this->_rate_divisor = new uint32_t [this->_num_nodes + 1];
+    this->_num_rates = 0;
+    for (i=0; i<this->_num_nodes; i++) {
+        d = this->_nodes[i]->getRateDivisor();
+        for (r=0; r<this->_num_rates; r++) if (this->_rate_divisor[r] >= d) break;
+        if ((r < this->_num_rates) && (this->_rate_divisor[r] == d)) continue;
+        for (j=this->_num_rates; j>r; j--) this->_rate_divisor[j] = this->_rate_divisor[j-1];
+        this->_rate_divisor[r] = d;
+        this->_num_rates++;
+    }
+    
+    this->_rate_first = new uint32_t [this->_num_rates + 1];
+    this->_rate_phase = new uint32_t [this->_num_rates];
+    this->_rate_cursor = new uint32_t [this->_num_rates];
+    this->_rate_nodes = new uint32_t [this->_num_nodes];
+    this->_rate_node_phase = new uint32_t [this->_num_nodes];
+    auto_count = new uint32_t [this->_num_rates];
+    
+    for (r=0; r<this->_num_rates; r++) auto_count[r] = 0;
+    for (i=0; i<this->_num_nodes; i++) {
+        for (r=0; this->_rate_divisor[r] != this->_nodes[i]->getRateDivisor(); r++) { }
+        group_of[i] = r;
+    }
+    
+    // Fill groups in traversing order, resolving automatic phases
+    k = 0;
+    for (r=0; r<this->_num_rates; r++) {
+        this->_rate_first[r] = k;
+        for (i=0; i<this->_num_nodes; i++) {
+            if (group_of[i] != r) continue;
+            phase = this->_nodes[i]->getRatePhase();
+            if (phase == NBLOCKS_AUTO_PHASE) {
+                phase = (r + auto_count[r]) % this->_rate_divisor[r];
+                auto_count[r]++;
+            }
+            // Stable insertion by phase
+            j = k;
+            while ((j > this->_rate_first[r]) && (this->_rate_node_phase[j-1] > phase)) {
+                this->_rate_nodes[j] = this->_rate_nodes[j-1];
+                this->_rate_node_phase[j] = this->_rate_node_phase[j-1];
+                j--;
+            }
+            this->_rate_nodes[j] = i;
+            this->_rate_node_phase[j] = phase;
+            k++;
+        }
+        this->_rate_phase[r] = 0;
+        this->_rate_cursor[r] = this->_rate_first[r];
+    }
+    this->_rate_first[this->_num_rates] = k;
+    
+    this->_frame_count = 0;
+    this->_node_due = new uint32_t [this->_num_nodes];
+    for (i=0; i<this->_num_nodes; i++) this->_node_due[i] = 0xFFFFFFFF;
+#ifdef TARGET_HOST
+    this->_due_list = new uint32_t [this->_num_nodes];
+#endif
+    
+    delete[] group_of;
+    delete[] auto_count;
+}
+
+#ifdef TARGET_HOST
+/**
+ *  \brief Builds the connections by destination node (_in_*) from the
+ *  compiled groups. Sources are taken in rate group order, which is the
+ *  order of every dirty list, so each destination lists its connections
+ *  in the order a serial propagate stage delivers them.
+ */
+void nWorkbench::compileIncoming(void) {
+    uint32_t * bucket = new uint32_t [this->_num_nodes];
+    uint32_t i, j, g, c, d;
+    
+    for (i=0; i<this->_num_nodes; i++) bucket[i] = this->_in_first[i];
+    this->_num_in_nodes = 0;
+    for (i=0; i<this->_num_nodes; i++) if (this->_in_first[i+1] > this->_in_first[i]) this->_num_in_nodes++;
+    this->_in_nodes = new uint32_t [this->_num_in_nodes];
+    this->_num_in_nodes = 0;
+    for (i=0; i<this->_num_nodes; i++) if (this->_in_first[i+1] > this->_in_first[i]) this->_in_nodes[this->_num_in_nodes++] = i;
+    
+    // Stable counting sort by destination
+    this->_in_src = new uint32_t [this->_num_connections];
+    this->_in_read = new nBlocks_ReadFunction [this->_num_connections];
+    this->_in_output = new uint32_t [this->_num_connections];
+    this->_in_input = new uint32_t [this->_num_connections];
+    for (j=0; j<this->_num_nodes; j++) {
+        i = this->_rate_nodes[j];
+        for (g=this->_node_first_group[i]; g<this->_node_first_group[i+1]; g++) {
+            for (c=this->_group_first[g]; c<this->_group_first[g+1]; c++) {
+                d = bucket[this->_conn_dst_index[c]]++;
+                this->_in_src[d] = i;
+                this->_in_read[d] = this->_group_read[g];
+                this->_in_output[d] = this->_group_output[g];
+                this->_in_input[d] = this->_conn_input[c];
+            }
+        }
+    }
+    delete[] bucket;
+    
+    this->_src_pending = new uint8_t [this->_num_nodes];
+    for (i=0; i<this->_num_nodes; i++) this->_src_pending[i] = 0;
+}
+#endif
+
+/**
+ *  \brief Computes _order, a topological order of the node table, as
+ *  the reverse postorder of a depth-first search over the connections.
+ *  The search starts from nodes without incoming connections, then from
+ *  any node left (graphs made only of cycles). Connections reaching a
+ *  node still on the search stack close a cycle: they become back edges
+ *  and keep the one-frame delay. The search uses explicit stacks, so
+ *  deep graphs do not exhaust the MCU stack.
+ */
+void nWorkbench::computeOrder(void) {
+    uint8_t * state = new uint8_t [this->_num_nodes]; // 0: new, 1: on stack, 2: done
+    uint32_t * has_input = new uint32_t [this->_num_nodes];
+    uint32_t * stack_node = new uint32_t [this->_num_nodes];
+    uint32_t * stack_conn = new uint32_t [this->_num_nodes];
+    uint32_t pos = this->_num_nodes;
+    uint32_t sp, pass, r, n, c, d;
+    
+    this->_order = new uint32_t [this->_num_nodes];
+    
+    for (n=0; n<this->_num_nodes; n++) {
+        state[n] = 0;
+        has_input[n] = 0;
+    }
+    for (c=0; c<this->_num_connections; c++) has_input[this->_conn_dst[c]->getIndex()] = 1;
+    
+    for (pass=0; pass<2; pass++) {
+        for (r=0; r<this->_num_nodes; r++) {
+            if ((state[r] != 0) || ((pass == 0) && has_input[r])) continue;
+            
+            // Depth-first search from r. stack_conn holds the next
+            // connection to follow for each node on the stack.
+            sp = 0;
+            stack_node[sp] = r;
+            stack_conn[sp] = this->_group_first[this->_node_first_group[r]];
+            sp++;
+            state[r] = 1;
+            while (sp > 0) {
+                n = stack_node[sp-1];
+                if (stack_conn[sp-1] < this->_group_first[this->_node_first_group[n+1]]) {
+                    d = this->_conn_dst[stack_conn[sp-1]++]->getIndex();
+                    if (state[d] == 0) {
+                        stack_node[sp] = d;
+                        stack_conn[sp] = this->_group_first[this->_node_first_group[d]];
+                        sp++;
+                        state[d] = 1;
+                    }
+                }
+                else {
+                    // All successors done: n goes before all of them
+                    sp--;
+                    state[n] = 2;
+                    this->_order[--pos] = n;
+                }
+            }
+        }
+    }
+    
+    delete[] state;
+    delete[] has_input;
+    delete[] stack_node;
+    delete[] stack_conn;
+}
+
+#ifdef NBLOCKS_TRACE
+/**
+ *  \brief Sets up the tracer for the compiled tables, flagging the
+ *  connections which reach a node visited earlier in topological
+ *  order: their messages are only seen by the next frame.
+ */
+void nWorkbench::setupTrace(void) {
+    uint32_t * position;
+    uint32_t g, c, k, src;
+    
+    TraceSetup(this->_num_connections);
+    if (this->_order == 0) return;
+    position = new uint32_t [this->_num_nodes];
+    for (k=0; k<this->_num_nodes; k++) position[this->_order[k]] = k;
+    for (g=0; g<this->_num_groups; g++) {
+        src = this->_group_src[g]->getIndex();
+        for (c=this->_group_first[g]; c<this->_group_first[g+1]; c++) {
+            if (position[this->_conn_dst_index[c]] <= position[src]) TraceSetBackEdge(c);
+        }
+    }
+    delete[] position;
+}
+#endif
+
+/**
+ *  \brief Frees the compiled tables
+ */
+void nWorkbench::releaseTables(void) {
+    delete[] this->_nodes;
+    delete[] this->_group_src;
+    delete[] this->_group_output;
+    delete[] this->_group_first;
+    delete[] this->_group_read;
+    delete[] this->_conn_dst;
+    delete[] this->_conn_input;
+    delete[] this->_node_first_group;
+    delete[] this->_dirty;
+    delete[] this->_conn_dst_index;
+    delete[] this->_node_deliver;
+    delete[] this->_in_first;
+    delete[] this->_in_count;
+    delete[] this->_in_messages;
+    delete[] this->_order;
+    this->_order = 0;
+    delete[] this->_rate_divisor;
+    delete[] this->_rate_first;
+    delete[] this->_rate_phase;
+    delete[] this->_rate_cursor;
+    delete[] this->_rate_nodes;
+    delete[] this->_rate_node_phase;
+    delete[] this->_node_due;
+#ifdef TARGET_HOST
+    delete[] this->_due_list;
+    delete[] this->_in_src;
+    delete[] this->_in_read;
+    delete[] this->_in_output;
+    delete[] this->_in_input;
+    delete[] this->_in_nodes;
+    delete[] this->_src_pending;
+#endif
+}
+
+/**
+ *  \brief Builds the node table and the connection table from the
+ *  linked lists. Connections are sorted by source node (in traversing
+ *  order) and then by output number; connections sharing the same
+ *  source output keep their construction order.
+ */
+void nWorkbench::compileTables(void) {
+    nBlockNode * enode;
+    nBlockConnection * econn;
+    nBlockConnection ** sorted;
+    uint32_t * bucket;
+    uint32_t i, j, n;
+    
+    this->releaseTables();
+    
+    // Node table
+    this->_num_nodes = 0;
+    for (enode = this->_first_node; enode != 0; enode = enode->getNext()) this->_num_nodes++;
+    this->_nodes = new nBlockNode * [this->_num_nodes];
+    i = 0;
+    for (enode = this->_first_node; enode != 0; enode = enode->getNext()) {
+        enode->setIndex(i);
+        this->_nodes[i++] = enode;
+    }
+    
+    // Counting sort of connections by source node index (stable)
+    this->_num_connections = 0;
+    for (econn = this->_first_connection; econn != 0; econn = econn->getNext()) this->_num_connections++;
+    sorted = new nBlockConnection * [this->_num_connections];
+    bucket = new uint32_t [this->_num_nodes + 1];
+    for (i=0; i<=this->_num_nodes; i++) bucket[i] = 0;
+    for (econn = this->_first_connection; econn != 0; econn = econn->getNext()) {
+        bucket[econn->getSource()->getIndex() + 1]++;
+    }
+    for (i=0; i<this->_num_nodes; i++) bucket[i+1] += bucket[i];
+    for (econn = this->_first_connection; econn != 0; econn = econn->getNext()) {
+        sorted[bucket[econn->getSource()->getIndex()]++] = econn;
+    }
+    delete[] bucket;
+    
+    // Within one source, stable insertion sort by output number. Nodes
+    // have few outputs, so runs are short.
+    for (i=1; i<this->_num_connections; i++) {
+        econn = sorted[i];
+        j = i;
+        while ((j > 0) && (sorted[j-1]->getSource() == econn->getSource())
+                && (sorted[j-1]->getOutputNumber() > econn->getOutputNumber())) {
+            sorted[j] = sorted[j-1];
+            j--;
+        }
+        sorted[j] = econn;
+    }
+    
+    // Count groups of connections sharing a source output
+    this->_num_groups = 0;
+    for (i=0; i<this->_num_connections; i++) {
+        if ((i == 0) || (sorted[i]->getSource() != sorted[i-1]->getSource())
+                || (sorted[i]->getOutputNumber() != sorted[i-1]->getOutputNumber())) this->_num_groups++;
+    }
+    
+    this->_group_src = new nBlockNode * [this->_num_groups];
+    this->_group_output = new uint32_t [this->_num_groups];
+    this->_group_first = new uint32_t [this->_num_groups + 1];
+    this->_group_read = new nBlocks_ReadFunction [this->_num_groups];
+    this->_conn_dst = new nBlockNode * [this->_num_connections];
+    this->_conn_input = new uint32_t [this->_num_connections];
+    
+    n = 0;
+    for (i=0; i<this->_num_connections; i++) {
+        if ((i == 0) || (sorted[i]->getSource() != sorted[i-1]->getSource())
+                || (sorted[i]->getOutputNumber() != sorted[i-1]->getOutputNumber())) {
+            this->_group_src[n] = sorted[i]->getSource();
+            this->_group_output[n] = sorted[i]->getOutputNumber();
+            this->_group_first[n] = i;
+            this->_group_read[n] = 0;
+            n++;
+        }
+        // Typed connections from one output read it the same way
+        if (sorted[i]->getReadFunction() != 0) this->_group_read[n-1] = sorted[i]->getReadFunction();
+        this->_conn_dst[i] = sorted[i]->getDestination();
+        this->_conn_input[i] = sorted[i]->getInputNumber();
+    }
+    this->_group_first[this->_num_groups] = this->_num_connections;
+    delete[] sorted;
+    
+    // Range of groups for each node
+    this->_node_first_group = new uint32_t [this->_num_nodes + 1];
+    n = 0;
+    for (i=0; i<this->_num_nodes; i++) {
+        this->_node_first_group[i] = n;
+        while ((n < this->_num_groups) && (this->_group_src[n] == this->_nodes[i])) n++;
+    }
+    this->_node_first_group[this->_num_nodes] = this->_num_groups;
+    
+    // Message space of each destination
+    this->_conn_dst_index = new uint32_t [this->_num_connections];
+    this->_node_deliver = new nBlocks_DeliverFunction [this->_num_nodes];
+    for (i=0; i<this->_num_nodes; i++) this->_node_deliver[i] = 0;
+    for (econn = this->_first_connection; econn != 0; econn = econn->getNext()) {
+        if (econn->getDeliverFunction() != 0) this->_node_deliver[econn->getDestination()->getIndex()] = econn->getDeliverFunction();
+    }
+    this->_in_first = new uint32_t [this->_num_nodes + 1];
+    this->_in_count = new uint32_t [this->_num_nodes];
+    this->_in_messages = new nBlocks_Message [this->_num_connections];
+    for (i=0; i<=this->_num_nodes; i++) this->_in_first[i] = 0;
+    for (i=0; i<this->_num_connections; i++) {
+        this->_conn_dst_index[i] = this->_conn_dst[i]->getIndex();
+        this->_in_first[this->_conn_dst_index[i] + 1]++;
+    }
+    for (i=0; i<this->_num_nodes; i++) {
+        this->_in_first[i+1] += this->_in_first[i];
+        this->_in_count[i] = 0;
+    }
+    this->_num_gathered = 0;
+    
+    this->computeRates();
+    
+    // Nodes may hold data from before the first frame, so all nodes
+    // having connections start dirty. Like every later dirty list, it
+    // follows the order of the rate groups.
+    this->_dirty = new uint32_t [this->_num_nodes];
+    this->_num_dirty = 0;
+    for (j=0; j<this->_num_nodes; j++) {
+        i = this->_rate_nodes[j];
+        if (this->_node_first_group[i+1] > this->_node_first_group[i]) this->_dirty[this->_num_dirty++] = i;
     }
+    
+#ifdef TARGET_HOST
+    if (this->_stage_threads > 1) this->compileIncoming();
+#endif
+    this->_instrumented = (this == nWorkbench::defaultInstance());
+    NBLOCKS_PROFILE_SETUP(this->_num_nodes);
+    if (this->_schedule_mode == KERNEL_SCHEDULE_TOPOLOGICAL) this->computeOrder();
+    NBLOCKS_TRACE_SETUP();
+    
+    this->_compiled = 1;
 }
 
-void SetupWorkbench(void) {
+void nWorkbench::setup(void) {
+    // Build the contiguous tables used by the frame loop
+    this->compileTables();
+    
+#ifdef TARGET_HOST
+    if ((this->_stage_threads > 1) && (this->_executor == 0)) this->_executor = new nBlockExecutor(this->_stage_threads);
+#endif
+    
     // Broadcast kernel data to all nodes
 
     // Get first node
     nBlockNode * enode;
-    enode = __firstNode;
+    enode = this->_first_node;
     
     // Traverse list of nodes
     while (enode != 0) {
         // Broadcast node under cursor
-        enode->setKernelData(__kernel_data);
+        enode->setKernelData(this->_kernel_data);
         // Move cursor to next node
-        enode = (nBlockNode *)(enode->getNext());
+        enode = enode->getNext();
     }
+    if (this->_graph_setup) this->_graph_setup(this->_graph_context, this->_kernel_data);
 
     // Start scheduler
-    __tickerElapsed = 0;
-    switch (__kernel_data.tickSource) {
+    this->_ticker_elapsed = 0;
+    switch (this->_kernel_data.tickSource) {
         // Initialize the selected tick source
         
         case KERNEL_TICK_TIMER:
-            PropagateTicker.attach(&propagateTick, __kernel_data.period);
+            // One tick per frame, i.e. per block of samples
+            if (this->_ticker == 0) this->_ticker = new Ticker();
+            this->_ticker->attach(this, &nWorkbench::tick, this->_kernel_data.period * (float)(this->_kernel_data.blockSize));
             break;
             
         case KERNEL_TICK_EXT:
-            __tickPin = new InterruptIn(__kernel_data.sourcePin);
-            __tickPin->rise(&propagateTick);
+            if (this->_tick_pin == 0) this->_tick_pin = new InterruptIn(this->_kernel_data.sourcePin);
+            this->_tick_pin->rise(this, &nWorkbench::tick);
             break;
     }
     
 }
 
-uint32_t ProgressNodes(void) {
+/**
+ *  \brief Propagates the connections of one node, for the outputs
+ *  flagged in its dirty outputs mask. Messages are gathered by
+ *  destination, to be delivered by deliverNode().
+ *  
+ *  \param [in] n Node index in the node table
+ */
+inline void nWorkbench::propagateNode(uint32_t n) {
+    nBlocks_Message message;
+    uint32_t data_available;
+    uint32_t dirty = this->_nodes[n]->getDirtyOutputs();
+    uint32_t g, c, dst, slot;
+    
+    for (g=this->_node_first_group[n]; g<this->_node_first_group[n+1]; g++) {
+        if ((dirty & NBLOCKS_OUTPUT_BIT(this->_group_output[g])) == 0) continue;
+        // Each source output is read once...
+        data_available = ReadMessage(this->_group_read[g], this->_group_src[g], this->_group_output[g], &message);
+        if (data_available == 0) continue;
+        // ...and delivered to all its destinations
+        for (c=this->_group_first[g]; c<this->_group_first[g+1]; c++) {
+            message.inputNumber = this->_conn_input[c];
+            NBLOCKS_TRACE_MESSAGE(c, &message);
+            dst = this->_conn_dst_index[c];
+            slot = this->_in_first[dst];
+            if ((this->_in_first[dst+1] - slot) == 1) {
+                // Nodes with a single input connection get it right away
+                DeliverMessages(this->_node_deliver[dst], this->_nodes[dst], &message, 1);
+            }
+            else {
+                this->_in_messages[slot + this->_in_count[dst]] = message;
+                this->_in_count[dst]++;
+                this->_num_gathered++;
+            }
+        }
+    }
+}
+
+/**
+ *  \brief Delivers the messages gathered for one node, in one call
+ *  
+ *  \param [in] n Node index in the node table
+ */
+inline void nWorkbench::deliverNode(uint32_t n) {
+    if (this->_in_count[n] == 0) return;
+    DeliverMessages(this->_node_deliver[n], this->_nodes[n], &(this->_in_messages[this->_in_first[n]]), this->_in_count[n]);
+    this->_num_gathered -= this->_in_count[n];
+    this->_in_count[n] = 0;
+}
+
+/**
+ *  \brief Delivers the messages gathered from the nodes in the dirty
+ *  list, visiting their destinations in connection order. Nodes with a
+ *  single input connection were served by propagateNode() already.
+ */
+void nWorkbench::deliverDirty(void) {
+    uint32_t d, n, g, c;
+    
+    if (this->_num_gathered == 0) return;
+    for (d=0; d<this->_num_dirty; d++) {
+        n = this->_dirty[d];
+        for (g=this->_node_first_group[n]; g<this->_node_first_group[n+1]; g++) {
+            for (c=this->_group_first[g]; c<this->_group_first[g+1]; c++) this->deliverNode(this->_conn_dst_index[c]);
+        }
+    }
+}
+
+#if defined(NBLOCKS_TRACE) && defined(TARGET_HOST)
+/**
+ *  \brief Returns the group of a compiled connection: the last group
+ *  starting at or before it
+ */
+uint32_t nWorkbench::connectionGroup(uint32_t c) {
+    uint32_t lo = 0, hi = this->_num_groups, g;
+    
+    while ((hi - lo) > 1) {
+        g = (lo + hi) / 2;
+        if (this->_group_first[g] <= c) lo = g;
+        else hi = g;
+    }
+    return lo;
+}
+
+/**
+ *  \brief Delivers one message recorded for the frame being replayed
+ *  with TRACE_REPLAY_INJECT. Payloads are not recorded: those are read
+ *  from the live source output.
+ */
+void nWorkbench::replayDeliver(const nBlocks_TraceRecord * record) {
+    nBlocks_Message message;
+    uint32_t c = record->id;
+    uint32_t g, dst;
+    
+    if (c >= this->_num_connections) return;
+    if (TraceReplayFill(record, &message) == 0) {
+        g = this->connectionGroup(c);
+        if (ReadMessage(this->_group_read[g], this->_group_src[g], this->_group_output[g], &message) == 0) return;
+        TraceReplayCheck(record, &message);
+    }
+    message.inputNumber = this->_conn_input[c];
+    dst = this->_conn_dst_index[c];
+    DeliverMessages(this->_node_deliver[dst], this->_nodes[dst], &message, 1);
+}
+
+/**
+ *  \brief Processes one topological frame replayed with
+ *  TRACE_REPLAY_INJECT. The messages recorded from a node are delivered
+ *  right after its step, but back edges, delivered after all steps.
+ */
+void nWorkbench::runReplayTopologicalFrame(void) {
+    const nBlocks_TraceRecord * records;
+    uint32_t count, i = 0, k, n;
+    
+    records = TraceReplayMessages(&count);
+    for (k=0; k<this->_num_nodes; k++) {
+        n = this->_order[k];
+        if (this->_node_due[n] == this->_frame_count) this->_nodes[n]->step();
+        while ((i < count) && ((records[i].id >= this->_num_connections)
+                || (this->_group_src[this->connectionGroup(records[i].id)]->getIndex() == n))) {
+            if ((records[i].extra & NBLOCKS_TRACE_BACK_EDGE) == 0) this->replayDeliver(&(records[i]));
+            i++;
+        }
+    }
+    for (i=0; i<count; i++) {
+        if (records[i].extra & NBLOCKS_TRACE_BACK_EDGE) this->replayDeliver(&(records[i]));
+    }
+}
+#endif
+
+/**
+ *  \brief Processes one frame using the linked lists: propagates all
+ *  connections, then steps all nodes. Used while the tables are not
+ *  compiled.
+ */
+void nWorkbench::runListFrame(void) {
     nBlockConnection * econn;
     nBlockNode * enode;
     
+    // --------
+    // Propagate connections
+    
+    // Get cursor to first connection (connection stage entry point)
+    econn = this->_first_connection;
+    // Traverse list of connections
+    while (econn != 0) {
+        // Propagate connection under cursor
+        econn->propagate();
+        // Move cursor to next connection
+        econn = econn->getNext();
+    }
+    
+    // --------
+    // Step blocks' state machines and fifos
+    
+    // Get cursor to first node (step stage entry point)
+    enode = this->_first_node;
+    // Traverse list of nodes
+    while (enode != 0) {
+        // Step node under cursor
+        enode->step();
+        // Move cursor to next node
+        enode = enode->getNext();
+    }
+}
+
+/**
+ *  \brief Moves a rate group to its next phase.
+ *  
+ *  \param [in] r Rate group
+ *  \param [in] k Position after the last node of the current phase
+ */
+inline void nWorkbench::advanceRate(uint32_t r, uint32_t k) {
+    if (++this->_rate_phase[r] == this->_rate_divisor[r]) {
+        this->_rate_phase[r] = 0;
+        k = this->_rate_first[r];
+    }
+    this->_rate_cursor[r] = k;
+}
+
+#ifdef TARGET_HOST
+/**
+ *  \brief Delivers the messages of nodes _in_nodes[begin] to [end-1],
+ *  on a pool thread. Each destination is handled by one thread only.
+ */
+void nWorkbench::propagateRange(uint32_t begin, uint32_t end) {
+    nBlocks_Message * message;
+    nBlockNode * src;
+    uint32_t data_available;
+    uint32_t j, dst, c, s;
+    
+    for (j=begin; j<end; j++) {
+        dst = this->_in_nodes[j];
+        message = &(this->_in_messages[this->_in_first[dst]]);
+        for (c=this->_in_first[dst]; c<this->_in_first[dst+1]; c++) {
+            s = this->_in_src[c];
+            if (this->_src_pending[s] == 0) continue;
+            src = this->_nodes[s];
+            if ((src->getDirtyOutputs() & NBLOCKS_OUTPUT_BIT(this->_in_output[c])) == 0) continue;
+            data_available = ReadMessage(this->_in_read[c], src, this->_in_output[c], message);
+            if (data_available == 0) continue;
+            message->inputNumber = this->_in_input[c];
+            message++;
+        }
+        if (message != &(this->_in_messages[this->_in_first[dst]])) {
+            DeliverMessages(this->_node_deliver[dst], this->_nodes[dst], &(this->_in_messages[this->_in_first[dst]]), message - &(this->_in_messages[this->_in_first[dst]]));
+        }
+    }
+}
+
+/**
+ *  \brief Runs propagateRange() of the workbench given as context. Nodes
+ *  receiving messages on the pool thread reach it through the Kernel*()
+ *  functions.
+ */
+void nWorkbench::propagateRangeEntry(void * context, uint32_t begin, uint32_t end) {
+    __current_workbench = (nWorkbench *)context;
+    ((nWorkbench *)context)->propagateRange(begin, end);
+}
+
+/**
+ *  \brief Propagate stage on the worker pool, partitioned by destination
+ */
+void nWorkbench::propagateParallel(void) {
+    uint32_t d, chunk;
+    
+    if (this->_num_dirty == 0) return;
+    for (d=0; d<this->_num_dirty; d++) this->_src_pending[this->_dirty[d]] = 1;
+    chunk = this->_num_in_nodes / (this->_executor->threads() * 8);
+    if (chunk < 16) chunk = 16;
+    this->_executor->parallelFor(this->_num_in_nodes, chunk, &nWorkbench::propagateRangeEntry, this);
+    for (d=0; d<this->_num_dirty; d++) this->_src_pending[this->_dirty[d]] = 0;
+}
+
+/**
+ *  \brief Steps nodes _due_list[begin] to [end-1], on a pool thread
+ */
+void nWorkbench::stepRange(uint32_t begin, uint32_t end) {
+    uint32_t j, i;
+    NBLOCKS_PROFILE_VAR(t_node);
+    
+    for (j=begin; j<end; j++) {
+        i = this->_due_list[j];
+        NBLOCKS_PROFILE_START(t_node);
+        this->_nodes[i]->step();
+        NBLOCKS_PROFILE_NODE(i, PROFILE_STAGE_STEP, t_node);
+    }
+}
+
+/**
+ *  \brief Runs stepRange() of the workbench given as context, see
+ *  propagateRangeEntry()
+ */
+void nWorkbench::stepRangeEntry(void * context, uint32_t begin, uint32_t end) {
+    __current_workbench = (nWorkbench *)context;
+    ((nWorkbench *)context)->stepRange(begin, end);
+}
+
+/**
+ *  \brief Step stage on the worker pool. Due nodes are listed in the
+ *  same order as the serial stage, stepped in parallel, and the dirty
+ *  list is then built serially in that order, so the next propagation
+ *  is identical to a serial run.
+ */
+void nWorkbench::stepParallel(void) {
+    uint32_t num_due = 0;
+    uint32_t r, k, j, i, phase, chunk;
+    
+    for (r=0; r<this->_num_rates; r++) {
+        phase = this->_rate_phase[r];
+        for (k=this->_rate_cursor[r]; (k < this->_rate_first[r+1]) && (this->_rate_node_phase[k] == phase); k++) {
+            this->_due_list[num_due++] = this->_rate_nodes[k];
+        }
+        this->advanceRate(r, k);
+    }
+    
+    // About 8 chunks per thread leaves room for stealing, while keeping
+    // chunks big enough to amortize the claim
+    chunk = num_due / (this->_executor->threads() * 8);
+    if (chunk < 16) chunk = 16;
+    this->_executor->parallelFor(num_due, chunk, &nWorkbench::stepRangeEntry, this);
+    
+    for (j=0; j<num_due; j++) {
+        i = this->_due_list[j];
+        if (this->_nodes[i]->getDirtyOutputs() && (this->_node_first_group[i+1] > this->_node_first_group[i])) {
+            this->_dirty[this->_num_dirty++] = i;
+        }
+    }
+}
+#endif
+
+/**
+ *  \brief Processes one frame from the compiled tables: propagates the
+ *  outputs published in the previous frame, then steps all nodes.
+ */
+void nWorkbench::runStagedFrame(void) {
+    uint32_t d, i, r, k, phase;
+#if defined(NBLOCKS_TRACE) && defined(TARGET_HOST)
+    const nBlocks_TraceRecord * records;
+#endif
+    NBLOCKS_PROFILE_VAR(t_stage);
+    NBLOCKS_PROFILE_VAR(t_node);
+    
+    // --------
+    // Propagate connections from the compiled table, only
+    // for nodes which produced data in the last step
+    
+    NBLOCKS_PROFILE_START(t_stage);
+#if defined(NBLOCKS_TRACE) && defined(TARGET_HOST)
+    if (this->_instrumented && (__trace_replay == TRACE_REPLAY_INJECT)) {
+        // Recorded messages instead of propagation
+        records = TraceReplayMessages(&r);
+        for (k=0; k<r; k++) this->replayDeliver(&(records[k]));
+    }
+    else
+#endif
+#ifdef TARGET_HOST
+    if (this->_executor) this->propagateParallel();
+    else
+#endif
+    {
+        for (d=0; d<this->_num_dirty; d++) {
+            NBLOCKS_PROFILE_START(t_node);
+            this->propagateNode(this->_dirty[d]);
+            NBLOCKS_PROFILE_NODE(this->_dirty[d], PROFILE_STAGE_PROPAGATE, t_node);
+        }
+        this->deliverDirty();
+    }
+    NBLOCKS_PROFILE_FRAME(PROFILE_STAGE_PROPAGATE, t_stage);
+    NBLOCKS_TRACE_STAGE(TRACE_STAGE_PROPAGATE);
+    
+    // --------
+    // Step blocks' state machines and fifos, collecting the
+    // nodes with dirty outputs for the next propagation.
+    // Only nodes due in this frame are stepped.
+    
+    NBLOCKS_PROFILE_START(t_stage);
+    this->_num_dirty = 0;
+#ifdef TARGET_HOST
+    if (this->_executor) {
+        this->stepParallel();
+        NBLOCKS_PROFILE_FRAME(PROFILE_STAGE_STEP, t_stage);
+        NBLOCKS_TRACE_STAGE(TRACE_STAGE_STEP);
+        this->_frame_count++;
+        return;
+    }
+#endif
+    for (r=0; r<this->_num_rates; r++) {
+        phase = this->_rate_phase[r];
+        for (k=this->_rate_cursor[r]; (k < this->_rate_first[r+1]) && (this->_rate_node_phase[k] == phase); k++) {
+            i = this->_rate_nodes[k];
+            NBLOCKS_PROFILE_START(t_node);
+            this->_nodes[i]->step();
+            NBLOCKS_PROFILE_NODE(i, PROFILE_STAGE_STEP, t_node);
+            if (this->_nodes[i]->getDirtyOutputs() && (this->_node_first_group[i+1] > this->_node_first_group[i])) {
+                this->_dirty[this->_num_dirty++] = i;
+            }
+        }
+        this->advanceRate(r, k);
+    }
+    NBLOCKS_PROFILE_FRAME(PROFILE_STAGE_STEP, t_stage);
+    NBLOCKS_TRACE_STAGE(TRACE_STAGE_STEP);
+    this->_frame_count++;
+}
+
+/**
+ *  \brief Processes one frame in topological order: each node is
+ *  stepped and its outputs are propagated immediately, so downstream
+ *  nodes receive them before their own step in the same frame.
+ */
+void nWorkbench::runTopologicalFrame(void) {
+    uint32_t k, n, r, phase;
+    NBLOCKS_PROFILE_VAR(t_node);
+    
+    // Mark the nodes due in this frame
+    for (r=0; r<this->_num_rates; r++) {
+        phase = this->_rate_phase[r];
+        for (k=this->_rate_cursor[r]; (k < this->_rate_first[r+1]) && (this->_rate_node_phase[k] == phase); k++) {
+            this->_node_due[this->_rate_nodes[k]] = this->_frame_count;
+        }
+        this->advanceRate(r, k);
+    }
+    
+#if defined(NBLOCKS_TRACE) && defined(TARGET_HOST)
+    if (this->_instrumented && (__trace_replay == TRACE_REPLAY_INJECT)) {
+        this->runReplayTopologicalFrame();
+        this->_frame_count++;
+        return;
+    }
+#endif
+    for (k=0; k<this->_num_nodes; k++) {
+        n = this->_order[k];
+        // Inputs from the nodes before this one
+        this->deliverNode(n);
+        if (this->_node_due[n] != this->_frame_count) continue;
+        NBLOCKS_PROFILE_START(t_node);
+        this->_nodes[n]->step();
+        NBLOCKS_PROFILE_NODE(n, PROFILE_STAGE_STEP, t_node);
+        if (this->_nodes[n]->getDirtyOutputs()) {
+            NBLOCKS_PROFILE_START(t_node);
+            this->propagateNode(n);
+            NBLOCKS_PROFILE_NODE(n, PROFILE_STAGE_PROPAGATE, t_node);
+        }
+    }
+    // Inputs from back edges, which reach nodes already visited
+    for (k=0; (k<this->_num_nodes) && (this->_num_gathered > 0); k++) this->deliverNode(k);
+    this->_frame_count++;
+}
+
+/**
+ *  \brief Processes one frame with the graph, the lists or the compiled
+ *  tables, whichever is in use
+ */
+inline void nWorkbench::runFrame(void) {
+    this->arenaNextFrame();
+    if (this->_graph_frame) this->_graph_frame(this->_graph_context);
+    else if (!this->_compiled) this->runListFrame();
+    else if (this->_order != 0) this->runTopologicalFrame();
+    else this->runStagedFrame();
+}
+
+#ifdef NBLOCKS_TRACE
+/**
+ *  \brief Processes one replayed frame, see KernelTraceReplay()
+ *  
+ *  \param [in] frame Tick index of the frame when recorded
+ */
+void TraceRunFrame(uint32_t frame) {
+    nWorkbench * workbench = nWorkbench::defaultInstance();
+    
+    if (workbench->_propagating) return;
+    workbench->_propagating = 1;
+    workbench->_ticks_taken = (uint64_t)frame + 1;
+    workbench->runFrame();
+    workbench->_propagating = 0;
+}
+#endif
+
+uint32_t nWorkbench::progressNodes(void) {
     // Counter to store number of iterations actually processed
     uint32_t num_iterations = 0;
+    uint32_t pending, limit;
+    nWorkbench * previous = __current_workbench;
+    NBLOCKS_PROFILE_VAR(t_frame);
+    
+    // Ignore this call if we are in the middle of a frame already
+    if (this->_propagating) return 0;
+    
+    // Frames allowed in this call by the overrun policy
+    switch (this->_overrun_policy) {
+        case KERNEL_OVERRUN_REPLAY_BOUNDED:
+            limit = this->_max_burst;
+            break;
+        case KERNEL_OVERRUN_SKIP_TO_LATEST:
+            limit = 1;
+            break;
+        default:
+            limit = 0xFFFFFFFF;
+            break;
+    }
+    
+    // More than one tick pending means the main loop stalled
+    pending = this->ticksPending();
+    if (pending > 1) {
+        this->_stats.overrunEvents++;
+        // Drop the missed frames which will not be replayed
+        if (pending > limit) {
+            this->ticksTake(pending - limit);
+            this->_stats.droppedFrames += (pending - limit);
+        }
+    }
+    
+    // Nodes reach this workbench through the Kernel*() functions
+    __current_workbench = this;
     
-    // If __tickerElapsed == 0 this call will return immediately
-    while (__tickerElapsed > 0) {
+    // If _ticker_elapsed == 0 this call will return immediately
+    while ((this->ticksPending() > 0) && (num_iterations < limit)) {
         // Ignore this call if we are in the middle of a frame already
-        if (__propagating == 0) {
-            __propagating = 1; // Flag: we are in the middle of a frame
+        if (this->_propagating == 0) {
+            this->_propagating = 1; // Flag: we are in the middle of a frame
 
             // If we have a framePulse pin configured, set it to ON
-            if (__framePulse) __framePulse->write(1);
+            if (this->_frame_pulse) this->_frame_pulse->write(1);
+            NBLOCKS_PROFILE_START(t_frame);
             
 
+            NBLOCKS_TRACE_FRAME_START((uint32_t)this->_ticks_taken, this->ticksPending());
+
             // Remove one frame tick from the down counter
-            __tickerElapsed--;
+            this->ticksTake(1);
             // Add one iteration to the up counter (return value)
             num_iterations++;
 
-            // --------
-            // Propagate connections
-            
-            // Get cursor to first connection (connection stage entry point)
-            econn = __first_connection;
-            // Traverse list of connections
-            while (econn != 0) {
-                // Propagate connection under cursor
-                econn->propagate();
-                // Move cursor to next connection
-                econn = (nBlockConnection *)(econn->getNext());
-            }
-            
-            // --------
-            // Step blocks' state machines and fifos
-            
-            // Get cursor to first node (step stage entry point)
-            enode = __firstNode;
-            // Traverse list of nodes
-            while (enode != 0) {
-                // Step node under cursor
-                enode->step();
-                // Move cursor to next node
-                enode = (nBlockNode *)(enode->getNext());
-            }
+            this->runFrame();
+            NBLOCKS_PROFILE_FRAME(PROFILE_STAGE_FRAME, t_frame);
+            NBLOCKS_TRACE_FRAME_END();
             
             // If we have a framePulse pin configured, set it to OFF
-            if (__framePulse) __framePulse->write(0);
+            if (this->_frame_pulse) this->_frame_pulse->write(0);
             
-            __propagating = 0; // Flag: no longer inside a frame
+            this->_propagating = 0; // Flag: no longer inside a frame
         }
     }
+    __current_workbench = previous;
+    this->_stats.frames += num_iterations;
+    if (num_iterations > this->_stats.longestBurst) this->_stats.longestBurst = num_iterations;
+    NBLOCKS_TRACE_IDLE();
+    
     // Return the number of frames that were actually processed
     return num_iterations;
 }
 
+uint32_t nWorkbench::waitAndProgressNodes(void) {
+    this->waitForTick();
+    return this->progressNodes();
+}
+
+
+
+// KERNEL API, on the current workbench
+void SetupWorkbench(void) { nWorkbench::current()->setup(); }
+uint32_t ProgressNodes(void) { return nWorkbench::current()->progressNodes(); }
+uint32_t WaitAndProgressNodes(void) { return nWorkbench::current()->waitAndProgressNodes(); }
+void KernelPeriod(float new_period) { nWorkbench::current()->period(new_period); }
+void KernelBlockSize(uint32_t samples) { nWorkbench::current()->blockSize(samples); }
+uint64_t KernelSampleIndex(void) { return nWorkbench::current()->sampleIndex(); }
+void KernelTickSource(nBlocks_KernelSources source_flag, PinName source_pin) { nWorkbench::current()->tickSource(source_flag, source_pin); }
+void KernelScheduleMode(nBlocks_ScheduleModes mode) { nWorkbench::current()->scheduleMode(mode); }
+void KernelOverrunPolicy(nBlocks_OverrunPolicies policy, uint32_t max_burst) { nWorkbench::current()->overrunPolicy(policy, max_burst); }
+nBlocks_KernelStats KernelGetStats(void) { return nWorkbench::current()->getStats(); }
+void KernelResetStats(void) { nWorkbench::current()->resetStats(); }
+void KernelSuspendRegistration(void) { nWorkbench::current()->suspendRegistration(); }
+void KernelResumeRegistration(void) { nWorkbench::current()->resumeRegistration(); }
+void KernelAttachGraph(nBlocks_FrameFunction frame, nBlocks_SetupFunction setup, void * context) { nWorkbench::current()->attachGraph(frame, setup, context); }
+void * KernelFrameAlloc(uint32_t size) { return nWorkbench::current()->frameAlloc(size); }
+void KernelEnableFramePulse(PinName pin) { nWorkbench::current()->enableFramePulse(pin); }
+#ifdef TARGET_HOST
+void KernelParallelStages(uint32_t num_threads) { nWorkbench::current()->parallelStages(num_threads); }
+nBlocks_SimulationStats KernelSimulate(float seconds) { return nWorkbench::current()->simulate(seconds); }
+#endif
+// Tick of the default workbench, for code driving it from its own interrupt
+void propagateTick(void) { nWorkbench::defaultInstance()->tick(); }
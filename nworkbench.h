@@ -77,6 +77,58 @@
 #define pin_F9    P0_7
 #define pin_F10   P1_29
 
+/**
+ *  \brief Bit representing an output number in a dirty outputs mask.
+ *  Outputs 0 to 30 have one bit each, outputs from 31 on share bit 31.
+ */
+#define NBLOCKS_OUTPUT_BIT(n)   (((n) < 31) ? (1u << (n)) : 0x80000000u)
+
+/**
+ *  \brief Dirty outputs mask meaning "any output may have data"
+ */
+#define NBLOCKS_ALL_OUTPUTS     0xFFFFFFFFu
+
+/**
+ *  \brief Word and bit of sample s in the availability mask following
+ *  the samples of a block (see KernelBlockSize() )
+ */
+#define NBLOCKS_SAMPLE_WORD(s)  ((s) >> 5)
+#define NBLOCKS_SAMPLE_BIT(s)   (1u << ((s) & 31))
+
+/**
+ *  \brief Marks a block message kept by reference, not copied (see
+ *  nBlockSimpleNode::storeInputs() )
+ */
+#define NBLOCKS_NO_COPY         0xFFFFFFFFu
+
+/**
+ *  \brief Phase value letting the kernel choose the phase of a node
+ *  running at a reduced rate (see nBlockNode::setRate() )
+ */
+#define NBLOCKS_AUTO_PHASE      0xFFFFFFFFu
+
+/**
+ *  \brief Output type value meaning "known at run time only", see
+ *  nBlocks_OutputTraits
+ */
+#define NBLOCKS_OUTPUT_TYPE_DYNAMIC 0xFFFFFFFFu
+
+/**
+ *  \brief Bytes in each half of the frame arena (see KernelFrameAlloc() ).
+ *  The kernel reserves twice this amount. Define as 0 to leave the arena
+ *  out entirely.
+ */
+#ifndef NBLOCKS_FRAME_ARENA_SIZE
+#define NBLOCKS_FRAME_ARENA_SIZE    512
+#endif
+
+/**
+ *  \brief Alignment of frame arena allocations, a power of two
+ */
+#ifndef NBLOCKS_FRAME_ARENA_ALIGN
+#define NBLOCKS_FRAME_ARENA_ALIGN   8
+#endif
+
 /**
  *  \brief Node output types
  */
@@ -84,9 +136,30 @@ enum nBlocks_OutputType {
     OUTPUT_TYPE_INT,
     OUTPUT_TYPE_STRING,
     OUTPUT_TYPE_FLOAT,
-    OUTPUT_TYPE_ARRAY
+    OUTPUT_TYPE_ARRAY,
+    OUTPUT_TYPE_INT_BLOCK,      /**< Block of INT samples (see KernelBlockSize() ) */
+    OUTPUT_TYPE_FLOAT_BLOCK,    /**< Block of FLOAT samples (see KernelBlockSize() ) */
+    OUTPUT_TYPE_INT64,          /**< 64-bit integer, read with readOutput64() */
+    OUTPUT_TYPE_DOUBLE          /**< Double, read with readOutput64() (see PackDouble() ) */
 };
 
+/**
+ *  \brief True for the output types read with readOutput64()
+ */
+#define NBLOCKS_OUTPUT_IS_64(type)  (((type) == OUTPUT_TYPE_INT64) || ((type) == OUTPUT_TYPE_DOUBLE))
+
+/**
+ *  \brief Value returned by readOutput(): an INT or packed FLOAT value,
+ *  or the address of a STRING, ARRAY or block payload. It is as wide as
+ *  a pointer, so addresses are not truncated on 64-bit hosts, and it is
+ *  uint32_t on 32-bit targets, so existing nodes compile unchanged.
+ */
+#if (defined(UINTPTR_MAX) && (UINTPTR_MAX > 0xFFFFFFFFu)) || (defined(__SIZEOF_POINTER__) && (__SIZEOF_POINTER__ > 4))
+typedef uint64_t nBlocks_Handle;
+#else
+typedef uint32_t nBlocks_Handle;
+#endif
+
 /**
  *  \brief Kernel tick input options
  */
@@ -95,6 +168,59 @@ enum nBlocks_KernelSources {
     KERNEL_TICK_EXT
 };
 
+/**
+ *  \brief Kernel scheduling modes
+ *  
+ *  KERNEL_SCHEDULE_STAGED: each frame propagates all connections, then
+ *  steps all nodes. A value crossing a chain of K nodes takes K frames.
+ *  
+ *  KERNEL_SCHEDULE_TOPOLOGICAL: nodes are stepped in topological order
+ *  of the graph, and the outputs of each node are propagated right after
+ *  its step, so a value crosses any acyclic chain within one frame.
+ *  Connections closing a cycle keep the one-frame delay.
+ */
+enum nBlocks_ScheduleModes {
+    KERNEL_SCHEDULE_STAGED,
+    KERNEL_SCHEDULE_TOPOLOGICAL
+};
+
+/**
+ *  \brief What ProgressNodes() does when it finds more than one tick
+ *  pending (the main loop stalled)
+ *  
+ *  KERNEL_OVERRUN_REPLAY_ALL: processes every missed frame back to back
+ *  (default, soft realtime).
+ *  
+ *  KERNEL_OVERRUN_REPLAY_BOUNDED: processes at most a given number of
+ *  frames per call, and drops the missed frames in excess.
+ *  
+ *  KERNEL_OVERRUN_SKIP_TO_LATEST: drops all missed frames but the
+ *  latest one, and processes one frame per call.
+ */
+enum nBlocks_OverrunPolicies {
+    KERNEL_OVERRUN_REPLAY_ALL,
+    KERNEL_OVERRUN_REPLAY_BOUNDED,
+    KERNEL_OVERRUN_SKIP_TO_LATEST
+};
+
+/**
+ *  \brief Frame accounting counters, see KernelGetStats()
+ */
+typedef struct nBlocks_KernelStats {
+    /** Frames processed */
+    uint32_t frames;
+    /** Ticks discarded by the overrun policy, i.e. frames never processed */
+    uint32_t droppedFrames;
+    /** Calls to ProgressNodes() which found more than one tick pending */
+    uint32_t overrunEvents;
+    /** Largest number of frames processed in one call to ProgressNodes() */
+    uint32_t longestBurst;
+    /** Most frame arena bytes requested in one frame (may exceed the size) */
+    uint32_t arenaPeak;
+    /** Calls to KernelFrameAlloc() which returned 0 */
+    uint32_t arenaFailures;
+} nBlocks_KernelStats;
+
 /**
  *  \brief Structure to broadcast kernel data to all nodes prior to 
  *  first frame
@@ -103,23 +229,112 @@ enum nBlocks_KernelSources {
      float period;
      uint32_t tickSource;
      PinName sourcePin;
+     /** Samples per frame, see KernelBlockSize() */
+     uint32_t blockSize;
  } nBlocks_KernelData;
 
 /**
  *  Structure data for messages received by destination nodes.
- *  The argument for triggerInput() is of this type.
+ *  The argument for triggerInput() is of this type, triggerInputs()
+ *  receives an array of them.
  */
 typedef struct nBlocks_Message {
     uint32_t inputNumber;
     uint32_t intValue;
     float floatValue;
     char * stringValue;
-    uint32_t pointerValue;
+    nBlocks_Handle pointerValue;
     uint32_t dataLength;
     nBlocks_OutputType dataType;
+    /** Value of INT64 and DOUBLE messages */
+    union {
+        int64_t int64Value;
+        double doubleValue;
+    };
     
 } nBlocks_Message;
 
+/**
+ *  \brief Fills all fields of a message but inputNumber from a value
+ *  read from an output. When inlined with a constant type, only the
+ *  code for that type remains.
+ *  
+ *  \param [in] type One of the constants in the nBlocks_OutputType enum
+ *  \param [in] value Value returned by readOutput()
+ *  \param [in] data_available Value returned by outputAvailable()
+ *  \param [out] message Message to fill
+ */
+static inline void nBlocks_FillMessage(uint32_t type, nBlocks_Handle value, uint32_t data_available, nBlocks_Message * message) {
+    uint32_t bits;
+    
+    message->dataType = (nBlocks_OutputType)type;
+    message->dataLength = data_available;
+    // Reset all values
+    message->intValue = 0;
+    message->floatValue = 0.0;
+    message->pointerValue = 0;
+    message->stringValue = (char *)("");
+    message->int64Value = 0;
+    
+    switch (type) {
+        case OUTPUT_TYPE_INT:
+            // INT type is direct read
+            message->intValue = (uint32_t)value;
+            break;
+        case OUTPUT_TYPE_STRING:
+            // STRINGs are passed as memory addresses (char *)
+            message->stringValue = (char *)(uintptr_t)(value);
+            break;
+        case OUTPUT_TYPE_ARRAY:
+            // ARRAYs are passed as memory addresses
+            message->pointerValue = value;
+            break;
+        case OUTPUT_TYPE_FLOAT:
+            // Reinterpret the bits of the packed value
+            bits = (uint32_t)value;
+            memcpy(&(message->floatValue), &bits, sizeof(bits));
+            break;
+        case OUTPUT_TYPE_INT_BLOCK:
+            // Sample blocks are passed as memory addresses, with the
+            // latest sample as value for nodes reading single values
+            message->pointerValue = value;
+            message->intValue = ((const uint32_t *)(uintptr_t)(value))[data_available - 1];
+            break;
+        case OUTPUT_TYPE_FLOAT_BLOCK:
+            message->pointerValue = value;
+            memcpy(&(message->floatValue), &(((const uint32_t *)(uintptr_t)(value))[data_available - 1]), sizeof(bits));
+            break;
+    }
+}
+
+/**
+ *  \brief Fills all fields of a message but inputNumber from a value
+ *  read with readOutput(), for INT64 and DOUBLE outputs. The value is
+ *  also narrowed into intValue or floatValue, for nodes reading 32-bit
+ *  values.
+ *  
+ *  \param [in] type OUTPUT_TYPE_INT64 or OUTPUT_TYPE_DOUBLE
+ *  \param [in] value Value returned by readOutput64()
+ *  \param [in] data_available Value returned by outputAvailable()
+ *  \param [out] message Message to fill
+ */
+static inline void nBlocks_FillMessage64(uint32_t type, uint64_t value, uint32_t data_available, nBlocks_Message * message) {
+    message->dataType = (nBlocks_OutputType)type;
+    message->dataLength = data_available;
+    message->pointerValue = 0;
+    message->stringValue = (char *)("");
+    if (type == OUTPUT_TYPE_DOUBLE) {
+        memcpy(&(message->doubleValue), &value, sizeof(value));
+        message->intValue = 0;
+        message->floatValue = (float)(message->doubleValue);
+    }
+    else {
+        message->int64Value = (int64_t)value;
+        message->intValue = (uint32_t)value;
+        message->floatValue = 0.0;
+    }
+}
+
 /**
  *  Structure data for a value which corresponds to a numeric ID
  *  Can be used to map a value to a specific index in an array
@@ -132,6 +347,9 @@ typedef struct nBlocks_Message {
 /**
  *  \brief Configures the n-Blocks Studio kernel and sets the Ticker.
  *  This function must be called in the main() function,  before entering the main loop.
+ *  
+ *  This and the Kernel*() functions below act on the current workbench
+ *  (see nWorkbench).
  */
 void SetupWorkbench(void);
 
@@ -146,9 +364,25 @@ void SetupWorkbench(void);
  *  \return Number if frames processed during this call. Ideally 0 most of times, 1 every 1ms.
  *  If this function returns more than 1, means it is being called less often than it should
  *  as it had to process more than one frame to catch up.
+ *  How many missed frames are processed is set by KernelOverrunPolicy().
  */
 uint32_t ProgressNodes(void);
 
+/**
+ *  \brief Sleeps until at least one kernel tick is pending, then
+ *  performs the pending frames as ProgressNodes() does. Intended as the
+ *  whole main loop body when the firmware has nothing else to poll:
+ *  
+ *      while (1) WaitAndProgressNodes();
+ *  
+ *  The CPU sleeps (WFI) between frames on target, and the calling
+ *  thread blocks on a condition variable on the host. The tick interrupt
+ *  wakes it immediately, so frames start with minimal jitter.
+ *  
+ *  \return Number of frames processed during this call (see ProgressNodes() )
+ */
+uint32_t WaitAndProgressNodes(void);
+
 /**
  *  \brief Modifies the internal tick period for the kernel, relevant
  *  only if the tick source is an internal timer. Nodes can call this
@@ -156,9 +390,45 @@ uint32_t ProgressNodes(void);
  *  this method,  the last call will be effective.
  *  
  *  \param [in] new_period Period in seconds (as float)
+ *  
+ *  With KernelBlockSize() the period is the sample period, and frames
+ *  run every new_period * block size seconds. Periods making frames
+ *  shorter than 100 us are ignored.
  */
 void KernelPeriod(float new_period);
 
+/**
+ *  \brief Selects block mode: each frame covers the given number of
+ *  samples, and the kernel ticks once every block (KernelPeriod() times
+ *  samples). Must be called before SetupWorkbench(), either before or
+ *  after KernelPeriod(). Defaults to 1 (one sample per frame).
+ *  
+ *  \details In block mode, INT and FLOAT outputs of nBlockSimpleNode
+ *  nodes carry one sample per sample period of the frame, as
+ *  OUTPUT_TYPE_INT_BLOCK / OUTPUT_TYPE_FLOAT_BLOCK messages: pointerValue
+ *  addresses the 32 bit samples (ints, or floats as packed by
+ *  PackFloat() ), dataLength is their number and intValue / floatValue
+ *  is the latest one. The samples are followed by (dataLength + 31) / 32
+ *  words with one bit per sample (NBLOCKS_SAMPLE_BIT), set where the
+ *  output produced data; other samples repeat the previous value.
+ *  Nodes written for single values run sample by sample within the
+ *  frame (see nBlockSimpleNode), so graphs need no change; nodes
+ *  declaring handlesBlocks() process whole blocks, as nBlockVectorNode
+ *  does with FLOAT blocks.
+ *  
+ *  \param [in] samples Samples per frame (0 is taken as 1)
+ */
+void KernelBlockSize(uint32_t samples);
+
+/**
+ *  \brief Returns the index of the first sample of the frame being
+ *  processed (of the last frame, between frames), counted from the
+ *  first tick. Frames dropped by the overrun policy are counted, so
+ *  index * KernelPeriod() stays the sample time. Sample s of a block
+ *  has index KernelSampleIndex() + s.
+ */
+uint64_t KernelSampleIndex(void);
+
 /**
  *  \brief Modifies the kernel tick source. If source is KERNEL_TICK_EXT
  *  the source_pin argument is used as physical interrupt pin, otherwise
@@ -170,6 +440,155 @@ void KernelPeriod(float new_period);
  */
 void KernelTickSource(nBlocks_KernelSources source_flag, PinName source_pin);
 
+/**
+ *  \brief Selects how nodes and connections are scheduled within a frame.
+ *  Must be called before SetupWorkbench(), which computes the node order.
+ *  Defaults to KERNEL_SCHEDULE_STAGED.
+ *  
+ *  \param [in] mode One of nBlocks_ScheduleModes constant values
+ */
+void KernelScheduleMode(nBlocks_ScheduleModes mode);
+
+/**
+ *  \brief Selects how ProgressNodes() catches up after a stall, which
+ *  bounds the time spent inside one call under load.
+ *  
+ *  \param [in] policy One of nBlocks_OverrunPolicies constant values
+ *  \param [in] max_burst Maximum number of frames per call, used with
+ *  KERNEL_OVERRUN_REPLAY_BOUNDED only (minimum 1)
+ */
+void KernelOverrunPolicy(nBlocks_OverrunPolicies policy, uint32_t max_burst = 1);
+
+/**
+ *  \brief Retrieves the frame accounting counters
+ *  
+ *  \return Copy of the counters
+ */
+nBlocks_KernelStats KernelGetStats(void);
+
+/**
+ *  \brief Clears the frame accounting counters
+ */
+void KernelResetStats(void);
+
+/**
+ *  \brief Nodes and connections constructed between these two calls are
+ *  not registered in the kernel lists, so SetupWorkbench() and
+ *  ProgressNodes() ignore them, and connections to or from such nodes
+ *  are ignored. Used by nBlockStaticGraph (ngraph.h), which runs its
+ *  own nodes. Calls nest.
+ */
+void KernelSuspendRegistration(void);
+void KernelResumeRegistration(void);
+
+/**
+ *  \brief Function processing one frame of a graph, see KernelAttachGraph()
+ */
+typedef void (*nBlocks_FrameFunction)(void * context);
+
+/**
+ *  \brief Function receiving the kernel data in SetupWorkbench()
+ */
+typedef void (*nBlocks_SetupFunction)(void * context, nBlocks_KernelData kernel_data);
+
+/**
+ *  \brief Makes ProgressNodes() process frames by calling frame(context)
+ *  instead of the registered nodes and connections, keeping the tick
+ *  source, overrun policy, statistics, frame pulse and frame arena.
+ *  SetupWorkbench() calls setup(context, kernel data). Used by
+ *  nBlockStaticGraph::attach(). Call before SetupWorkbench().
+ *  
+ *  \param [in] frame Frame function, 0 to detach
+ *  \param [in] setup Setup function, may be 0
+ *  \param [in] context Passed to both functions
+ */
+void KernelAttachGraph(nBlocks_FrameFunction frame, nBlocks_SetupFunction setup, void * context);
+
+/**
+ *  \brief Allocates memory valid until the end of the next frame, for
+ *  STRING and ARRAY outputs. Memory is handed out from one half of a
+ *  kernel owned arena, and each frame starts by switching halves and
+ *  discarding the contents of the half it switches to, so there is no
+ *  free() and no per-node worst case buffer.
+ *  
+ *  A node allocates its payload in step(), writes it, and sets it as
+ *  output for that frame only:
+ *  
+ *      char * text = (char *)KernelFrameAlloc(len + 1);
+ *      if (text) {
+ *          memcpy(text, source, len + 1);
+ *          output[0] = (nBlocks_Handle)text;
+ *          available[0] = len;
+ *      }
+ *  
+ *  Receivers get the payload in triggerInput() during the following
+ *  frame (or the same one with KERNEL_SCHEDULE_TOPOLOGICAL) and may use
+ *  it until the end of the frame in which they received it. Only data
+ *  kept longer has to be copied, e.g. by nodes running at a reduced
+ *  rate (setRate() ) which may not step in that frame.
+ *  
+ *  With KERNEL_SCHEDULE_TOPOLOGICAL a receiver may also forward the
+ *  payload unchanged as its own output, since downstream nodes receive
+ *  it within the same frame. With KERNEL_SCHEDULE_STAGED every hop
+ *  takes one more frame, so forwarding nodes copy the payload into a
+ *  new KernelFrameAlloc() block.
+ *  
+ *  Call only from step() or triggerInput(), not from interrupts.
+ *  
+ *  \param [in] size Number of bytes
+ *  \return Address aligned to NBLOCKS_FRAME_ARENA_ALIGN, or 0 if the
+ *  current half of the arena is exhausted (counted in arenaFailures)
+ */
+void * KernelFrameAlloc(uint32_t size);
+
+#ifdef TARGET_HOST
+/**
+ *  \brief Runs staged frames on several threads (host only). Must be
+ *  called before SetupWorkbench(). Both stages of each frame are split
+ *  into chunks run by a fixed worker pool, and each stage waits for all
+ *  of them before the next one starts, so results are identical to a
+ *  serial run:
+ *    - step: due nodes are stepped in parallel; step() may only touch
+ *      the node's own state
+ *    - propagate: connections are partitioned by destination node, so
+ *      each node receives its messages from a single thread, in the
+ *      same order as in a serial frame; outputAvailable() and
+ *      readOutput() may be called concurrently and must not modify
+ *      the node
+ *  Topological frames interleave steps and propagation and always run
+ *  on the calling thread.
+ *  
+ *  \param [in] num_threads Number of threads including the caller
+ *  of ProgressNodes(); 1 (default) disables the pool
+ */
+void KernelParallelStages(uint32_t num_threads);
+
+/**
+ *  \brief Result of KernelSimulate()
+ */
+typedef struct nBlocks_SimulationStats {
+    uint64_t frames;            /**< Frames processed */
+    uint64_t virtualNs;         /**< Virtual time simulated */
+    uint64_t wallNs;            /**< Wall-clock time taken */
+    float framesPerSecond;      /**< Frames per wall-clock second */
+} nBlocks_SimulationStats;
+
+/**
+ *  \brief Runs the graph in virtual time (host only), as fast as the CPU
+ *  allows: the frame ticker and the stimuli scheduled with
+ *  HostSimSetPin(), HostSimPulses() and HostSimCall() fire at their
+ *  virtual timestamps, and ProgressNodes() runs after each of them.
+ *  HostSimEnable() must be called before SetupWorkbench(). With virtual
+ *  time, WaitAndProgressNodes() also advances the clock to the next
+ *  tick, so an unmodified main loop runs accelerated as well.
+ *  
+ *  \param [in] seconds Virtual time to simulate
+ *  \return Frames processed and the wall-clock time taken, all zero if
+ *  virtual time is not enabled
+ */
+nBlocks_SimulationStats KernelSimulate(float seconds);
+#endif
+
 /**
  *  \brief Enables a pulse in a physical pin indicating frame duration.
  *  
@@ -187,6 +606,300 @@ void KernelEnableFramePulse(PinName pin);
  */
 uint32_t PackFloat(float value);
 
+/**
+ *  \brief Packs a double as the value of a DOUBLE output, to be returned
+ *  by readOutput64()
+ */
+uint64_t PackDouble(double value);
+
+
+class nBlockNode;
+
+/**
+ *  \brief Reads the source output of a connection into a message (all
+ *  fields but inputNumber), returning the data available (0: no data,
+ *  message not filled)
+ */
+typedef uint32_t (*nBlocks_ReadFunction)(nBlockNode * src, nBlocks_Message * message);
+
+/**
+ *  \brief Delivers count messages to a destination node
+ */
+typedef void (*nBlocks_DeliverFunction)(nBlockNode * dst, const nBlocks_Message * messages, uint32_t count);
+
+class nBlockConnection;
+#ifdef TARGET_HOST
+class nBlockExecutor;
+#endif
+
+/**
+ *  nWorkbench holds one graph: its nodes and connections, the tables
+ *  compiled from them, its tick source, frame loop state and stats.
+ *  
+ *  Nodes and connections register into the current workbench of the
+ *  calling thread when constructed. It is the default workbench unless
+ *  another one was made current with select(), so code written for a
+ *  single graph keeps working unchanged, and the Kernel*() functions,
+ *  SetupWorkbench() and ProgressNodes() act on the current workbench.
+ *  
+ *  Each workbench has its own Ticker (or tick pin) and frame arena, so
+ *  graphs with different periods can run side by side: on a MCU, by
+ *  calling progressNodes() of each one from the main loop; on the host,
+ *  also one per thread, since the current workbench is per thread.
+ *  Frames of one workbench must not run on two threads at once.
+ *  
+ *      nWorkbench slow;
+ *      nWorkbench * previous = slow.select();
+ *      // nodes and connections created here belong to slow
+ *      KernelPeriod(0.1);
+ *      SetupWorkbench();
+ *      previous->select();
+ *      ...
+ *      while (1) { ProgressNodes(); slow.progressNodes(); }
+ *  
+ *  A connection only joins nodes of the current workbench: one between
+ *  nodes of two workbenches is ignored. Graphs of different workbenches
+ *  exchange messages through an nBlockPeerLink (see nlink.h).
+ *  
+ *  With NBLOCKS_PROFILE or NBLOCKS_TRACE, only the default workbench is
+ *  profiled and traced.
+ */
+class nWorkbench {
+public:
+    nWorkbench(void);
+    ~nWorkbench(void);
+    
+    /**
+     *  \brief Returns the current workbench of the calling thread
+     */
+    static nWorkbench * current(void);
+    
+    /**
+     *  \brief Returns the default workbench, used by code which never
+     *  selects another one
+     */
+    static nWorkbench * defaultInstance(void);
+    
+    /**
+     *  \brief Makes this workbench the current one of the calling thread
+     *  
+     *  \return The workbench which was current
+     */
+    nWorkbench * select(void);
+    
+    /** \brief Same as SetupWorkbench(), for this workbench */
+    void setup(void);
+    /** \brief Same as ProgressNodes(), for this workbench */
+    uint32_t progressNodes(void);
+    /** \brief Same as WaitAndProgressNodes(), for this workbench */
+    uint32_t waitAndProgressNodes(void);
+    /** \brief Adds a tick (called by the tick source) */
+    void tick(void);
+    
+    /** \brief Same as KernelPeriod(), for this workbench */
+    void period(float new_period);
+    /** \brief Same as KernelBlockSize(), for this workbench */
+    void blockSize(uint32_t samples);
+    /** \brief Same as KernelSampleIndex(), for this workbench */
+    uint64_t sampleIndex(void);
+    /** \brief Same as KernelTickSource(), for this workbench */
+    void tickSource(nBlocks_KernelSources source_flag, PinName source_pin);
+    /** \brief Same as KernelScheduleMode(), for this workbench */
+    void scheduleMode(nBlocks_ScheduleModes mode);
+    /** \brief Same as KernelOverrunPolicy(), for this workbench */
+    void overrunPolicy(nBlocks_OverrunPolicies policy, uint32_t max_burst);
+    /** \brief Same as KernelGetStats(), for this workbench */
+    nBlocks_KernelStats getStats(void);
+    /** \brief Same as KernelResetStats(), for this workbench */
+    void resetStats(void);
+    /** \brief Same as KernelSuspendRegistration(), for this workbench */
+    void suspendRegistration(void);
+    /** \brief Same as KernelResumeRegistration(), for this workbench */
+    void resumeRegistration(void);
+    /** \brief Same as KernelAttachGraph(), for this workbench */
+    void attachGraph(nBlocks_FrameFunction frame, nBlocks_SetupFunction setup, void * context);
+    /** \brief Same as KernelFrameAlloc(), for this workbench */
+    void * frameAlloc(uint32_t size);
+    /** \brief Same as KernelEnableFramePulse(), for this workbench */
+    void enableFramePulse(PinName pin);
+#ifdef TARGET_HOST
+    /** \brief Same as KernelParallelStages(), for this workbench */
+    void parallelStages(uint32_t num_threads);
+    /** \brief Same as KernelSimulate(), for this workbench */
+    nBlocks_SimulationStats simulate(float seconds);
+#endif
+    
+    /**
+     *  \brief Registers a node (called by the nBlockNode constructor)
+     *  
+     *  \return 1 if registered, 0 while registration is suspended
+     */
+    uint32_t addNode(nBlockNode * node);
+    /** \brief Registers a connection (called by the nBlockConnection constructor) */
+    void addConnection(nBlockConnection * connection);
+    /** \brief Makes frames use the lists until the next setup */
+    void invalidate(void) { this->_compiled = 0; }
+    
+private:
+    static void propagateRangeEntry(void * context, uint32_t begin, uint32_t end);
+    static void stepRangeEntry(void * context, uint32_t begin, uint32_t end);
+    friend void TraceRunFrame(uint32_t frame);
+    
+    inline uint32_t ticksPending(void);
+    inline void ticksTake(uint32_t count);
+    void waitForTick(void);
+    inline void arenaNextFrame(void);
+    void computeRates(void);
+    void compileIncoming(void);
+    void computeOrder(void);
+    void setupTrace(void);
+    void releaseTables(void);
+    void compileTables(void);
+    inline void propagateNode(uint32_t n);
+    inline void deliverNode(uint32_t n);
+    void deliverDirty(void);
+    uint32_t connectionGroup(uint32_t c);
+    void replayDeliver(const struct nBlocks_TraceRecord * record);
+    void runReplayTopologicalFrame(void);
+    void runListFrame(void);
+    inline void advanceRate(uint32_t r, uint32_t k);
+    void propagateRange(uint32_t begin, uint32_t end);
+    void propagateParallel(void);
+    void stepRange(uint32_t begin, uint32_t end);
+    void stepParallel(void);
+    void runStagedFrame(void);
+    void runTopologicalFrame(void);
+    inline void runFrame(void);
+    
+    // Tick source and frame pulse
+    Ticker * _ticker;
+    InterruptIn * _tick_pin;
+    DigitalOut * _frame_pulse;
+    
+    // Registered nodes and connections
+    nBlockNode * _first_node;
+    nBlockNode * _last_node;
+    nBlockConnection * _first_connection;
+    nBlockConnection * _last_connection;
+    uint32_t _propagating;
+    // Nonzero while nodes and connections are not registered
+    uint32_t _registration_suspended;
+    // Nonzero for the workbench seen by the profiler and the tracer
+    uint32_t _instrumented;
+    
+    // Graph processing the frames instead of the lists, see KernelAttachGraph()
+    nBlocks_FrameFunction _graph_frame;
+    nBlocks_SetupFunction _graph_setup;
+    void * _graph_context;
+    
+    // Tables compiled by setup() from the node and connection lists.
+    // Nodes are stored in traversing order. Connections are stored as a
+    // structure of arrays grouped by source output: group g reads output
+    // _group_output[g] of _group_src[g] and delivers to connections
+    // _group_first[g] to _group_first[g+1]-1.
+    // _compiled is cleared whenever a node or connection is created, and
+    // the frame loop falls back to the linked lists until the next setup.
+    uint32_t _compiled;
+    uint32_t _num_nodes;
+    nBlockNode ** _nodes;
+    uint32_t _num_groups;
+    nBlockNode ** _group_src;
+    uint32_t * _group_output;
+    uint32_t * _group_first;
+    // Read function of each group (typed connections), 0 for virtual calls
+    nBlocks_ReadFunction * _group_read;
+    uint32_t _num_connections;
+    nBlockNode ** _conn_dst;
+    uint32_t * _conn_input;
+    // Groups are sorted by source node, so the groups of node n are
+    // _node_first_group[n] to _node_first_group[n+1]-1
+    uint32_t * _node_first_group;
+    
+    // Nodes (table indices) which published dirty outputs during the last
+    // step stage and have connections: the only ones visited by propagation
+    uint32_t _num_dirty;
+    uint32_t * _dirty;
+    
+    // Messages gathered by destination node during propagation: node i
+    // receives _in_count[i] messages stored from _in_messages[_in_first[i]]
+    // on, room for one per incoming connection. _conn_dst_index[c] is the
+    // node index of _conn_dst[c].
+    uint32_t * _conn_dst_index;
+    // Deliver function of each node (typed connections), 0 for virtual calls
+    nBlocks_DeliverFunction * _node_deliver;
+    uint32_t * _in_first;
+    uint32_t * _in_count;
+    nBlocks_Message * _in_messages;
+    // Messages gathered and not yet delivered
+    uint32_t _num_gathered;
+    
+    // Rate groups: nodes sharing a step divisor. Group r holds the node
+    // indices _rate_nodes[_rate_first[r]] to [_rate_first[r+1]-1], sorted
+    // by phase (_rate_node_phase). Each frame, the nodes whose phase equals
+    // the group phase counter are stepped, starting at the group cursor, so
+    // no modulo is computed in the frame loop.
+    uint32_t _num_rates;
+    uint32_t * _rate_divisor;
+    uint32_t * _rate_first;
+    uint32_t * _rate_phase;
+    uint32_t * _rate_cursor;
+    uint32_t * _rate_nodes;
+    uint32_t * _rate_node_phase;
+    
+    // Frame counter, and the frame in which each node was last due
+    uint32_t _frame_count;
+    uint32_t * _node_due;
+    
+#ifdef TARGET_HOST
+    // Worker pool for staged frames, and the nodes due in the current frame
+    uint32_t _stage_threads;
+    nBlockExecutor * _executor;
+    uint32_t * _due_list;
+    // Connections by destination node index, for the parallel propagate
+    // stage: source node index, output and input of connections
+    // _in_first[i] to _in_first[i+1]-1, and the nodes having any
+    uint32_t * _in_src;
+    nBlocks_ReadFunction * _in_read;
+    uint32_t * _in_output;
+    uint32_t * _in_input;
+    uint32_t _num_in_nodes;
+    uint32_t * _in_nodes;
+    // Nonzero for nodes in the dirty list while propagating
+    uint8_t * _src_pending;
+#endif
+    
+    // Node indices in topological order, for KERNEL_SCHEDULE_TOPOLOGICAL
+    uint32_t _schedule_mode;
+    uint32_t * _order;
+    
+    // Pending ticks: incremented by the tick source, decremented by
+    // progressNodes(). Only modified through tick()/ticksTake().
+    volatile uint32_t _ticker_elapsed;
+#ifdef TARGET_HOST
+    // Wakes waitAndProgressNodes() when a tick arrives
+    pthread_mutex_t _tick_lock;
+    pthread_cond_t _tick_cond;
+#endif
+    // Ticks taken by the frame loop (processed or dropped), for sampleIndex()
+    uint64_t _ticks_taken;
+    
+    // Overrun policy and frame accounting
+    uint32_t _overrun_policy;
+    uint32_t _max_burst;
+    nBlocks_KernelStats _stats;
+    
+    nBlocks_KernelData _kernel_data;
+    // Last period passed to period(), even if ignored
+    float _requested_period;
+    
+    // Frame arena: the half in use and the bytes taken from it this frame
+    uint32_t _arena_half;
+    volatile uint32_t _arena_used;
+    volatile uint32_t _arena_failures;
+#if NBLOCKS_FRAME_ARENA_SIZE > 0
+    uint8_t _frame_arena[2][NBLOCKS_FRAME_ARENA_SIZE] __attribute__((aligned(NBLOCKS_FRAME_ARENA_ALIGN)));
+#endif
+};
 
 /**
  *  nBlocksNode is the base class for all nodes in n-BlocksStudio.
@@ -206,13 +919,35 @@ public:
     void setNext(nBlockNode * next);
     
     /**
-     *  \brief Retireves the address of the next node in the traversing
-     *  chain (set via setNext() ).
+     *  \brief Retireves the next node in the traversing chain (set via
+     *  setNext() ).
      *  
-     *  \return 32-bit memory address of the next node. Has to be
-     *  externally cast as pointer
+     *  \return The next node, 0 for the last one
+     */
+    nBlockNode * getNext(void);
+    
+    /**
+     *  \brief Sets the position of this node in the kernel node table.
+     *  Called by SetupWorkbench() only.
+     *  
+     *  \param [in] index Position of the node in the traversing chain
+     */
+    void setIndex(uint32_t index);
+    
+    /**
+     *  \brief Retrieves the position of this node in the kernel node
+     *  table (set via setIndex() ).
+     *  
+     *  \return Position of the node in the traversing chain
+     */
+    uint32_t getIndex(void);
+    
+    /**
+     *  \brief Retrieves the workbench this node was registered into
+     *  (the current one when it was constructed), or 0 if it was
+     *  constructed while registration was suspended
      */
-    uint32_t getNext(void);
+    nWorkbench * getWorkbench(void) { return _workbench; }
     
     /**
      *  \brief Sets the kernel data received from broadcast prior to
@@ -220,7 +955,7 @@ public:
      *  
      *  \param [in] kernel_data Struct containing data for the kernel
      */
-    void setKernelData(nBlocks_KernelData kernel_data);
+    virtual void setKernelData(nBlocks_KernelData kernel_data);
     
     /**
      *  \brief Returns the number of data packets available to be read
@@ -251,9 +986,19 @@ public:
      *  in descending classes.
      *  
      *  \param [in] outputNumber The output number to retrieve data from
-     *  \return The data as 32 bit unsigned integer
+     *  \return The value, or the address of the payload
      */
-    virtual uint32_t readOutput(uint32_t outputNumber);
+    virtual nBlocks_Handle readOutput(uint32_t outputNumber);
+    
+    /**
+     *  \brief Returns data from an INT64 or DOUBLE output (packed with
+     *  PackDouble() ). Called instead of readOutput() for those types.
+     *  The default returns readOutput().
+     *  
+     *  \param [in] outputNumber The output number to retrieve data from
+     *  \return The data as 64 bit unsigned integer
+     */
+    virtual uint64_t readOutput64(uint32_t outputNumber);
  
     /**
      *  \brief Receives a value from a connection. Called externally
@@ -266,6 +1011,20 @@ public:
      */
     virtual void triggerInput(nBlocks_Message message);
     
+    /**
+     *  \brief Receives all messages for this node from one propagation
+     *  in a single call, ordered as the connections deliver them. The
+     *  default implementation calls triggerInput() for each message.
+     *  Nodes with many inputs (mixers, multiplexers) can override it
+     *  to handle them at once.
+     *  
+     *  \param [in] messages Messages, valid during this call only
+     *  (payloads they point to follow their own rules, see
+     *  KernelFrameAlloc() )
+     *  \param [in] count Number of messages, at least 1
+     */
+    virtual void triggerInputs(const nBlocks_Message * messages, uint32_t count);
+    
     /**
      *  \brief Discards any data respective to previous frame and 
      *  prepares data to be available at the next frame. Also performs
@@ -275,10 +1034,62 @@ public:
      *  other nodes or parts of the kernel is allowed in this method.
      */
     virtual void step(void);
+    
+    /**
+     *  \brief Returns the mask of outputs which had data available
+     *  after the last step() (see NBLOCKS_OUTPUT_BIT). Used by the
+     *  kernel to only propagate connections from outputs which
+     *  actually produced data.
+     *  
+     *  \return Dirty outputs mask
+     */
+    uint32_t getDirtyOutputs(void) { return _dirtyOutputs; }
+    
+    /**
+     *  \brief Makes this node be stepped only every divisor-th frame,
+     *  at frames where (frame number % divisor) == phase. Slow nodes
+     *  (displays, sensors) should use this instead of slowing down the
+     *  whole graph with KernelPeriod(). Must be called before
+     *  SetupWorkbench(), typically in the node constructor.
+     *  
+     *  Outputs of a node are delivered once, in the frame after the
+     *  node was stepped, and inputs received meanwhile are kept by the
+     *  node until its next step.
+     *  
+     *  \param [in] divisor Number of frames between two steps (1 = every frame)
+     *  \param [in] phase Frame offset in 0..divisor-1, or NBLOCKS_AUTO_PHASE
+     *  to let the kernel spread nodes of the same rate across frames
+     */
+    void setRate(uint32_t divisor, uint32_t phase = NBLOCKS_AUTO_PHASE);
+    
+    /** \brief Returns the divisor set via setRate() (1 by default) */
+    uint32_t getRateDivisor(void) { return _rateDivisor; }
+    
+    /** \brief Returns the phase set via setRate() */
+    uint32_t getRatePhase(void) { return _ratePhase; }
+
+protected:
+    /**
+     *  \brief Publishes the mask of outputs having data available, to
+     *  be called at the end of step(). Nodes which never call this keep
+     *  NBLOCKS_ALL_OUTPUTS and have all their outputs checked every frame.
+     *  
+     *  \param [in] mask Dirty outputs mask (see NBLOCKS_OUTPUT_BIT)
+     */
+    void setDirtyOutputs(uint32_t mask) { _dirtyOutputs = mask; }
 
 private:
+    // Mask of outputs with data available since the last step
+    uint32_t _dirtyOutputs;
+    // Step every _rateDivisor frames, at frames matching _ratePhase
+    uint32_t _rateDivisor;
+    uint32_t _ratePhase;
     // Pointer to next node in the traversing chain
     nBlockNode * _next;
+    // Position in the kernel node table
+    uint32_t _index;
+    // Workbench holding the node
+    nWorkbench * _workbench;
     
 };
 
@@ -311,6 +1122,18 @@ template <size_t simpleNode_OutputSize>
  *    - The step() method invokes endFrame(), and then copies the contents
  *      from output[] to _exposed_output[], when the user is no longer
  *      able to modify it and connections are not active
+ *    - The step() method also publishes which outputs have data
+ *      available, so the kernel skips connections from idle outputs
+ *  
+ *  In block mode (KernelBlockSize() ) the node runs sample by sample,
+ *  unless it declares handlesBlocks(): messages received in the frame
+ *  are kept, and step() calls endFrame() once per sample, delivering
+ *  the samples of each block input marked available just before their
+ *  call (other messages before the first call). INT and FLOAT outputs
+ *  are published as blocks of the value of output[] after each call,
+ *  marking the calls which set available[]; STRING and ARRAY outputs
+ *  publish their latest value. Nodes overriding triggerInputs()
+ *  receive blocks as is.
  *  
  *  Implementation code has to be in this file (instead of nworkbench.cpp)
  *  due to use of the template feature.
@@ -333,6 +1156,20 @@ public:
             // Buffers not modified after instantiation
             outputType[i] = OUTPUT_TYPE_INT; // Output type defaults to integer
         }
+        // Block mode buffers are allocated with the kernel data
+        _blockSamples = 1;
+        _blockStride = 0;
+        _sampleOffset = 0;
+        _blockBank = 0;
+        _blockBuffer = 0;
+        _pending = 0;
+        _pendingFrame = 0;
+        _pendingCopy = 0;
+        _numPending = 0;
+        _maxPending = 0;
+        _copies = 0;
+        _copiesUsed = 0;
+        _copiesSize = 0;
     }
     
     /**
@@ -354,9 +1191,93 @@ public:
      */
     void setKernelData(nBlocks_KernelData kernel_data) {
         kernelData = kernel_data;
+        if ((kernel_data.blockSize > 1) && (handlesBlocks() == 0) && (_blockBuffer == 0)) {
+            _blockSamples = kernel_data.blockSize;
+            _blockStride = _blockSamples + NBLOCKS_SAMPLE_WORD(_blockSamples + 31);
+            _blockBuffer = new uint32_t [2 * simpleNode_OutputSize * _blockStride];
+            memset(_blockBuffer, 0, 2 * simpleNode_OutputSize * _blockStride * sizeof(uint32_t));
+        }
         onKernelData();
     }
     
+    /**
+     *  \brief Returns non-zero if the node processes sample blocks itself
+     *  in block mode (see KernelBlockSize() ), instead of running sample
+     *  by sample. Nodes handling OUTPUT_TYPE_INT_BLOCK /
+     *  OUTPUT_TYPE_FLOAT_BLOCK messages override it to return 1.
+     */
+    virtual uint32_t handlesBlocks(void) { return 0; }
+    
+    /**
+     *  \brief Returns the index of the sample being processed: in block
+     *  mode, the sample of the current endFrame() call, otherwise the
+     *  frame (see KernelSampleIndex() )
+     */
+    uint64_t sampleIndex(void) { return KernelSampleIndex() + _sampleOffset; }
+    
+    /**
+     *  \brief Returns the number of samples processed per frame by this
+     *  node, 1 unless running sample by sample in block mode
+     */
+    uint32_t blockSamples(void) { return _blockSamples; }
+    
+    /**
+     *  \brief Receives the messages of a frame. In block mode they are
+     *  kept until step(), otherwise passed to triggerInput().
+     */
+    void triggerInputs(const nBlocks_Message * messages, uint32_t count) {
+        uint32_t i;
+        if (_blockSamples > 1) storeInputs(messages, count);
+        else for (i=0; i<count; i++) this->triggerInput(messages[i]);
+    }
+    
+    /**
+     *  \brief Keeps messages for the per sample loop of step(), with the
+     *  frame they arrived in. Nodes stepped every few frames (setRate() )
+     *  copy block payloads, as sources overwrite them meanwhile. Used by
+     *  triggerInputs() and by typed connections.
+     */
+    void storeInputs(const nBlocks_Message * messages, uint32_t count) {
+        uint32_t i, n, words;
+        nBlocks_Message * grown;
+        uint64_t * grown_frame;
+        uint32_t * grown_copy;
+        if ((_numPending + count) > _maxPending) {
+            // Grows once to the largest number of messages between steps
+            _maxPending = _numPending + count;
+            grown = new nBlocks_Message [_maxPending];
+            grown_frame = new uint64_t [_maxPending];
+            grown_copy = new uint32_t [_maxPending];
+            for (i=0; i<_numPending; i++) {
+                grown[i] = _pending[i];
+                grown_frame[i] = _pendingFrame[i];
+                grown_copy[i] = _pendingCopy[i];
+            }
+            delete[] _pending;
+            delete[] _pendingFrame;
+            delete[] _pendingCopy;
+            _pending = grown;
+            _pendingFrame = grown_frame;
+            _pendingCopy = grown_copy;
+        }
+        for (i=0; i<count; i++) {
+            n = _numPending++;
+            _pending[n] = messages[i];
+            // Nodes stepped every frame hold the messages of one frame only
+            if (getRateDivisor() == 1) continue;
+            _pendingFrame[n] = KernelSampleIndex();
+            _pendingCopy[n] = NBLOCKS_NO_COPY;
+            if ((messages[i].dataType == OUTPUT_TYPE_INT_BLOCK) || (messages[i].dataType == OUTPUT_TYPE_FLOAT_BLOCK)) {
+                // Samples and mask
+                words = messages[i].dataLength + NBLOCKS_SAMPLE_WORD(messages[i].dataLength + 31);
+                growCopies(_copiesUsed + words);
+                memcpy(&(_copies[_copiesUsed]), (const uint32_t *)(uintptr_t)(messages[i].pointerValue), words * sizeof(uint32_t));
+                _pendingCopy[n] = _copiesUsed;
+                _copiesUsed += words;
+            }
+        }
+    }
+    
     
     /**
      *  \brief Called to check if there is data available at one particular
@@ -380,7 +1301,13 @@ public:
      *  \param [in] outputNumber The output number to check for data type
      *  \return One of the constants in the nBlocks_OutputType enum
      */
-    nBlocks_OutputType readOutputType(uint32_t outputNumber) { return outputType[outputNumber]; }
+    nBlocks_OutputType readOutputType(uint32_t outputNumber) {
+        if (_blockSamples > 1) {
+            if (outputType[outputNumber] == OUTPUT_TYPE_INT) return OUTPUT_TYPE_INT_BLOCK;
+            if (outputType[outputNumber] == OUTPUT_TYPE_FLOAT) return OUTPUT_TYPE_FLOAT_BLOCK;
+        }
+        return outputType[outputNumber];
+    }
     
     /**
      *  \brief Returns data stored at the output buffer exposed to
@@ -390,9 +1317,9 @@ public:
      *  This method should not be modified except in very specific cases.
      *  
      *  \param [in] outputNumber The output number to retrieve data from
-     *  \return The data as 32 bit unsigned integer
+     *  \return The value, or the address of the payload
      */
-    uint32_t readOutput(uint32_t outputNumber) { return _exposed_output[outputNumber]; }
+    nBlocks_Handle readOutput(uint32_t outputNumber) { return _exposed_output[outputNumber]; }
     
     /**
      *  \brief The user (node developer) *must* implement the endFrame()
@@ -420,19 +1347,27 @@ public:
      */
     void step(void) {
         unsigned int i;
+        uint32_t dirty = 0;
+        if (_blockSamples > 1) {
+            stepSamples();
+            return;
+        }
         endFrame();
         for (i=0; i<simpleNode_OutputSize; i++) {
             _exposed_output[i] = output[i];
             _exposed_available[i] = available[i];
+            if (available[i]) dirty |= NBLOCKS_OUTPUT_BIT(i);
             available[i] = 0;
         }
+        setDirtyOutputs(dirty);
         return;
     }
         
     /**
      *  \brief Buffer holding output data, to be modified by user.
+     *  Values, or payload addresses cast to nBlocks_Handle.
      */
-    uint32_t output[simpleNode_OutputSize];
+    nBlocks_Handle output[simpleNode_OutputSize];
     
     /**
      *  \brief Buffer holding output types. Should be written 
@@ -456,7 +1391,7 @@ private:
      *  hidden from user. Do not modify the contents of this buffer in 
      *  node code.
      */
-    uint32_t _exposed_output[simpleNode_OutputSize];
+    nBlocks_Handle _exposed_output[simpleNode_OutputSize];
     
     /**
      *  \brief Buffer holding data availability, exposed to connections and
@@ -464,6 +1399,318 @@ private:
      *  node code.
      */
     uint32_t _exposed_available[simpleNode_OutputSize];
+
+    /**
+     *  \brief Block mode state: samples per frame (1 when not running
+     *  sample by sample), words per block (samples and mask), sample of
+     *  the current endFrame() call, and the two banks of output blocks,
+     *  simpleNode_OutputSize each
+     */
+    uint32_t _blockSamples;
+    uint32_t _blockStride;
+    uint32_t _sampleOffset;
+    uint32_t _blockBank;
+    uint32_t * _blockBuffer;
+
+    /**
+     *  \brief Messages received since the last step, in block mode, with
+     *  the first sample of the frame they arrived in, and the position
+     *  of their payload copy in _copies (NBLOCKS_NO_COPY if not copied)
+     */
+    nBlocks_Message * _pending;
+    uint64_t * _pendingFrame;
+    uint32_t * _pendingCopy;
+    uint32_t _numPending;
+    uint32_t _maxPending;
+
+    /**
+     *  \brief Copies of block payloads kept until the next step
+     */
+    uint32_t * _copies;
+    uint32_t _copiesUsed;
+    uint32_t _copiesSize;
+
+    /**
+     *  \brief Makes room for size words of payload copies, keeping the
+     *  ones stored
+     */
+    void growCopies(uint32_t size) {
+        uint32_t * grown;
+        if (size <= _copiesSize) return;
+        // Grows once to the largest payload between steps
+        grown = new uint32_t [size];
+        if (_copiesUsed > 0) memcpy(grown, _copies, _copiesUsed * sizeof(uint32_t));
+        delete[] _copies;
+        _copies = grown;
+        _copiesSize = size;
+    }
+
+    /**
+     *  \brief Passes sample q of a block message to triggerInput(), and
+     *  other messages at q = 0
+     */
+    void triggerSample(const nBlocks_Message & message, uint32_t q) {
+        const uint32_t * block;
+        nBlocks_Message sample;
+
+        if ((message.dataType == OUTPUT_TYPE_INT_BLOCK) || (message.dataType == OUTPUT_TYPE_FLOAT_BLOCK)) {
+            // Shorter blocks end early, unmarked samples are held values
+            if (q >= message.dataLength) return;
+            block = (const uint32_t *)(uintptr_t)(message.pointerValue);
+            if ((block[message.dataLength + NBLOCKS_SAMPLE_WORD(q)] & NBLOCKS_SAMPLE_BIT(q)) == 0) return;
+            nBlocks_FillMessage((message.dataType == OUTPUT_TYPE_INT_BLOCK) ? OUTPUT_TYPE_INT : OUTPUT_TYPE_FLOAT, block[q], 1, &sample);
+            sample.inputNumber = message.inputNumber;
+            this->triggerInput(sample);
+        }
+        else if (q == 0) this->triggerInput(message);
+    }
+
+    /**
+     *  \brief step() in block mode: runs endFrame() once per sample and
+     *  publishes the outputs as blocks. The messages of each frame since
+     *  the last step form a group of samples, replayed in arrival order:
+     *  a node stepped every d frames receives about d samples per input
+     *  before each endFrame() call, as it receives d messages per step
+     *  with one sample per frame.
+     */
+    void stepSamples(void) {
+        uint32_t s, i, o, g, q;
+        uint32_t dirty = 0;
+        uint32_t samples = _blockSamples;
+        uint32_t * bank = &(_blockBuffer[_blockBank * simpleNode_OutputSize * _blockStride]);
+        uint32_t groups = 0;
+        uint32_t first = 0;
+        uint32_t last = 0;
+
+        for (o=0; o<simpleNode_OutputSize; o++) {
+            _exposed_available[o] = 0;
+            memset(&(bank[(o * _blockStride) + samples]), 0, (_blockStride - samples) * sizeof(uint32_t));
+        }
+        if (getRateDivisor() > 1) for (i=0; i<_numPending; i++) {
+            if ((i == 0) || (_pendingFrame[i] != _pendingFrame[i-1])) groups++;
+            // _copies no longer moves until the next step
+            if (_pendingCopy[i] != NBLOCKS_NO_COPY) _pending[i].pointerValue = (nBlocks_Handle)(uintptr_t)(&(_copies[_pendingCopy[i]]));
+        }
+        // groups * samples received samples, groups before each endFrame()
+        q = samples;
+        for (s=0; s<samples; s++) {
+            _sampleOffset = s;
+            // A single frame's messages, sample s of each block
+            if (getRateDivisor() == 1) {
+                for (i=0; i<_numPending; i++) triggerSample(_pending[i], s);
+            }
+            else for (g=0; g<groups; g++) {
+                if (q == samples) {
+                    // Next frame's messages
+                    first = last;
+                    for (last=first+1; (last < _numPending) && (_pendingFrame[last] == _pendingFrame[first]); last++) { }
+                    q = 0;
+                }
+                for (i=first; i<last; i++) triggerSample(_pending[i], q);
+                q++;
+            }
+            endFrame();
+            for (o=0; o<simpleNode_OutputSize; o++) {
+                if ((outputType[o] == OUTPUT_TYPE_INT) || (outputType[o] == OUTPUT_TYPE_FLOAT)) {
+                    bank[(o * _blockStride) + s] = (uint32_t)output[o];
+                    if (available[o]) {
+                        bank[(o * _blockStride) + samples + NBLOCKS_SAMPLE_WORD(s)] |= NBLOCKS_SAMPLE_BIT(s);
+                        _exposed_available[o] = samples;
+                    }
+                }
+                else if (available[o]) {
+                    _exposed_output[o] = output[o];
+                    _exposed_available[o] = available[o];
+                }
+                available[o] = 0;
+            }
+        }
+        _sampleOffset = 0;
+        _numPending = 0;
+        _copiesUsed = 0;
+
+        for (o=0; o<simpleNode_OutputSize; o++) {
+            if ((outputType[o] == OUTPUT_TYPE_INT) || (outputType[o] == OUTPUT_TYPE_FLOAT)) {
+                _exposed_output[o] = (nBlocks_Handle)(uintptr_t)(&(bank[o * _blockStride]));
+            }
+            if (_exposed_available[o]) dirty |= NBLOCKS_OUTPUT_BIT(o);
+        }
+        // The other bank is written next frame, while receivers may still
+        // read this one
+        _blockBank ^= 1;
+        setDirtyOutputs(dirty);
+    }
+};
+
+
+/**
+ *  \brief Template used by nBlockSwapNode to set buffer size based on
+ *  the number of outputs.
+ */
+template <size_t swapNode_OutputSize>
+
+/**
+ *  \brief Alternative to nBlockSimpleNode for nodes with many outputs,
+ *  which publishes the outputs of a frame without copying them.
+ *  
+ *  \details Output values live in two banks. Users write the back bank
+ *  through setOutput() while connections read the front bank; step()
+ *  invokes endFrame() and then swaps the bank indices. Which outputs
+ *  were written is kept as a bitmask, so step() only touches one word
+ *  per 32 outputs instead of every output, whether written or not.
+ *    - setOutput() replaces writing output[] and available[]
+ *    - Only outputs written during the last endFrame() are available;
+ *      readOutput() of any other output returns a stale value, which
+ *      the kernel never reads since it checks outputAvailable() first
+ *    - Since the banks alternate, a value written in one frame is not
+ *      kept for the next: outputs must be written again in each frame
+ *      they should be available
+ *  
+ *  Implementation code has to be in this file (instead of nworkbench.cpp)
+ *  due to use of the template feature.
+ */
+class nBlockSwapNode: public nBlockNode {
+public:
+    /**
+     *  \brief Constructor for nBlockSwapNode, initializes both banks and
+     *  the availability masks
+     */
+    nBlockSwapNode(void) {
+        unsigned int i;
+        _front = 0;
+        for (i=0; i<swapNode_OutputSize; i++) {
+            _output[0][i] = 0;
+            _output[1][i] = 0;
+            _available[0][i] = 0;
+            _available[1][i] = 0;
+            outputType[i] = OUTPUT_TYPE_INT; // Output type defaults to integer
+        }
+        for (i=0; i<_mask_words; i++) {
+            _written[i] = 0;
+            _exposed[i] = 0;
+        }
+    }
+    
+    /**
+     *  \brief Called after kernel data is received and stored in the
+     *  kernelData private property. Same as nBlockSimpleNode::onKernelData()
+     */
+    virtual void onKernelData() { return; }
+    
+    /**
+     *  \brief Stores the received kernel data into the private
+     *  kernelData property, and invokes the onKernelData method.
+     *  
+     *  \param [in] kernel_data Struct containing data for the kernel
+     */
+    void setKernelData(nBlocks_KernelData kernel_data) {
+        kernelData = kernel_data;
+        onKernelData();
+    }
+    
+    /**
+     *  \brief Writes one output for the current frame. To be called from
+     *  endFrame(). Writing the same output again in a frame replaces
+     *  the previous value.
+     *  
+     *  \param [in] outputNumber The output number to write
+     *  \param [in] value The data (or pointer, for strings and arrays)
+     *  \param [in] availableCount Same meaning as available[] in
+     *  nBlockSimpleNode (e.g. string length). Zero retracts the output.
+     */
+    void setOutput(uint32_t outputNumber, nBlocks_Handle value, uint32_t availableCount = 1) {
+        uint32_t back = _front ^ 1;
+        _output[back][outputNumber] = value;
+        _available[back][outputNumber] = availableCount;
+        if (availableCount) _written[outputNumber >> 5] |= (1u << (outputNumber & 31));
+        else _written[outputNumber >> 5] &= ~(1u << (outputNumber & 31));
+    }
+    
+    /**
+     *  \brief Returns the number of messages available at an output
+     *  (see nBlockSimpleNode::outputAvailable() ). Reads the availability
+     *  mask first, so idle outputs cost one bit test.
+     *  
+     *  \param [in] outputNumber The output number to check for data
+     *  \return Zero if no messages available, non-zero otherwise.
+     */
+    uint32_t outputAvailable(uint32_t outputNumber) {
+        if ((_exposed[outputNumber >> 5] & (1u << (outputNumber & 31))) == 0) return 0;
+        return _available[_front][outputNumber];
+    }
+    
+    /**
+     *  \brief Returns the output type for the given output number.
+     *  
+     *  \param [in] outputNumber The output number to check for data type
+     *  \return One of the constants in the nBlocks_OutputType enum
+     */
+    nBlocks_OutputType readOutputType(uint32_t outputNumber) { return outputType[outputNumber]; }
+    
+    /**
+     *  \brief Returns the data published at the output in the last step()
+     *  
+     *  \param [in] outputNumber The output number to retrieve data from
+     *  \return The value, or the address of the payload
+     */
+    nBlocks_Handle readOutput(uint32_t outputNumber) { return _output[_front][outputNumber]; }
+    
+    /**
+     *  \brief Same as nBlockSimpleNode::endFrame(), with outputs written
+     *  through setOutput()
+     */
+    virtual void endFrame(void) { return; }
+
+    /**
+     *  \brief Invokes the user code at the endFrame() method, then swaps
+     *  the banks and publishes the mask of written outputs.
+     *  This method is called automatically by the kernel, and should not
+     *  be called manually in any circumstance.
+     */
+    void step(void) {
+        unsigned int i;
+        uint32_t overflow = 0;
+        endFrame();
+        _front ^= 1;
+        for (i=0; i<_mask_words; i++) {
+            _exposed[i] = _written[i];
+            _written[i] = 0;
+            if (i > 0) overflow |= _exposed[i];
+        }
+        // Dirty mask: one bit per output below 31, bit 31 for the rest
+        // (see NBLOCKS_OUTPUT_BIT)
+        overflow |= _exposed[0] & 0x80000000u;
+        setDirtyOutputs((_exposed[0] & 0x7FFFFFFFu) | (overflow ? 0x80000000u : 0));
+        return;
+    }
+    
+    /**
+     *  \brief Buffer holding output types. Should be written 
+     *  in constructor only. Defaults to OUTPUT_TYPE_INT
+     */
+    nBlocks_OutputType outputType[swapNode_OutputSize];
+private:
+    static const uint32_t _mask_words = (swapNode_OutputSize + 31) / 32;
+
+    /**
+     *  \brief Struct holding data received in kernel data broadcasting
+     */
+    nBlocks_KernelData kernelData;
+
+    /**
+     *  \brief Output banks. _output[_front] is exposed to connections,
+     *  the other one is written by setOutput()
+     */
+    nBlocks_Handle _output[2][swapNode_OutputSize];
+    uint32_t _available[2][swapNode_OutputSize];
+    uint32_t _front;
+
+    /**
+     *  \brief Outputs written in the current frame, and outputs
+     *  published in the last step(), one bit per output
+     */
+    uint32_t _written[_mask_words];
+    uint32_t _exposed[_mask_words];
 };
 
 
@@ -476,8 +1723,13 @@ private:
 /**
  *  \brief Class representing a connection between one output from a source 
  *  node and one input in a destination node.
- *  This class should not be derived or modified. It is just instantiated
- *  as connections as is.
+ *  This class is instantiated as is. Generated code knowing the node
+ *  classes can use nBlockTypedConnection instead.
+ *  
+ *  Connections are chained in a list as they are constructed. During
+ *  SetupWorkbench() the list is compiled into a contiguous table sorted
+ *  by source node and output number, so each output is read once per
+ *  frame and fanned out to all its destinations.
  */
 class nBlockConnection {
 public:
@@ -495,6 +1747,17 @@ public:
      */
     nBlockConnection(nBlockNode * srcBlock, uint32_t outputNumber, nBlockNode * dstBlock, uint32_t inputNumber);
     
+    /**
+     *  \brief Constructor for connections with their own transfer code
+     *  (see nBlockTypedConnection). Either function may be 0 to use the
+     *  virtual methods of the nodes.
+     *  
+     *  \param [in] read Reads the source output into a message
+     *  \param [in] deliver Delivers messages to the destination node
+     */
+    nBlockConnection(nBlockNode * srcBlock, uint32_t outputNumber, nBlockNode * dstBlock, uint32_t inputNumber,
+        nBlocks_ReadFunction read, nBlocks_DeliverFunction deliver);
+    
     /**
      *  \brief Moves data across the connection, that is, reads data
      *  from the source node using the output number, and writes it into
@@ -512,14 +1775,32 @@ public:
     void setNext(nBlockConnection * next);
 
     /**
-     *  \brief Retireves the address of the next connection in the traversing
-     *  chain (set via setNext() ).
+     *  \brief Retireves the next connection in the traversing chain (set
+     *  via setNext() ).
      *  
-     *  \return 32-bit memory address of the next connection. Has to be
-     *  externally cast as pointer
+     *  \return The next connection, 0 for the last one
      */
-    uint32_t getNext(void);
+    nBlockConnection * getNext(void);
+    
+    /** \brief Returns the source node given in the constructor */
+    nBlockNode * getSource(void) { return _srcBlock; }
+    /** \brief Returns the output number given in the constructor */
+    uint32_t getOutputNumber(void) { return _outputNumber; }
+    /** \brief Returns the destination node given in the constructor */
+    nBlockNode * getDestination(void) { return _dstBlock; }
+    /** \brief Returns the input number given in the constructor */
+    uint32_t getInputNumber(void) { return _inputNumber; }
+    /** \brief Returns the read function, 0 for the virtual methods */
+    nBlocks_ReadFunction getReadFunction(void) { return _read; }
+    /** \brief Returns the deliver function, 0 for the virtual methods */
+    nBlocks_DeliverFunction getDeliverFunction(void) { return _deliver; }
 private:
+    void init(nBlockNode * srcBlock, uint32_t outputNumber, nBlockNode * dstBlock, uint32_t inputNumber,
+        nBlocks_ReadFunction read, nBlocks_DeliverFunction deliver);
+    
+    /** Transfer functions given in the constructor, or 0 */
+    nBlocks_ReadFunction _read;
+    nBlocks_DeliverFunction _deliver;
     /** Pointer holding the source node given in the constructor */
     nBlockNode * _srcBlock;
     /** Holds the output number given in the constructor */
@@ -532,5 +1813,133 @@ private:
     nBlockConnection * _next;
 };
 
+/**
+ *  \brief Compile time type of output OutIdx of node class Node, for
+ *  nBlockTypedConnection. Unless specialized with NBLOCKS_OUTPUT_TYPE(),
+ *  the type is asked to the node at each transfer (with a direct call).
+ */
+template <typename Node, uint32_t OutIdx>
+struct nBlocks_OutputTraits {
+    static const uint32_t type = NBLOCKS_OUTPUT_TYPE_DYNAMIC;
+};
+
+/**
+ *  \brief Declares the type of an output at compile time, at global scope:
+ *  
+ *      NBLOCKS_OUTPUT_TYPE(nBlock_Counter, 0, OUTPUT_TYPE_INT);
+ *  
+ *  In block mode (KernelBlockSize() ) the INT and FLOAT outputs of
+ *  nBlockSimpleNode become OUTPUT_TYPE_INT_BLOCK / OUTPUT_TYPE_FLOAT_BLOCK,
+ *  so declare those types, or none.
+ */
+#define NBLOCKS_OUTPUT_TYPE(Node, OutIdx, OutputType) \
+    template <> struct nBlocks_OutputTraits<Node, OutIdx> { static const uint32_t type = (OutputType); }
+
+/**
+ *  \brief Keeps the messages of a nBlockSimpleNode running sample by
+ *  sample in block mode
+ *  
+ *  \return Non-zero if the messages were kept, zero if they have to be
+ *  delivered (not in block mode, or not a nBlockSimpleNode)
+ */
+template <size_t N>
+inline uint32_t nBlocks_StoreSamples(nBlockSimpleNode<N> * node, const nBlocks_Message * messages, uint32_t count) {
+    if (node->blockSamples() <= 1) return 0;
+    node->storeInputs(messages, count);
+    return 1;
+}
+
+inline uint32_t nBlocks_StoreSamples(void * node, const nBlocks_Message * messages, uint32_t count) {
+    return 0;
+}
+
+/**
+ *  \brief Tells at compile time whether Node overrides triggerInputs()
+ */
+template <typename Node>
+struct nBlocks_InputTraits {
+    // &Node::triggerInputs has type void (nBlockNode::*)(...) unless a
+    // class derived from nBlockNode declares it, and that type only
+    // matches the template overload
+    static char test(void (nBlockNode::*)(const nBlocks_Message *, uint32_t));
+    template <typename U>
+    static long test(void (U::*)(const nBlocks_Message *, uint32_t));
+    // nBlockSimpleNode::triggerInputs() only differs in block mode
+    template <size_t N>
+    static short test(void (nBlockSimpleNode<N>::*)(const nBlocks_Message *, uint32_t));
+    
+    static const bool batched = (sizeof(test(&Node::triggerInputs)) == sizeof(long));
+    
+    /**
+     *  \brief Delivers messages to a Node, calling triggerInput()
+     *  directly unless Node overrides triggerInputs() or runs sample by
+     *  sample in block mode
+     */
+    static void deliver(nBlockNode * dst, const nBlocks_Message * messages, uint32_t count) {
+        Node * node = static_cast<Node *>(dst);
+        uint32_t i;
+        
+        if (batched) node->Node::triggerInputs(messages, count);
+        else if (nBlocks_StoreSamples(node, messages, count) == 0) {
+            for (i=0; i<count; i++) node->Node::triggerInput(messages[i]);
+        }
+    }
+};
+
+/**
+ *  \brief Reads output OutIdx of a Node with direct calls, and the type
+ *  given by nBlocks_OutputTraits
+ */
+template <typename Node, uint32_t OutIdx>
+struct nBlocks_OutputReader {
+    /**
+     *  \brief Reads the output into a message, all fields but inputNumber
+     *  
+     *  \return Data available at the output; the message is only
+     *  filled if not zero
+     */
+    static uint32_t read(nBlockNode * src, nBlocks_Message * message) {
+        Node * node = static_cast<Node *>(src);
+        uint32_t type = nBlocks_OutputTraits<Node, OutIdx>::type;
+        uint32_t data_available = node->Node::outputAvailable(OutIdx);
+        
+        if (data_available == 0) return 0;
+        if (type == NBLOCKS_OUTPUT_TYPE_DYNAMIC) type = node->Node::readOutputType(OutIdx);
+        if (NBLOCKS_OUTPUT_IS_64(type)) nBlocks_FillMessage64(type, node->Node::readOutput64(OutIdx), data_available, message);
+        else nBlocks_FillMessage(type, node->Node::readOutput(OutIdx), data_available, message);
+        return data_available;
+    }
+};
+
+/**
+ *  \brief Template used by nBlockTypedConnection to set the node classes
+ *  and the output and input numbers at compile time.
+ */
+template <typename SrcNode, uint32_t OutIdx, typename DstNode, uint32_t InIdx>
+
+/**
+ *  \brief Connection resolved at compile time, for generated code:
+ *  
+ *      nBlockTypedConnection<nBlock_Counter, 0, nBlock_Gain, 0> n_conn_1(&counter, &gain);
+ *  
+ *  \details The transfer functions call the methods of SrcNode and
+ *  DstNode directly instead of through the virtual table, so the
+ *  compiler can inline the whole transfer (e.g. with nBlockSimpleNode
+ *  the output read becomes a load from the exposed buffer). The output
+ *  type is taken from nBlocks_OutputTraits, so with a specialization no
+ *  type switch is left. SrcNode and DstNode must be the actual classes
+ *  of the nodes, not base classes of them.
+ *  
+ *  The kernel handles these connections like nBlockConnection in every
+ *  other respect (ordering, batching, scheduling). Mixing both kinds in
+ *  one graph is allowed.
+ */
+class nBlockTypedConnection: public nBlockConnection {
+public:
+    nBlockTypedConnection(SrcNode * srcBlock, DstNode * dstBlock):
+        nBlockConnection(srcBlock, OutIdx, dstBlock, InIdx,
+            &nBlocks_OutputReader<SrcNode, OutIdx>::read, &nBlocks_InputTraits<DstNode>::deliver) { }
+};
+
 
 #endif